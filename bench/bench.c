@@ -0,0 +1,415 @@
+#include "divgrid.h"
+#include "search.h"
+#include <time.h>
+
+#define OP_ADD 0
+#define OP_UPDATE 1
+#define OP_DELETE 2
+#define OP_CIRCLE 3
+#define OP_RECT 4
+#define OP_SECTOR 5
+#define OP_MAX 6
+
+#define DIST_UNIFORM 0
+#define DIST_CLUSTER 1
+#define DIST_HOTSPOT 2
+#define DIST_MAX 3
+
+#define CLUSTER_CNT 8
+#define CLUSTER_SIGMA 30
+#define HOTSPOT_RADIUS 20
+#define HOTSPOT_RATIO 0.1
+#define MOVE_STEP 2
+
+static const char* op_names[OP_MAX] = {"add", "update", "delete", "search_circle", "search_rect", "search_sector"};
+static const char* dist_names[DIST_MAX] = {"uniform", "cluster", "hotspot"};
+#define BENCH_COMPACT 2 //grid backend with compact towers
+#define BENCH_MORTON 3  //grid backend with the morton tower layout
+#define BENCH_BACKEND_MAX 4
+
+static const char* backend_names[BENCH_BACKEND_MAX] = {"grid", "quadtree", "compact", "morton"};
+
+typedef struct latency {
+    uint64_t * ns;
+    int n;
+    int cap;
+    uint64_t total;
+} latency;
+
+typedef struct bench_conf {
+    int max_x;
+    int max_z;
+    int obj_cnt;
+    int op_cnt;
+    int dist;
+    int grid_size;
+    int backend;
+    float radius;
+    int mix[4]; //add,update,delete,search
+    unsigned seed;
+} bench_conf;
+
+typedef struct workload {
+    bench_conf * conf;
+    map * m;
+    uint64_t * live;
+    int live_cnt;
+    uint64_t next_id;
+    float cluster_x[CLUSTER_CNT];
+    float cluster_z[CLUSTER_CNT];
+    latency lat[OP_MAX];
+    uint64_t hits;
+} workload;
+
+static inline uint64_t
+now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline float
+rand_float(float lo, float hi) {
+    return lo + (hi - lo)*((float)rand()/((float)RAND_MAX + 1));
+}
+
+static inline float
+rand_gauss(float sigma) {
+    float u1 = rand_float(1e-6, 1);
+    float u2 = rand_float(0, 1);
+    return sigma*sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+static inline float
+clamp_pos(float v, int max) {
+    if (v < 0) {
+        return 0;
+    }
+    if (v >= max) {
+        return max - 0.01;
+    }
+    return v;
+}
+
+static void
+gen_pos(workload* w, float* x, float* z) {
+    bench_conf * conf = w->conf;
+    switch (conf->dist) {
+    case DIST_CLUSTER: {
+        int k = rand()%CLUSTER_CNT;
+        *x = w->cluster_x[k] + rand_gauss(CLUSTER_SIGMA);
+        *z = w->cluster_z[k] + rand_gauss(CLUSTER_SIGMA);
+        break;
+    }
+    case DIST_HOTSPOT:
+        if (rand_float(0, 1) < HOTSPOT_RATIO) {
+            *x = w->cluster_x[0] + rand_float(-HOTSPOT_RADIUS, HOTSPOT_RADIUS);
+            *z = w->cluster_z[0] + rand_float(-HOTSPOT_RADIUS, HOTSPOT_RADIUS);
+            break;
+        }
+        //fall through
+    default:
+        *x = rand_float(0, conf->max_x);
+        *z = rand_float(0, conf->max_z);
+        break;
+    }
+    *x = clamp_pos(*x, conf->max_x);
+    *z = clamp_pos(*z, conf->max_z);
+}
+
+static inline void
+record(latency* lat, uint64_t ns) {
+    if (lat->n == lat->cap) {
+        lat->cap = lat->cap ? lat->cap*2 : 1024;
+        lat->ns = realloc(lat->ns, lat->cap*sizeof(uint64_t));
+    }
+    lat->ns[lat->n++] = ns;
+    lat->total += ns;
+}
+
+static void
+count_hit(void* ud, object* obj) {
+    (*(uint64_t*)ud)++;
+}
+
+static void
+do_add(workload* w) {
+    float x,z;
+    gen_pos(w, &x, &z);
+    uint64_t id = w->next_id++;
+    uint64_t t0 = now_ns();
+    object * obj = map_add_object(w->m, id, x, z, rand_float(0.3, 2), 1 << (id%4));
+    record(&w->lat[OP_ADD], now_ns() - t0);
+    if (obj) {
+        w->live[w->live_cnt++] = id;
+    }
+}
+
+static void
+do_update(workload* w) {
+    if (w->live_cnt == 0) {
+        return;
+    }
+    uint64_t id = w->live[rand()%w->live_cnt];
+    object * obj = map_query_object(w->m, id);
+    float x = clamp_pos(obj->x + rand_float(-MOVE_STEP, MOVE_STEP), w->conf->max_x);
+    float z = clamp_pos(obj->z + rand_float(-MOVE_STEP, MOVE_STEP), w->conf->max_z);
+    uint64_t t0 = now_ns();
+    obj = map_query_object(w->m, id);
+    map_update_object(w->m, obj, x, z);
+    record(&w->lat[OP_UPDATE], now_ns() - t0);
+}
+
+static void
+do_delete(workload* w) {
+    if (w->live_cnt == 0) {
+        return;
+    }
+    int i = rand()%w->live_cnt;
+    uint64_t id = w->live[i];
+    w->live[i] = w->live[--w->live_cnt];
+    uint64_t t0 = now_ns();
+    map_delete_object(w->m, id);
+    record(&w->lat[OP_DELETE], now_ns() - t0);
+}
+
+static void
+do_search(workload* w) {
+    float x,z;
+    if (w->live_cnt > 0) { //searches are issued by entities
+        object * obj = map_query_object(w->m, w->live[rand()%w->live_cnt]);
+        x = obj->x;
+        z = obj->z;
+    }else {
+        gen_pos(w, &x, &z);
+    }
+    float radius = w->conf->radius;
+    float angle = rand_float(0, 2*M_PI);
+    float dir_x = cos(angle);
+    float dir_z = sin(angle);
+    int op = OP_CIRCLE + rand()%3;
+    uint64_t t0 = now_ns();
+    shape s;
+    switch (op) {
+    case OP_CIRCLE:
+        shape_circle(&s, x, z, radius);
+        break;
+    case OP_RECT:
+        shape_rect(&s, x, z, dir_x, dir_z, radius*0.5, radius);
+        break;
+    default:
+        shape_sector(&s, x, z, dir_x, dir_z, 90, radius);
+        break;
+    }
+    map_search(w->m, &s, 0, DEFAULT_LIMIT_CNT, count_hit, &w->hits);
+    record(&w->lat[op], now_ns() - t0);
+}
+
+static int
+cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static inline uint64_t
+percentile(latency* lat, double p) {
+    int i = (int)(p*(lat->n - 1));
+    return lat->ns[i];
+}
+
+static void
+report(workload* w, uint64_t elapsed) {
+    bench_conf * conf = w->conf;
+    printf("dist=%s backend=%s grid_size=%d radius=%.1f objs=%d mix=%d:%d:%d:%d ops=%d total=%.0f ops/s avg_hits=%.1f\n",
+        dist_names[conf->dist], backend_names[conf->backend], conf->grid_size, conf->radius, conf->obj_cnt,
+        conf->mix[0], conf->mix[1], conf->mix[2], conf->mix[3], conf->op_cnt,
+        conf->op_cnt/(elapsed/1e9),
+        (double)w->hits/(w->lat[OP_CIRCLE].n + w->lat[OP_RECT].n + w->lat[OP_SECTOR].n + 1e-9));
+    printf("  %-14s %10s %14s %10s %10s %10s\n", "op", "count", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+    int i;
+    for (i=0; i<OP_MAX; i++) {
+        latency * lat = &w->lat[i];
+        if (lat->n == 0) {
+            continue;
+        }
+        qsort(lat->ns, lat->n, sizeof(uint64_t), cmp_u64);
+        printf("  %-14s %10d %14.0f %10llu %10llu %10llu\n", op_names[i], lat->n,
+            lat->n/(lat->total/1e9),
+            (unsigned long long)percentile(lat, 0.5),
+            (unsigned long long)percentile(lat, 0.99),
+            (unsigned long long)percentile(lat, 0.999));
+    }
+}
+
+static void
+run(bench_conf* conf) {
+    workload w;
+    memset(&w, 0, sizeof(w));
+    w.conf = conf;
+    srand(conf->seed);
+    int i;
+    for (i=0; i<CLUSTER_CNT; i++) {
+        w.cluster_x[i] = rand_float(0.1*conf->max_x, 0.9*conf->max_x);
+        w.cluster_z[i] = rand_float(0.1*conf->max_z, 0.9*conf->max_z);
+    }
+    w.m = map_new(conf->max_x, conf->max_z, conf->grid_size);
+    if (conf->backend == BENCH_COMPACT) {
+        map_set_compact(w.m, true);
+    }else if (conf->backend == BENCH_MORTON) {
+        map_set_layout(w.m, LAYOUT_MORTON);
+    }else {
+        map_set_backend(w.m, conf->backend);
+    }
+    w.live = malloc((conf->obj_cnt + conf->op_cnt)*sizeof(uint64_t));
+    w.next_id = 1;
+    for (i=0; i<conf->obj_cnt; i++) {
+        do_add(&w);
+    }
+    for (i=0; i<OP_MAX; i++) { //population is not measured
+        free(w.lat[i].ns);
+    }
+    memset(w.lat, 0, sizeof(w.lat));
+
+    int total_mix = conf->mix[0] + conf->mix[1] + conf->mix[2] + conf->mix[3];
+    uint64_t t0 = now_ns();
+    for (i=0; i<conf->op_cnt; i++) {
+        int k = rand()%total_mix;
+        if (k < conf->mix[0]) {
+            do_add(&w);
+        }else if (k < conf->mix[0] + conf->mix[1]) {
+            do_update(&w);
+        }else if (k < conf->mix[0] + conf->mix[1] + conf->mix[2]) {
+            do_delete(&w);
+        }else {
+            do_search(&w);
+        }
+    }
+    report(&w, now_ns() - t0);
+    for (i=0; i<OP_MAX; i++) {
+        free(w.lat[i].ns);
+    }
+    free(w.live);
+    map_delete(w.m);
+}
+
+static int
+parse_list(const char* s, float* out, int max) {
+    int n = 0;
+    char * end;
+    while (*s && n < max) {
+        out[n++] = strtof(s, &end);
+        if (end == s) {
+            break;
+        }
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static void
+usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [-d uniform|cluster|hotspot|all] [-b grid|quadtree|compact|morton|all] [-g grid_sizes] [-r radii]\n"
+        "          [-n objs] [-o ops] [-m add:update:delete:search] [-w width] [-s seed]\n"
+        "  e.g. %s -d cluster -g 5,10,20 -r 10,30 -m 5:60:5:30\n", name, name);
+}
+
+int
+main(int argc, char** argv) {
+    bench_conf conf;
+    conf.max_x = conf.max_z = 1000;
+    conf.obj_cnt = 20000;
+    conf.op_cnt = 100000;
+    conf.mix[0] = 5;
+    conf.mix[1] = 60;
+    conf.mix[2] = 5;
+    conf.mix[3] = 30;
+    conf.seed = 20180101;
+    int dist = -1;
+    int backend = BACKEND_GRID;
+    float grid_sizes[16] = {5, 10, 20, 40};
+    int grid_cnt = 4;
+    float radii[16] = {5, 15, 40};
+    int radius_cnt = 3;
+    int i,j,k,b;
+    for (i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' || arg[1] == 0 || arg[2] != 0 || i+1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* val = argv[++i];
+        switch (arg[1]) {
+        case 'd':
+            for (dist=DIST_MAX-1; dist>=0; dist--) {
+                if (strcmp(val, dist_names[dist]) == 0) {
+                    break;
+                }
+            }
+            if (dist < 0 && strcmp(val, "all") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            for (backend=BENCH_BACKEND_MAX-1; backend>=0; backend--) {
+                if (strcmp(val, backend_names[backend]) == 0) {
+                    break;
+                }
+            }
+            if (backend < 0 && strcmp(val, "all") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g':
+            grid_cnt = parse_list(val, grid_sizes, 16);
+            break;
+        case 'r':
+            radius_cnt = parse_list(val, radii, 16);
+            break;
+        case 'n':
+            conf.obj_cnt = atoi(val);
+            break;
+        case 'o':
+            conf.op_cnt = atoi(val);
+            break;
+        case 'm':
+            if (sscanf(val, "%d:%d:%d:%d", &conf.mix[0], &conf.mix[1], &conf.mix[2], &conf.mix[3]) != 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            conf.max_x = conf.max_z = atoi(val);
+            break;
+        case 's':
+            conf.seed = atoi(val);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (k=0; k<DIST_MAX; k++) {
+        if (dist >= 0 && dist != k) {
+            continue;
+        }
+        conf.dist = k;
+        for (b=0; b<BENCH_BACKEND_MAX; b++) {
+            if (backend >= 0 && backend != b) {
+                continue;
+            }
+            conf.backend = b;
+            for (i=0; i<grid_cnt; i++) {
+                for (j=0; j<radius_cnt; j++) {
+                    conf.grid_size = grid_sizes[i];
+                    conf.radius = radii[j];
+                    run(&conf);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+package.cpath = package.cpath .. ";./build/?.so"
+local areasearch = require "areasearch"
+local random = math.random
+local sqrt = math.sqrt
+local log = math.log
+local cos = math.cos
+local sin = math.sin
+local pi = math.pi
+local clock = os.clock
+local sfmt = string.format
+
+-- usage: bin/lua bench/bench.lua [dist] [grid_size] [radius] [objs] [ops]
+-- measures the same workloads as bench/bench.c through the Lua binding,
+-- compare ops/s per op with the C harness to get the Lua crossing overhead
+local dist = arg[1] or "all"
+local grid_sizes = {tonumber(arg[2]) or 10}
+local radii = {tonumber(arg[3]) or 15}
+local obj_cnt = tonumber(arg[4]) or 20000
+local op_cnt = tonumber(arg[5]) or 100000
+local max_x, max_z = 1000, 1000
+local CLUSTER_CNT = 8
+local CLUSTER_SIGMA = 30
+local HOTSPOT_RADIUS = 20
+local HOTSPOT_RATIO = 0.1
+local MOVE_STEP = 2
+
+local function rand_float(lo, hi)
+    return lo + (hi - lo)*random()
+end
+
+local function rand_gauss(sigma)
+    local u1 = rand_float(1e-6, 1)
+    local u2 = random()
+    return sigma*sqrt(-2*log(u1))*cos(2*pi*u2)
+end
+
+local function clamp_pos(v, max)
+    if v < 0 then
+        return 0
+    elseif v >= max then
+        return max - 0.01
+    end
+    return v
+end
+
+local function make_gen(dist_name)
+    local cx, cz = {}, {}
+    for i = 1, CLUSTER_CNT do
+        cx[i] = rand_float(0.1*max_x, 0.9*max_x)
+        cz[i] = rand_float(0.1*max_z, 0.9*max_z)
+    end
+    return function()
+        local x, z
+        if dist_name == "cluster" then
+            local k = random(CLUSTER_CNT)
+            x, z = cx[k] + rand_gauss(CLUSTER_SIGMA), cz[k] + rand_gauss(CLUSTER_SIGMA)
+        elseif dist_name == "hotspot" and random() < HOTSPOT_RATIO then
+            x = cx[1] + rand_float(-HOTSPOT_RADIUS, HOTSPOT_RADIUS)
+            z = cz[1] + rand_float(-HOTSPOT_RADIUS, HOTSPOT_RADIUS)
+        else
+            x, z = rand_float(0, max_x), rand_float(0, max_z)
+        end
+        return clamp_pos(x, max_x), clamp_pos(z, max_z)
+    end
+end
+
+local function report(name, cnt, elapsed)
+    print(sfmt("  %-14s %10d %14.0f", name, cnt, cnt/elapsed))
+end
+
+local function run(dist_name, grid_size, radius)
+    math.randomseed(20180101)
+    local gen = make_gen(dist_name)
+    local areaobj = areasearch.create(max_x, max_z, grid_size)
+    local pos_x, pos_z = {}, {}
+    for id = 1, obj_cnt do
+        local x, z = gen()
+        areaobj:add(id, x, z, rand_float(0.3, 2), 1 << (id%4))
+        pos_x[id], pos_z[id] = x, z
+    end
+    print(sfmt("dist=%s grid_size=%d radius=%.1f objs=%d ops=%d (lua binding)", dist_name, grid_size, radius, obj_cnt, op_cnt))
+    print(sfmt("  %-14s %10s %14s", "op", "count", "ops/s"))
+
+    local ids, nx, nz = {}, {}, {}
+    for i = 1, op_cnt do
+        local id = random(obj_cnt)
+        ids[i] = id
+        nx[i] = clamp_pos(pos_x[id] + rand_float(-MOVE_STEP, MOVE_STEP), max_x)
+        nz[i] = clamp_pos(pos_z[id] + rand_float(-MOVE_STEP, MOVE_STEP), max_z)
+    end
+    local t0 = clock()
+    for i = 1, op_cnt do
+        areaobj:update(ids[i], nx[i], nz[i])
+    end
+    report("update", op_cnt, clock() - t0)
+
+    local dx, dz = {}, {}
+    for i = 1, op_cnt do
+        local angle = rand_float(0, 2*pi)
+        dx[i], dz[i] = cos(angle), sin(angle)
+    end
+    local search_cnt = op_cnt//3
+    t0 = clock()
+    for i = 1, search_cnt do
+        areaobj:search_circle_range_objs(nx[i], nz[i], radius)
+    end
+    report("search_circle", search_cnt, clock() - t0)
+    t0 = clock()
+    for i = 1, search_cnt do
+        areaobj:search_rect_range_objs(nx[i], nz[i], dx[i], dz[i], radius*0.5, radius)
+    end
+    report("search_rect", search_cnt, clock() - t0)
+    t0 = clock()
+    for i = 1, search_cnt do
+        areaobj:search_sector_range_objs(nx[i], nz[i], dx[i], dz[i], 90, radius)
+    end
+    report("search_sector", search_cnt, clock() - t0)
+
+    local del_cnt = obj_cnt//2
+    t0 = clock()
+    for id = 1, del_cnt do
+        areaobj:delete(id)
+    end
+    report("delete", del_cnt, clock() - t0)
+    t0 = clock()
+    for id = 1, del_cnt do
+        local x, z = gen()
+        areaobj:add(id, x, z, 1, 0)
+    end
+    report("add", del_cnt, clock() - t0)
+end
+
+for _, dist_name in ipairs({"uniform", "cluster", "hotspot"}) do
+    if dist == "all" or dist == dist_name then
+        for _, grid_size in ipairs(grid_sizes) do
+            for _, radius in ipairs(radii) do
+                run(dist_name, grid_size, radius)
+            end
+        end
+    end
+end
@@ -0,0 +1,33 @@
+#!/bin/sh
+# usage: bench/report.sh "<bench args>" name=path/to/bench ...
+# runs every bench binary on the same workload and prints ops/s per op side by side
+args="$1"
+shift
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+names=""
+for variant in "$@"; do
+    name=${variant%%=*}
+    bin=${variant#*=}
+    names="$names $name"
+    $bin $args > "$tmp/$name.txt" || exit 1
+done
+for dist in uniform cluster hotspot; do
+    echo "dist=$dist args: $args"
+    printf "  %-14s" "ops/s"
+    for name in $names; do
+        printf " %12s" "$name"
+    done
+    echo
+    for op in add update delete search_circle search_rect search_sector; do
+        printf "  %-14s" "$op"
+        for name in $names; do
+            awk -v d="dist=$dist" -v op="$op" '
+                $1 == d { found = 1; next }
+                /^dist=/ { found = 0 }
+                found && $1 == op { printf " %12.0f", $3; exit }
+            ' "$tmp/$name.txt"
+        done
+        echo
+    done
+done
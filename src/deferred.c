@@ -0,0 +1,128 @@
+#include "deferred.h"
+
+#define DEFERRED_PRE_ALLOC 64
+
+static inline int
+index_slot(deferred* d, object* obj) {
+    uint64_t h = (uint64_t)(uintptr_t)obj*0x9e3779b97f4a7c15ULL;
+    return (int)(h >> 32) & (d->index_size - 1);
+}
+
+static pending_move *
+find_move(deferred* d, object* obj) {
+    int i = index_slot(d, obj);
+    while (d->index[i]) {
+        pending_move * mv = &d->moves[d->index[i] - 1];
+        if (mv->obj == obj) {
+            return mv;
+        }
+        i = (i + 1) & (d->index_size - 1);
+    }
+    return NULL;
+}
+
+static void
+index_move(deferred* d, int n) {
+    int i = index_slot(d, d->moves[n].obj);
+    while (d->index[i]) {
+        i = (i + 1) & (d->index_size - 1);
+    }
+    d->index[i] = n + 1;
+}
+
+deferred*
+deferred_new(void) {
+    deferred * d = calloc(1, sizeof(*d));
+    d->cap = DEFERRED_PRE_ALLOC;
+    d->moves = malloc(d->cap*sizeof(pending_move));
+    d->index_size = DEFERRED_PRE_ALLOC*2;
+    d->index = calloc(d->index_size, sizeof(int));
+    return d;
+}
+
+void
+deferred_delete(deferred* d) {
+    free(d->moves);
+    free(d->index);
+    free(d);
+}
+
+//records the latest position of obj, 0 when it is outside the map like map_update_object
+int
+deferred_move(map* m, object* obj, float x, float z) {
+    deferred * d = m->deferred;
+    int row = z/m->grid_size;
+    int col = x/m->grid_size;
+    if (!(row >= 0 && row < m->max_row && col >= 0 && col < m->max_col)) {
+        return 0;
+    }
+    pending_move * mv = find_move(d, obj);
+    if (mv) {
+        d->coalesced++;
+    }else {
+        if (obj->x == x && obj->z == z) {
+            return 1;
+        }
+        if (d->cnt >= d->cap) {
+            d->cap *= 2;
+            d->moves = realloc(d->moves, d->cap*sizeof(pending_move));
+        }
+        if ((d->cnt + 1)*2 > d->index_size) { //deleted entries keep their slot until the commit
+            d->index_size *= 2;
+            free(d->index);
+            d->index = calloc(d->index_size, sizeof(int));
+            int i;
+            for (i=0; i<d->cnt; i++) {
+                index_move(d, i);
+            }
+        }
+        mv = &d->moves[d->cnt];
+        mv->obj = obj;
+        index_move(d, d->cnt++);
+    }
+    mv->x = x;
+    mv->z = z;
+    mv->tower = m->qt ? 0 : tower_index(m, row, col);
+    return 1;
+}
+
+//obj is deleted or moved right away, its pending position is obsolete
+void
+deferred_drop(deferred* d, object* obj) {
+    pending_move * mv = find_move(d, obj);
+    if (mv) {
+        mv->obj = NULL;
+    }
+}
+
+static int
+cmp_move(const void* a, const void* b) {
+    int ta = ((const pending_move *)a)->tower;
+    int tb = ((const pending_move *)b)->tower;
+    return (ta > tb) - (ta < tb);
+}
+
+//applies every pending move, the ones bound for the same tower back to back, returns how many
+int
+deferred_commit(map* m) {
+    deferred * d = m->deferred;
+    int cnt = d->cnt;
+    if (cnt == 0) {
+        return 0;
+    }
+    //the index is cleared first, map_update_object drops nothing while the moves are applied
+    d->cnt = 0;
+    memset(d->index, 0, d->index_size*sizeof(int));
+    qsort(d->moves, cnt, sizeof(pending_move), cmp_move);
+    int n = 0;
+    int i;
+    for (i=0; i<cnt; i++) {
+        pending_move * mv = &d->moves[i];
+        if (mv->obj) {
+            map_update_object(m, mv->obj, mv->x, mv->z);
+            n++;
+        }
+    }
+    d->committed += n;
+    return n;
+}
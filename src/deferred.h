@@ -0,0 +1,30 @@
+#ifndef _DEFERRED_H
+#define _DEFERRED_H
+#include "divgrid.h"
+
+//deferred position updates: a move only records the latest position of the object, searches keep
+//seeing the committed towers until deferred_commit applies every recorded move, sorted by destination tower
+typedef struct pending_move {
+    object * obj; //NULL once the object is deleted before the commit
+    float x;
+    float z;
+    int tower; //tower_index of the destination, sort key of the commit
+} pending_move;
+
+typedef struct deferred {
+    pending_move * moves;
+    int cnt;
+    int cap;
+    int * index; //open addressing by object, index+1 into moves, 0 when empty
+    int index_size;
+    uint64_t committed; //moves applied since the deferred mode was turned on
+    uint64_t coalesced; //moves that replaced a pending one
+} deferred;
+
+deferred* deferred_new(void);
+void deferred_delete(deferred*);
+int deferred_move(map*, object*, float, float);
+void deferred_drop(deferred*, object*);
+int deferred_commit(map*);
+
+#endif
@@ -1,17 +1,57 @@
 #include "divgrid.h"
+#include "quadtree.h"
+#include "journal.h"
+#include "deferred.h"
+#include "trigger.h"
+#include "qcache.h"
 
 #define INVALID_ID (~0)
 #define PRE_ALLOC 2
+#define OBJECT_CHUNK_CNT 256
+#define ADVICE_MAX_CELLS (1<<22)
+#define ADVICE_TOWER_COST 2.0 //a tower visit costs about two object tests
+
+static object_chunk *
+new_chunk(map * m, int cnt) {
+    object_chunk * c = malloc(sizeof(*c) + cnt*sizeof(object));
+    c->cnt = cnt;
+    c->next = m->chunks;
+    m->chunks = c;
+    return c;
+}
+
+//a block of cnt contiguous objects owned by the map, they go back to the free list one by one
+object *
+map_alloc_objects(map * m, int cnt) {
+    return new_chunk(m, cnt > 0 ? cnt : 1)->objs;
+}
+
+static inline void
+free_object(map * m, object * obj) {
+    obj->pNext = m->free_objs;
+    m->free_objs = obj;
+}
 
 static object *
 new_object(map * m, uint64_t id) {
-    object * obj = malloc(sizeof(*obj));
+    if (!m->free_objs) {
+        object_chunk * c = new_chunk(m, OBJECT_CHUNK_CNT);
+        int i;
+        for (i=c->cnt-1; i>=0; i--) {
+            free_object(m, &c->objs[i]);
+        }
+    }
+    object * obj = m->free_objs;
+    m->free_objs = obj->pNext;
     obj->id = id;
     obj->pTower = NULL;
     obj->pPrev = NULL;
     obj->pNext = NULL;
     obj->radius = 0;
     obj->type = 0;
+    obj->motion = -1;
+    obj->handle = -1;
+    memset(obj->attr, 0, sizeof(obj->attr));
     return obj;
 }
 
@@ -68,6 +108,7 @@ rehash(map * m) {
     int old_size = m->size;
     m->size = 2 * old_size;
     m->lastfree = m->size - 1;
+    STAT_INC(m, rehashes);
     m->slot_list = malloc(m->size * sizeof(slot));
     int i;
     for (i=0;i<m->size;i++) {
@@ -86,46 +127,188 @@ rehash(map * m) {
     free(old_slot);
 }
 
+static void
+free_tower(map * m, tower * t) {
+    free(t->pHead);
+    free(t->packed);
+    free(t->refs);
+    if (!m->tower_block) {
+        free(t);
+    }
+}
+
+//frees every tower, then sizes tower_list for the current grid and layout
+static void
+reset_towers(map * m) {
+    int i;
+    m->version++;
+    if (m->tower_list) {
+        for (i=0; i<m->tower_cap; i++) {
+            if (m->tower_list[i]) {
+                free_tower(m, m->tower_list[i]);
+            }
+        }
+    }
+    free(m->tower_list);
+    free(m->tower_block);
+    m->tower_block = NULL;
+    if (m->layout == LAYOUT_MORTON) {
+        int tile_rows = (m->max_row + (1<<TILE_BITS) - 1)>>TILE_BITS;
+        m->tile_cols = (m->max_col + (1<<TILE_BITS) - 1)>>TILE_BITS;
+        m->tower_cap = (tile_rows*m->tile_cols)<<(2*TILE_BITS);
+        m->tower_block = malloc(m->tower_cap*sizeof(tower));
+    }else {
+        m->tile_cols = 0;
+        m->tower_cap = m->max_row*m->max_col;
+    }
+    m->tower_list = calloc(m->tower_cap, sizeof(tower *));
+    if (m->cache) {
+        qcache_clear(m->cache);
+    }
+    if (m->change_log) { //the cells of the entries are gone
+        m->change_log->cnt = 0;
+        m->change_log->head = 0;
+        m->change_log->floor = m->change_seq;
+    }
+}
+
+//the change log keeps one entry per change, a change right after one to the same tower replaces it
+static inline void
+touch_tower(map * m, tower * t) {
+    t->version = ++m->change_seq;
+    change_log * log = m->change_log;
+    if (!log) {
+        return;
+    }
+    int cell = t->row*m->max_col + t->col;
+    if (log->cnt > 0) {
+        change_entry * last = &log->entries[(log->head + log->cap - 1) % log->cap];
+        if (last->cell == cell) {
+            last->version = t->version;
+            return;
+        }
+    }
+    if (log->cnt == log->cap) {
+        log->floor = log->entries[log->head].version; //overwrites the oldest
+    }else {
+        log->cnt++;
+    }
+    log->entries[log->head].version = t->version;
+    log->entries[log->head].cell = cell;
+    log->head = (log->head + 1) % log->cap;
+}
+
 inline tower *
 get_tower(map * m, int row, int col, bool creat_when_null) {
     if (!(row >= 0 && row < m->max_row && col >= 0 && col < m->max_col)) {
         return NULL;
     }
-    int index = row*m->max_col + col;
-    assert(index < (m->max_row*m->max_col));
+    int index = tower_index(m, row, col);
+    assert(index < m->tower_cap);
     if (m->tower_list[index] == NULL) {
         if (!creat_when_null) {
             return NULL;
         }
-        tower * t = malloc(sizeof(*t));
+        tower * t = m->tower_block ? &m->tower_block[index] : malloc(sizeof(*t));
         t->row = row;
         t->col = col;
         t->cx = (col+0.5)*m->grid_size;
         t->cz = (row+0.5)*m->grid_size;
-        t->pHead = malloc(sizeof(object));
-        t->pHead->pNext = t->pHead;
-        t->pHead->pPrev = t->pHead;
+        t->packed = NULL;
+        t->refs = NULL;
+        t->cnt = 0;
+        t->cap = 0;
+        touch_tower(m, t);
+        if (m->compact) {
+            t->pHead = NULL;
+        }else {
+            t->pHead = malloc(sizeof(object));
+            t->pHead->pNext = t->pHead;
+            t->pHead->pPrev = t->pHead;
+        }
         m->tower_list[index] = t;
     }
     return m->tower_list[index];
 };
 
+static inline uint16_t
+pack_pos(float v, float corner, float grid_size, bool* wide) {
+    float q = (v - corner)*(PACKED_POS_UNITS/grid_size);
+    if (q < 0 || q > PACKED_POS_UNITS - 1) { //outside its tower, clamped into the border one
+        *wide = true;
+        return 0;
+    }
+    return (uint16_t)(q + 0.5f);
+}
+
+static void
+pack_object(map* m, tower* t, object* obj) {
+    packed_obj * p = &t->packed[obj->cidx];
+    float g = m->grid_size;
+    bool wide = false;
+    p->x = pack_pos(obj->x, t->cx - g*0.5f, g, &wide);
+    p->z = pack_pos(obj->z, t->cz - g*0.5f, g, &wide);
+    float r = ceilf(obj->radius*(PACKED_RADIUS_UNITS/g));
+    //a moving object is tested at its extrapolated position, never on the packed one
+    p->radius = (wide || obj->motion >= 0 || !(r >= 0 && r < PACKED_WIDE)) ? PACKED_WIDE : (uint16_t)r;
+    p->type = (obj->type >= 0 && obj->type < PACKED_WIDE) ? (uint16_t)obj->type : PACKED_WIDE;
+}
+
 void
-insert_obj_to_tower(tower* t, object* obj) {
+insert_obj_to_tower(map* m, tower* t, object* obj) {
+    m->version++;
+    touch_tower(m, t);
+    obj->pTower = t;
+    if (!t->pHead) {
+        if (t->cnt >= t->cap) {
+            t->cap = t->cap ? t->cap*2 : 4;
+            t->packed = realloc(t->packed, t->cap*sizeof(packed_obj));
+            t->refs = realloc(t->refs, t->cap*sizeof(object*));
+        }
+        obj->pNext = NULL;
+        obj->cidx = t->cnt++;
+        t->refs[obj->cidx] = obj;
+        pack_object(m, t, obj);
+        return;
+    }
     obj->pNext = t->pHead->pNext;
     obj->pPrev = t->pHead;
     obj->pNext->pPrev = obj;
     obj->pPrev->pNext = obj;
-    obj->pTower = t;
 }
 
 void
-delete_obj_from_tower(tower* t, object* obj) {
+delete_obj_from_tower(map* m, tower* t, object* obj) {
+    m->version++;
+    touch_tower(m, t);
+    obj->pTower = NULL;
+    if (!t->pHead) {
+        int last = --t->cnt;
+        if (obj->cidx != last) {
+            object * moved = t->refs[last];
+            t->refs[obj->cidx] = moved;
+            t->packed[obj->cidx] = t->packed[last];
+            moved->cidx = obj->cidx;
+        }
+        obj->cidx = 0;
+        return;
+    }
     obj->pNext->pPrev = obj->pPrev;
     obj->pPrev->pNext = obj->pNext;
     obj->pPrev = NULL;
     obj->pNext = NULL;
-    obj->pTower = NULL;
+}
+
+//a compact tower mirrors position, radius and type, refresh it after any of them changes in place;
+//the tower version moves on in either layout
+static inline void
+repack_object(map* m, object* obj) {
+    if (!m->qt && obj->pTower) { //pNode shares the field on the quadtree backend
+        touch_tower(m, obj->pTower);
+        if (m->compact) {
+            pack_object(m, obj->pTower, obj);
+        }
+    }
 }
 
 
@@ -152,37 +335,270 @@ map_init_object(map * m, uint64_t id){
 object *
 map_query_object(map * m, uint64_t id){
     slot *s = mainposition(m, id);
+    int probes = 1;
     for (;;) {
         if (s->id == id) {
-            return s->obj;
+            break;
         }
         if (s->next < 0) {
-            return NULL;
+            break;
         }
         s=&m->slot_list[s->next];
+        probes++;
     }
+    STAT_INC(m, hash_lookups);
+    STAT_ADD(m, hash_probes, probes);
+    STAT_MAX(m, max_probe_len, probes);
+    return (s->id == id) ? s->obj : NULL;
+}
+
+static inline bool
+is_valid_cell(map* m, int row, int col) {
+    return row >= 0 && row < m->max_row && col >= 0 && col < m->max_col;
 }
 
 int
 map_update_object(map* m, object* obj, float x, float z){
+    if (m->deferred) {
+        deferred_drop(m->deferred, obj);
+    }
     if (obj->x == x && obj->z == z) {
         return 1;
     }
     int new_row = z/m->grid_size;
     int new_col = x/m->grid_size;
+    float old_x = obj->x;
+    float old_z = obj->z;
+    if (m->qt) {
+        if (!is_valid_cell(m, new_row, new_col)) {
+            return 0;
+        }
+        if (m->journal) {
+            journal_move(m->journal, obj);
+        }
+        m->version++;
+        qtree_update(m->qt, obj, x, z);
+        if (m->triggers) {
+            trigger_move(m, obj, old_x, old_z);
+        }
+        return 1;
+    }
     tower* new_t = get_tower(m, new_row, new_col, true);
     if (!new_t) {
         return 0;
     }
+    if (m->journal) {
+        journal_move(m->journal, obj);
+    }
     obj->x = x;
     obj->z = z;
     if (obj->pTower != new_t){
-        delete_obj_from_tower(obj->pTower, obj);
-        insert_obj_to_tower(new_t, obj);
+        delete_obj_from_tower(m, obj->pTower, obj);
+        insert_obj_to_tower(m, new_t, obj);
+    }else {
+        repack_object(m, obj);
+    }
+    if (m->triggers) {
+        trigger_move(m, obj, old_x, old_z);
+    }
+    return 1;
+}
+
+static void
+set_object_radius(map* m, object* obj, float radius){
+    if (m->qt && obj->pNode && radius != obj->radius) { //a larger circle may not fit its node any more
+        m->version++;
+        qtree_remove(m->qt, obj);
+        obj->radius = radius;
+        qtree_insert(m->qt, obj);
+    }
+    obj->radius = radius;
+    repack_object(m, obj);
+    if (radius > m->extra_check_grids*m->grid_size) {
+        m->extra_check_grids = ceil(radius/m->grid_size);
+    }
+}
+
+object *
+map_add_object(map* m, uint64_t id, float x, float z, float radius, int type){
+    if (map_query_object(m, id)) {
+        return NULL;
+    }
+    int row = z/m->grid_size;
+    int col = x/m->grid_size;
+    tower *t = NULL;
+    if (m->qt) {
+        if (!is_valid_cell(m, row, col)) {
+            return NULL;
+        }
+    }else {
+        t = get_tower(m, row, col, true);
+        if (!t) {
+            return NULL;
+        }
+    }
+    object * obj = map_init_object(m, id);
+    obj->x = x;
+    obj->z = z;
+    obj->type = type;
+    set_object_radius(m, obj, radius);
+    if (m->qt) {
+        m->version++;
+        qtree_insert(m->qt, obj);
+    }else {
+        insert_obj_to_tower(m, t, obj);
+    }
+    if (m->journal) {
+        journal_add(m->journal, obj);
+    }
+    if (m->triggers) {
+        trigger_insert(m, obj);
+    }
+    return obj;
+}
+
+void
+map_set_object_radius(map* m, object* obj, float radius){
+    if (radius == obj->radius) {
+        return;
+    }
+    set_object_radius(m, obj, radius);
+    if (m->journal) {
+        journal_radius(m->journal, obj);
+    }
+}
+
+void
+map_set_object_type(map* m, object* obj, int type){
+    if (type == obj->type) {
+        return;
+    }
+    int old_type = obj->type;
+    obj->type = type;
+    repack_object(m, obj);
+    if (m->triggers) {
+        trigger_retype(m, obj, old_type);
+    }
+    if (m->journal) {
+        journal_type(m->journal, obj);
+    }
+}
+
+static void
+remove_motion(map* m, object* obj) {
+    int i = obj->motion;
+    if (i != --m->motion_cnt) {
+        m->motions[i] = m->motions[m->motion_cnt];
+        m->motions[i].obj->motion = i;
+    }
+    obj->motion = -1;
+}
+
+//velocity in units per time unit of map_advance, 0,0 stops the object, grid backend only
+int
+map_set_object_velocity(map* m, object* obj, float vx, float vz){
+    if (m->qt) {
+        return 0;
+    }
+    if (vx == 0 && vz == 0) {
+        if (obj->motion >= 0) {
+            remove_motion(m, obj);
+            repack_object(m, obj);
+        }
+        return 1;
+    }
+    if (obj->motion < 0) {
+        if (m->motion_cnt >= m->motion_cap) {
+            m->motion_cap = m->motion_cap ? m->motion_cap*2 : 16;
+            m->motions = realloc(m->motions, m->motion_cap*sizeof(motion));
+        }
+        obj->motion = m->motion_cnt++;
+        m->motions[obj->motion].obj = obj;
+        repack_object(m, obj);
+    }
+    motion * mv = &m->motions[obj->motion];
+    mv->vx = vx;
+    mv->vz = vz;
+    float speed = sqrtf(vx*vx + vz*vz);
+    if (speed > m->max_speed) {
+        m->max_speed = speed;
     }
     return 1;
 }
 
+//moves the clock to t and every moving object to its position at t, only the ones that leave
+//their tower are relinked; an object whose path leaves the map stops, returns how many stopped
+int
+map_advance(map* m, double t){
+    map_commit(m);
+    float dt = t - m->now;
+    m->now = t;
+    if (dt == 0) {
+        return 0;
+    }
+    int stopped = 0;
+    float max_speed = 0;
+    int i = 0;
+    while (i < m->motion_cnt) {
+        motion * mv = &m->motions[i];
+        object * obj = mv->obj;
+        if (!map_update_object(m, obj, obj->x + mv->vx*dt, obj->z + mv->vz*dt)) {
+            remove_motion(m, obj); //the last motion moved into i
+            repack_object(m, obj);
+            stopped++;
+            continue;
+        }
+        float speed = sqrtf(mv->vx*mv->vx + mv->vz*mv->vz);
+        if (speed > max_speed) {
+            max_speed = speed;
+        }
+        i++;
+    }
+    m->max_speed = max_speed;
+    return stopped;
+}
+
+//stable integer for obj, resolved by map_handle_object without the id index
+uint64_t
+map_object_handle(map* m, object* obj){
+    if (obj->handle < 0) {
+        int i = m->free_handle;
+        if (i >= 0) {
+            m->free_handle = m->handles[i].next_free;
+        }else {
+            if (m->handle_cnt >= m->handle_cap) {
+                m->handle_cap = m->handle_cap ? m->handle_cap*2 : 64;
+                m->handles = realloc(m->handles, m->handle_cap*sizeof(handle_slot));
+            }
+            i = m->handle_cnt++;
+            m->handles[i].gen = 1;
+        }
+        m->handles[i].obj = obj;
+        m->handles[i].next_free = -1;
+        obj->handle = i;
+    }
+    return (uint64_t)m->handles[obj->handle].gen<<32 | (uint32_t)obj->handle;
+}
+
+object *
+map_handle_object(map* m, uint64_t h){
+    uint32_t i = (uint32_t)h;
+    if (i >= (uint32_t)m->handle_cnt || m->handles[i].gen != (uint32_t)(h>>32)) {
+        return NULL;
+    }
+    return m->handles[i].obj;
+}
+
+static void
+release_handle(map* m, object* obj) {
+    handle_slot * hs = &m->handles[obj->handle];
+    hs->obj = NULL;
+    hs->gen = hs->gen + 1 ? hs->gen + 1 : 1; //0 is never a live generation
+    hs->next_free = m->free_handle;
+    m->free_handle = obj->handle;
+    obj->handle = -1;
+}
+
 object *
 map_delete_object(map *m, uint64_t id){
     int hash = id & (m->size-1);
@@ -191,8 +607,28 @@ map_delete_object(map *m, uint64_t id){
         if (s->id == id) {
             object * obj = s->obj;
             s->obj = NULL;
-            delete_obj_from_tower(obj->pTower, obj);
-            free(obj);
+            if (m->journal) {
+                journal_remove(m->journal, id);
+            }
+            if (m->deferred) {
+                deferred_drop(m->deferred, obj);
+            }
+            if (obj->motion >= 0) {
+                remove_motion(m, obj);
+            }
+            if (obj->handle >= 0) {
+                release_handle(m, obj);
+            }
+            if (m->triggers) {
+                trigger_erase(m, obj);
+            }
+            if (m->qt) {
+                m->version++;
+                qtree_remove(m->qt, obj);
+            }else {
+                delete_obj_from_tower(m, obj->pTower, obj);
+            }
+            free_object(m, obj);
             return obj;
         }
         if (s->next < 0) {
@@ -202,6 +638,414 @@ map_delete_object(map *m, uint64_t id){
     }
 }
 
+int
+map_set_backend(map* m, int backend){
+    if (map_object_count(m) > 0 || (backend == BACKEND_QUADTREE && (m->compact || m->layout != LAYOUT_ROW))) {
+        return 0;
+    }
+    if (backend == BACKEND_QUADTREE && !m->qt) {
+        m->qt = qtree_new(m);
+    }else if (backend == BACKEND_GRID && m->qt) {
+        qtree_delete(m->qt);
+        m->qt = NULL;
+    }
+    return 1;
+}
+
+int
+map_set_compact(map* m, bool compact){
+    if (map_object_count(m) > 0 || (compact && m->qt)) {
+        return 0;
+    }
+    m->compact = compact;
+    reset_towers(m); //empty towers are rebuilt in the new layout
+    return 1;
+}
+
+int
+map_set_layout(map* m, int layout){
+    if (map_object_count(m) > 0 || m->qt || (layout != LAYOUT_ROW && layout != LAYOUT_MORTON)) {
+        return 0;
+    }
+    m->layout = layout;
+    reset_towers(m);
+    return 1;
+}
+
+//deferred: map_update_object callers may record moves with deferred_move and apply them with map_commit,
+//turning it off commits what is pending
+void
+map_set_deferred(map* m, bool on){
+    if (on && !m->deferred) {
+        m->deferred = deferred_new();
+    }else if (!on && m->deferred) {
+        map_commit(m);
+        deferred_delete(m->deferred);
+        m->deferred = NULL;
+    }
+}
+
+int
+map_commit(map* m){
+    return m->deferred ? deferred_commit(m) : 0;
+}
+
+//search result cache of about size entries, 0 turns it off
+void
+map_set_cache(map* m, int size){
+    if (m->cache) {
+        qcache_delete(m->cache);
+        m->cache = NULL;
+    }
+    if (size > 0) {
+        m->cache = qcache_new(size);
+    }
+}
+
+//per tick boundary: the entries go even if their towers did not change
+void
+map_clear_cache(map* m){
+    if (m->cache) {
+        qcache_clear(m->cache);
+    }
+}
+
+//change log of cap entries, 0 turns it off; without it map_changed_towers scans the towers
+void
+map_set_change_log(map* m, int cap){
+    if (m->change_log) {
+        free(m->change_log->entries);
+        free(m->change_log);
+        m->change_log = NULL;
+    }
+    if (cap > 0) {
+        change_log * log = malloc(sizeof(*log));
+        log->entries = malloc(cap*sizeof(change_entry));
+        log->cap = cap;
+        log->cnt = 0;
+        log->head = 0;
+        log->floor = m->change_seq;
+        m->change_log = log;
+    }
+}
+
+//calls cb for every tower in rows min_row..max_row and cols min_col..max_col changed after version since, in no
+//particular order; the log is walked when it still holds since and has fewer entries past it than the range has cells
+int
+map_changed_towers(map* m, uint64_t since, int min_row, int max_row, int min_col, int max_col, tower_cb cb, void* ud){
+    if (m->qt) {
+        return 0;
+    }
+    min_row = min_row > 0 ? min_row : 0;
+    min_col = min_col > 0 ? min_col : 0;
+    max_row = max_row < m->max_row - 1 ? max_row : m->max_row - 1;
+    max_col = max_col < m->max_col - 1 ? max_col : m->max_col - 1;
+    if (min_row > max_row || min_col > max_col) {
+        return 0;
+    }
+    change_log * log = m->change_log;
+    int n = 0;
+    int r,c;
+    if (log && since >= log->floor) {
+        //binary search for the first entry past since, the versions grow from the oldest entry
+        int oldest = (log->head + log->cap - log->cnt) % log->cap;
+        int lo = 0, hi = log->cnt;
+        while (lo < hi) {
+            int mid = (lo + hi)/2;
+            if (log->entries[(oldest + mid) % log->cap].version > since) {
+                hi = mid;
+            }else {
+                lo = mid + 1;
+            }
+        }
+        if (log->cnt - lo <= (max_row - min_row + 1)*(max_col - min_col + 1)) {
+            int i;
+            for (i=log->cnt-1; i>=lo; i--) {
+                const change_entry * e = &log->entries[(oldest + i) % log->cap];
+                r = e->cell/m->max_col;
+                c = e->cell%m->max_col;
+                if (r < min_row || r > max_row || c < min_col || c > max_col) {
+                    continue;
+                }
+                tower * t = get_tower(m, r, c, false);
+                if (t && t->version == e->version) { //the latest change of t
+                    cb(ud, t);
+                    n++;
+                }
+            }
+            return n;
+        }
+    }
+    tower_walk w;
+    tower_walk_begin(m, &w, min_row, max_row, min_col, max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &w))) {
+        if (t->version > since) {
+            cb(ud, t);
+            n++;
+        }
+    }
+    return n;
+}
+
+int
+map_tower_count(map* m){
+    if (m->qt) {
+        return m->qt->node_cnt;
+    }
+    int i;
+    int n = 0;
+    for (i=0; i<m->tower_cap; i++) {
+        if (m->tower_list[i]) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int
+map_object_count(map* m){
+    int i;
+    int n = 0;
+    for (i=0; i<m->size; i++) {
+        if (m->slot_list[i].obj) {
+            n++;
+        }
+    }
+    return n;
+}
+
+void
+map_reset_stats(map* m){
+    if (m->cache) {
+        m->cache->hits = 0;
+        m->cache->revalidated = 0;
+        m->cache->misses = 0;
+        m->cache->stale = 0;
+    }
+#ifdef AREA_STATS
+    memset(&m->stats, 0, sizeof(m->stats));
+    if (m->latency) {
+        int i;
+        for (i=0; i<LATENCY_MAX; i++) {
+            hist_reset(&m->latency->hist[i]);
+        }
+    }
+#endif
+}
+
+#ifdef AREA_STATS
+void
+map_set_latency_sample(map* m, int sample){
+    if (sample <= 0) {
+        free(m->latency);
+        m->latency = NULL;
+        return;
+    }
+    if (!m->latency) {
+        m->latency = calloc(1, sizeof(map_latency));
+    }
+    m->latency->sample = sample;
+    m->latency->tick = 0;
+}
+#endif
+
+static inline int
+grid_cells(int max, int grid_size) {
+    return max/grid_size + ((max%grid_size != 0) ? 1 : 0);
+}
+
+static float
+max_object_radius(map* m) {
+    float max_radius = 0;
+    int i;
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        if (obj && obj->radius > max_radius) {
+            max_radius = obj->radius;
+        }
+    }
+    return max_radius;
+}
+
+static int
+extra_grids(float max_radius, int grid_size) {
+    int extra = ceil(max_radius/grid_size);
+    return extra > 1 ? extra : 1;
+}
+
+static bool
+grid_occupancy(map* m, grid_cost* gc) {
+    int g = gc->grid_size;
+    int max_row = grid_cells(m->max_z, g);
+    int max_col = grid_cells(m->max_x, g);
+    if ((int64_t)max_row*max_col > ADVICE_MAX_CELLS) {
+        return false;
+    }
+    int * cnt = calloc(max_row*max_col, sizeof(int));
+    double n = 0;
+    double n2 = 0;
+    int i;
+    gc->occupied_towers = 0;
+    gc->max_occupancy = 0;
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        if (!obj) {
+            continue;
+        }
+        int row = obj->z/g;
+        int col = obj->x/g;
+        row = row < 0 ? 0 : (row < max_row ? row : max_row - 1);
+        col = col < 0 ? 0 : (col < max_col ? col : max_col - 1);
+        int c = ++cnt[row*max_col + col];
+        if (c == 1) {
+            gc->occupied_towers++;
+        }
+        if (c > gc->max_occupancy) {
+            gc->max_occupancy = c;
+        }
+        n2 += 2*c - 1; //c*c - (c-1)*(c-1)
+        n += 1;
+    }
+    free(cnt);
+    gc->weighted_occupancy = n > 0 ? n2/n : 0;
+    return true;
+}
+
+//cost of an average search: towers iterated plus objects tested in the covered area,
+//density is the object density around objects, searches are issued near them
+static void
+estimate_grid_cost(map* m, grid_advice* advice, double density, grid_cost* gc) {
+    int g = gc->grid_size;
+    int extra = extra_grids(advice->max_radius, g);
+    double cols = floor(advice->query_width/g) + 1 + 2*extra;
+    double rows = floor(advice->query_height/g) + 1 + 2*extra;
+    int max_row = grid_cells(m->max_z, g);
+    int max_col = grid_cells(m->max_x, g);
+    cols = cols < max_col ? cols : max_col;
+    rows = rows < max_row ? rows : max_row;
+    gc->towers = cols*rows;
+    gc->tested = density*(cols*g)*(rows*g);
+    gc->cost = gc->towers*ADVICE_TOWER_COST + gc->tested;
+}
+
+void
+map_advise_grid_size(map* m, grid_advice* advice) {
+    memset(advice, 0, sizeof(*advice));
+    advice->grid_size = m->grid_size;
+    advice->query_cnt = m->query_cnt;
+    if (m->query_cnt == 0) {
+        return;
+    }
+    advice->query_width = m->query_width_sum/m->query_cnt;
+    advice->query_height = m->query_height_sum/m->query_cnt;
+    advice->max_radius = max_object_radius(m);
+    int limit = m->max_x < m->max_z ? m->max_x : m->max_z;
+    //local density measured at the scale of the searches
+    grid_cost ref;
+    ref.grid_size = ceil(advice->query_width > advice->query_height ? advice->query_width : advice->query_height);
+    ref.grid_size = ref.grid_size < 1 ? 1 : (ref.grid_size > limit ? limit : ref.grid_size);
+    while (!grid_occupancy(m, &ref)) {
+        ref.grid_size *= 2;
+    }
+    double density = ref.weighted_occupancy/((double)ref.grid_size*ref.grid_size);
+    int g = 1;
+    bool has_current = false;
+    double best = -1;
+    while (g <= limit && advice->candidate_cnt < ADVICE_CANDIDATE_MAX) {
+        if (!has_current && g > m->grid_size) {
+            g = m->grid_size;
+        }
+        has_current = has_current || g == m->grid_size;
+        grid_cost * gc = &advice->candidates[advice->candidate_cnt];
+        gc->grid_size = g;
+        if (grid_occupancy(m, gc)) {
+            estimate_grid_cost(m, advice, density, gc);
+            advice->candidate_cnt++;
+            if (best < 0 || gc->cost < best) {
+                best = gc->cost;
+                advice->grid_size = g;
+            }
+        }
+        g = g < 4 ? g + 1 : (int)ceil(g*1.35);
+    }
+}
+
+//moves every object to the tower layout of new_grid_size, the id index is untouched
+int
+map_regrid(map* m, int new_grid_size) {
+    if (new_grid_size <= 0) {
+        return 0;
+    }
+    if (new_grid_size == m->grid_size) {
+        return 1;
+    }
+    map_commit(m); //pending moves carry tower indexes of the old layout
+    m->version++;
+    if (m->qt) { //grid_size bounds the leaf size of the quadtree
+        m->grid_size = new_grid_size;
+        m->max_row = grid_cells(m->max_z, new_grid_size);
+        m->max_col = grid_cells(m->max_x, new_grid_size);
+        reset_towers(m);
+        m->extra_check_grids = extra_grids(max_object_radius(m), new_grid_size);
+        qtree_rebuild(m->qt, m);
+        if (m->triggers) {
+            trigger_reindex(m);
+        }
+        m->query_cnt = 0;
+        m->query_width_sum = 0;
+        m->query_height_sum = 0;
+        return 1;
+    }
+    tower ** old_list = m->tower_list;
+    tower * old_block = m->tower_block;
+    int old_cnt = m->tower_cap;
+    m->grid_size = new_grid_size;
+    m->max_row = grid_cells(m->max_z, new_grid_size);
+    m->max_col = grid_cells(m->max_x, new_grid_size);
+    m->tower_list = NULL;
+    m->tower_block = NULL;
+    reset_towers(m);
+    float max_radius = 0;
+    int i;
+    for (i=0; i<old_cnt; i++) {
+        tower * old_t = old_list[i];
+        if (!old_t) {
+            continue;
+        }
+        int k = 0;
+        object * pCur = old_t->pHead ? old_t->pHead->pNext : (old_t->cnt > 0 ? old_t->refs[0] : NULL);
+        while (pCur && pCur != old_t->pHead) {
+            object * pNext = old_t->pHead ? pCur->pNext : (++k < old_t->cnt ? old_t->refs[k] : NULL);
+            int row = pCur->z/new_grid_size;
+            int col = pCur->x/new_grid_size;
+            row = row < 0 ? 0 : (row < m->max_row ? row : m->max_row - 1);
+            col = col < 0 ? 0 : (col < m->max_col ? col : m->max_col - 1);
+            insert_obj_to_tower(m, get_tower(m, row, col, true), pCur);
+            if (pCur->radius > max_radius) {
+                max_radius = pCur->radius;
+            }
+            pCur = pNext;
+        }
+        free(old_t->pHead);
+        free(old_t->packed);
+        free(old_t->refs);
+        if (!old_block) {
+            free(old_t);
+        }
+    }
+    free(old_list);
+    free(old_block);
+    m->extra_check_grids = extra_grids(max_radius, new_grid_size);
+    if (m->triggers) {
+        trigger_reindex(m);
+    }
+    m->query_cnt = 0;
+    m->query_width_sum = 0;
+    m->query_height_sum = 0;
+    return 1;
+}
+
 map*
 map_new(int max_x, int max_z, int grid_size){
     map * m = malloc(sizeof(*m));
@@ -219,6 +1063,11 @@ map_new(int max_x, int max_z, int grid_size){
     m->max_z = max_z;
     m->grid_size = grid_size;
     m->extra_check_grids = 1; //Larger than the maximum model radius on the field
+    m->compact = false;
+    m->layout = LAYOUT_ROW;
+    m->query_cnt = 0;
+    m->query_width_sum = 0;
+    m->query_height_sum = 0;
     m->slot_list = malloc(m->size * sizeof(slot));
     int i;
     for (i=0;i<m->size;i++) {
@@ -227,28 +1076,79 @@ map_new(int max_x, int max_z, int grid_size){
         s->obj = NULL;
         s->next = -1;
     }
-    m->tower_list = calloc(m->max_row * m->max_col, sizeof(tower *));
+    m->version = 0;
+    m->change_seq = 0;
+    m->change_log = NULL;
+    m->cache = NULL;
+    m->tower_list = NULL;
+    m->tower_block = NULL;
+    reset_towers(m);
+    m->chunks = NULL;
+    m->free_objs = NULL;
+    m->qt = NULL;
+    m->recorder = NULL;
+    m->journal = NULL;
+    m->journal_tick = 0;
+    m->shared = NULL;
+    m->deferred = NULL;
+    m->triggers = NULL;
+    m->now = 0;
+    m->motions = NULL;
+    m->motion_cnt = 0;
+    m->motion_cap = 0;
+    m->max_speed = 0;
+    m->handles = NULL;
+    m->handle_cnt = 0;
+    m->handle_cap = 0;
+    m->free_handle = -1;
+#ifdef AREA_STATS
+    m->latency = NULL;
+    m->slowlog = NULL;
+#endif
+    map_reset_stats(m);
     return m;
 }
 
 void
 map_delete(map* m){
     int i;
-    for (i=0;i<m->size;i++) {
-        slot * s = &m->slot_list[i];
-        if (s->obj) {
-            free(s->obj);
-            s->obj = NULL;
-        }
+    while (m->chunks) {
+        object_chunk * c = m->chunks;
+        m->chunks = c->next;
+        free(c);
     }
     free(m->slot_list);
-    for(i=0; i<m->max_row*m->max_col; i++){
+    for(i=0; i<m->tower_cap; i++){
         if (m->tower_list[i]){
-            object* pHead = m->tower_list[i]->pHead;
-            free(pHead);
-            free(m->tower_list[i]);
+            free_tower(m, m->tower_list[i]);
         }
     }
     free(m->tower_list);
+    free(m->tower_block);
+    if (m->qt) {
+        qtree_delete(m->qt);
+    }
+    if (m->journal) {
+        journal_delete(m->journal);
+    }
+    if (m->deferred) {
+        deferred_delete(m->deferred);
+    }
+    if (m->triggers) {
+        trigger_delete(m->triggers);
+    }
+    if (m->change_log) {
+        free(m->change_log->entries);
+        free(m->change_log);
+    }
+    if (m->cache) {
+        qcache_delete(m->cache);
+    }
+    free(m->motions);
+    free(m->handles);
+#ifdef AREA_STATS
+    free(m->latency);
+    free(m->slowlog);
+#endif
     free(m);
 }
\ No newline at end of file
@@ -8,31 +8,171 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#define OBJECT_ATTR_CNT 2 //user attribute slots, the object stays one cache line
+
 typedef struct object {
     uint64_t id;
     float x;
     float z;
     float radius;
     int type;
+    int motion; //index in the map motions, -1 while the object stands still
+    int handle; //index in the map handles, -1 until one is asked for
+    float attr[OBJECT_ATTR_CNT];
     struct object * pNext;
-    struct object * pPrev;
-    struct tower * pTower;
+    union {
+        struct object * pPrev;
+        int cidx; //compact towers: position in the tower arrays
+    };
+    union {
+        struct tower * pTower;
+        struct qnode * pNode; //quadtree backend
+    };
 } object;
 
+//compact towers: offset from the tower corner in 1/65536 of grid_size, radius rounded up
+//in 1/PACKED_RADIUS_UNITS of grid_size, low 16 bits of the type
+typedef struct packed_obj {
+    uint16_t x;
+    uint16_t z;
+    uint16_t radius;
+    uint16_t type;
+} packed_obj;
+
+#define PACKED_POS_UNITS 65536
+#define PACKED_RADIUS_UNITS 1024
+#define PACKED_WIDE 0xffff //the value did not fit, the object itself is tested
+
 typedef struct tower {
     float cx;
     float cz;
     int row;
     int col;
     object * pHead;
+    //compact towers keep the objects in arrays instead of the list
+    packed_obj * packed;
+    object ** refs;
+    int cnt;
+    int cap;
+    uint64_t version; //change_seq of its last change: an object entered, left or changed in place
 } tower;
 
+//velocity of a moving object, x and z of the object hold its position at the map time
+typedef struct motion {
+    struct object * obj;
+    float vx;
+    float vz;
+} motion;
+
+//handle = generation<<32 | index, the generation moves on when the object is deleted so a stale
+//handle never resolves to the object that reuses the entry
+typedef struct handle_slot {
+    object * obj;
+    uint32_t gen;
+    int next_free;
+} handle_slot;
+
+//objects are carved out of chunks, freed ones are kept on a list threaded through pNext
+typedef struct object_chunk {
+    struct object_chunk * next;
+    int cnt;
+    object objs[];
+} object_chunk;
+
 typedef struct slot {
     uint64_t id;
     object * obj;
     int next;
 } slot;
 
+#ifdef AREA_STATS
+#include "histogram.h"
+
+typedef struct map_stats {
+    uint64_t searches;
+    uint64_t towers_visited;
+    uint64_t safe_towers;
+    uint64_t objects_tested;
+    uint64_t hits;
+    uint64_t limit_truncations;
+    uint64_t hash_lookups;
+    uint64_t hash_probes;
+    uint64_t max_probe_len;
+    uint64_t rehashes;
+} map_stats;
+
+#define LATENCY_ADD 0
+#define LATENCY_UPDATE 1
+#define LATENCY_DELETE 2
+#define LATENCY_QUERY 3
+#define LATENCY_SEARCH_CIRCLE 4
+#define LATENCY_SEARCH_RECT 5
+#define LATENCY_SEARCH_SECTOR 6
+#define LATENCY_SEARCH_COMPOUND 7
+#define LATENCY_MAX 8
+
+typedef struct map_latency {
+    int sample; //time one of every sample calls
+    int tick;
+    histogram hist[LATENCY_MAX];
+} map_latency;
+
+#define STAT_INC(m, field) ((m)->stats.field++)
+#define STAT_ADD(m, field, n) ((m)->stats.field += (n))
+#define STAT_MAX(m, field, n) do { if ((uint64_t)(n) > (m)->stats.field) (m)->stats.field = (n); } while (0)
+#else
+#define STAT_INC(m, field) ((void)0)
+#define STAT_ADD(m, field, n) ((void)(n))
+#define STAT_MAX(m, field, n) ((void)(n))
+#endif
+
+#define ADVICE_CANDIDATE_MAX 40
+
+typedef struct grid_cost {
+    int grid_size;
+    int occupied_towers;
+    int max_occupancy;
+    double weighted_occupancy; //mean objects per tower seen from an object
+    double towers;             //expected towers visited per search
+    double tested;             //expected objects tested per search
+    double cost;
+} grid_cost;
+
+typedef struct grid_advice {
+    int grid_size;
+    uint64_t query_cnt;
+    double query_width;
+    double query_height;
+    float max_radius;
+    int candidate_cnt;
+    grid_cost candidates[ADVICE_CANDIDATE_MAX];
+} grid_advice;
+
+#define BACKEND_GRID 0
+#define BACKEND_QUADTREE 1
+
+//tower order in tower_list: row major, or 8x8 tiles in row order with z-order inside a tile
+//and every tower struct preallocated in that order, so towers close on the map are close in memory
+#define LAYOUT_ROW 0
+#define LAYOUT_MORTON 1
+#define TILE_BITS 3
+
+//recent tower changes, oldest first, for consumers that look for the towers changed since a version
+typedef struct change_entry {
+    uint64_t version;
+    int cell; //row*max_col + col
+} change_entry;
+
+typedef struct change_log {
+    change_entry * entries; //ring of cap entries
+    int cap;
+    int cnt;
+    int head; //next entry written
+    uint64_t floor; //changes up to it may be missing, an older since needs a scan of the towers
+} change_log;
+
+typedef void (*tower_cb)(void* ud, tower* t);
+
 typedef struct map {
     int size;
     int lastfree;
@@ -43,17 +183,203 @@ typedef struct map {
     int max_z;
     int grid_size;
     int extra_check_grids;
+    bool compact; //towers hold packed arrays, grid backend only
+    int layout;
+    int tile_cols;
+    int tower_cap; //entries of tower_list, padded to whole tiles in the morton layout
+    //cover box sizes of the searches, input of the grid size advisor
+    uint64_t query_cnt;
+    double query_width_sum;
+    double query_height_sum;
     tower ** tower_list;
+    tower * tower_block; //morton layout: storage of every tower, same index as tower_list
+    object_chunk * chunks;
+    object * free_objs;
+    struct qtree * qt; //set when the quadtree backend replaces the towers
+    struct trace_writer * recorder;
+    struct journal * journal; //replication stream, NULL unless enabled
+    uint64_t journal_tick; //tick of the next journal chunk a replica accepts
+    struct shm_writer * shared; //shared memory image for other processes
+    struct deferred * deferred; //pending moves, NULL unless updates are deferred
+    struct trigger_set * triggers; //static regions, NULL until the first one is added
+    double now; //time the object positions are valid at
+    motion * motions;
+    int motion_cnt;
+    int motion_cap;
+    float max_speed; //bound of the motions, widens the cover box of searches at another time
+    handle_slot * handles;
+    int handle_cnt;
+    int handle_cap;
+    int free_handle; //head of the released entries, -1 when none
+    uint64_t version; //moves on whenever an object enters or leaves a tower or quadtree node
+    uint64_t change_seq; //source of the tower versions
+    change_log * change_log; //NULL unless enabled
+    struct query_cache * cache; //search results by quantized center, NULL unless enabled
+#ifdef AREA_STATS
+    map_stats stats;
+    map_latency * latency;
+    struct slowlog * slowlog;
+#endif
 } map;
 
 map* map_new(int, int, int);
 void map_delete(map*);
 object* map_query_object(map*, uint64_t);
 object* map_init_object(map*, uint64_t);
+object* map_alloc_objects(map*, int);
+int map_set_backend(map*, int);
+int map_set_compact(map*, bool);
+int map_set_layout(map*, int);
+void map_set_deferred(map*, bool);
+int map_commit(map*);
+object* map_add_object(map*, uint64_t, float, float, float, int);
 int map_update_object(map*, object*, float, float);
+void map_set_object_radius(map*, object*, float);
+void map_set_object_type(map*, object*, int);
+int map_set_object_velocity(map*, object*, float, float);
+int map_advance(map*, double);
+uint64_t map_object_handle(map*, object*);
+object* map_handle_object(map*, uint64_t);
+void map_set_cache(map*, int);
+void map_clear_cache(map*);
+void map_set_change_log(map*, int);
+int map_changed_towers(map*, uint64_t, int, int, int, int, tower_cb, void*);
+int map_tower_count(map*);
+int map_object_count(map*);
+void map_reset_stats(map*);
+void map_advise_grid_size(map*, grid_advice*);
+int map_regrid(map*, int);
+#ifdef AREA_STATS
+void map_set_latency_sample(map*, int);
+
+static inline uint64_t
+latency_begin(map* m) {
+    map_latency * lat = m->latency;
+    if (lat && ++lat->tick >= lat->sample) {
+        lat->tick = 0;
+        return hist_now();
+    }
+    return 0;
+}
+
+static inline void
+latency_end(map* m, int op, uint64_t t0) {
+    if (t0) {
+        hist_record(&m->latency->hist[op], hist_now() - t0);
+    }
+}
+#endif
 object* map_delete_object(map *, uint64_t);
+
+//interleaves the 3 bits of a coordinate inside a tile with zeros
+static inline int
+morton_spread(int v) {
+    return (v&1) | ((v&2)<<1) | ((v&4)<<2);
+}
+
+static inline int
+morton_compact(int v) {
+    return (v&1) | ((v>>1)&2) | ((v>>2)&4);
+}
+
+static inline int
+tower_index(map* m, int row, int col) {
+    if (m->layout == LAYOUT_ROW) {
+        return row*m->max_col + col;
+    }
+    int mask = (1<<TILE_BITS) - 1;
+    int tile = (row>>TILE_BITS)*m->tile_cols + (col>>TILE_BITS);
+    return (tile<<(2*TILE_BITS)) | (morton_spread(row&mask)<<1) | morton_spread(col&mask);
+}
+
 tower* get_tower(map*, int, int, bool);
-void insert_obj_to_tower(tower*, object*);
-void delete_obj_from_tower(tower*, object*);
+//the towers of a box of cells in storage order, so a walk reads tower_list front to back: row by row on the row
+//layout, tile by tile and z-order inside a tile on the morton layout. The box is clamped to the map
+typedef struct tower_walk {
+    int row0, row1, col0, col1;
+    int tr, tc; //morton: the tile
+    int lr0, lr1, lc0, lc1; //its cells inside the box
+    int code, last;
+    bool done;
+    int row, col; //cell of the tower last returned
+} tower_walk;
+
+static inline void
+tower_walk_tile(tower_walk* w) {
+    int tile = 1<<TILE_BITS;
+    int base_r = w->tr<<TILE_BITS;
+    int base_c = w->tc<<TILE_BITS;
+    w->lr0 = w->row0 > base_r ? w->row0 - base_r : 0;
+    w->lr1 = w->row1 < base_r + tile - 1 ? w->row1 - base_r : tile - 1;
+    w->lc0 = w->col0 > base_c ? w->col0 - base_c : 0;
+    w->lc1 = w->col1 < base_c + tile - 1 ? w->col1 - base_c : tile - 1;
+    w->code = ((morton_spread(w->lr0)<<1) | morton_spread(w->lc0)) - 1;
+    w->last = (morton_spread(w->lr1)<<1) | morton_spread(w->lc1);
+}
+
+static inline void
+tower_walk_begin(map* m, tower_walk* w, int min_row, int max_row, int min_col, int max_col) {
+    w->row0 = min_row > 0 ? min_row : 0;
+    w->row1 = max_row < m->max_row - 1 ? max_row : m->max_row - 1;
+    w->col0 = min_col > 0 ? min_col : 0;
+    w->col1 = max_col < m->max_col - 1 ? max_col : m->max_col - 1;
+    w->done = w->row0 > w->row1 || w->col0 > w->col1;
+    w->row = w->row0;
+    w->col = w->col0 - 1; //the first step moves onto col0
+    w->tr = w->row0>>TILE_BITS;
+    w->tc = w->col0>>TILE_BITS;
+    tower_walk_tile(w);
+}
+
+//next tower of the box, NULL once the walk is over
+static inline tower*
+tower_walk_next(map* m, tower_walk* w) {
+    if (w->done) {
+        return NULL;
+    }
+    if (m->layout == LAYOUT_ROW) {
+        for (;;) {
+            if (++w->col > w->col1) {
+                w->col = w->col0;
+                if (++w->row > w->row1) {
+                    w->done = true;
+                    return NULL;
+                }
+            }
+            tower * t = m->tower_list[w->row*m->max_col + w->col];
+            if (t) {
+                return t;
+            }
+        }
+    }
+    for (;;) {
+        if (w->code >= w->last) {
+            if (++w->tc > w->col1>>TILE_BITS) {
+                w->tc = w->col0>>TILE_BITS;
+                if (++w->tr > w->row1>>TILE_BITS) {
+                    w->done = true;
+                    return NULL;
+                }
+            }
+            tower_walk_tile(w);
+        }
+        int code = ++w->code;
+        tower * t = m->tower_list[((w->tr*m->tile_cols + w->tc)<<(2*TILE_BITS)) | code];
+        if (!t) {
+            continue;
+        }
+        int lr = morton_compact(code>>1);
+        int lc = morton_compact(code);
+        if (lr < w->lr0 || lr > w->lr1 || lc < w->lc0 || lc > w->lc1) {
+            continue;
+        }
+        w->row = (w->tr<<TILE_BITS) + lr;
+        w->col = (w->tc<<TILE_BITS) + lc;
+        return t;
+    }
+}
+
+void insert_obj_to_tower(map*, tower*, object*);
+void delete_obj_from_tower(map*, tower*, object*);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "histogram.h"
+
+static inline int
+hist_index(uint64_t v) {
+    if (v < HIST_SUB_CNT) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKET_CNT - 1;
+    }
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1)*HIST_SUB_CNT + (int)((v >> shift) & (HIST_SUB_CNT - 1));
+}
+
+void
+hist_reset(histogram* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void
+hist_record(histogram* h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+//largest value that falls into bucket i
+uint64_t
+hist_bucket_upper(int i) {
+    if (i < HIST_SUB_CNT) {
+        return i;
+    }
+    int shift = i/HIST_SUB_CNT - 1;
+    uint64_t sub = i%HIST_SUB_CNT;
+    return ((HIST_SUB_CNT + sub + 1) << shift) - 1;
+}
+
+uint64_t
+hist_percentile(const histogram* h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p*h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t n = 0;
+    int i;
+    for (i=0; i<HIST_BUCKET_CNT; i++) {
+        n += h->buckets[i];
+        if (n > rank) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,33 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+//log-linear buckets: values below 2^HIST_SUB_BITS are exact, above that
+//every power of two is split into HIST_SUB_CNT linear sub buckets (~6% error)
+#define HIST_SUB_BITS 4
+#define HIST_SUB_CNT (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKET_CNT ((HIST_MAX_BITS-HIST_SUB_BITS+1)*HIST_SUB_CNT)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKET_CNT];
+} histogram;
+
+static inline uint64_t
+hist_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void hist_reset(histogram*);
+void hist_record(histogram*, uint64_t);
+uint64_t hist_bucket_upper(int);
+uint64_t hist_percentile(const histogram*, double);
+
+#endif
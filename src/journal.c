@@ -0,0 +1,456 @@
+#include "journal.h"
+
+#define JOURNAL_PRE_ALLOC 64
+
+static void
+buf_reserve(journal_buf* b, size_t n) {
+    if (b->len + n <= b->cap) {
+        return;
+    }
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap*2 : 256;
+    }
+    b->data = realloc(b->data, b->cap);
+}
+
+static inline void
+buf_put(journal_buf* b, const void* p, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static inline void
+buf_byte(journal_buf* b, uint8_t c) {
+    buf_put(b, &c, 1);
+}
+
+static inline void
+buf_varint(journal_buf* b, uint64_t v) {
+    buf_reserve(b, 10);
+    while (v >= 0x80) {
+        b->data[b->len++] = (uint8_t)(v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b->data[b->len++] = (uint8_t)v;
+}
+
+static inline void
+buf_float(journal_buf* b, float f) {
+    buf_put(b, &f, sizeof(f));
+}
+
+static inline uint64_t
+zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+//linear probing keyed by id, removal shifts the following entries back
+static inline int
+entry_slot(journal* j, uint64_t id) {
+    uint64_t h = id*0x9e3779b97f4a7c15ull;
+    return (int)(h >> 32) & (j->entry_size - 1);
+}
+
+static journal_entry *
+find_entry(journal* j, uint64_t id) {
+    int i = entry_slot(j, id);
+    while (j->entries[i].used) {
+        if (j->entries[i].id == id) {
+            return &j->entries[i];
+        }
+        i = (i + 1) & (j->entry_size - 1);
+    }
+    return NULL;
+}
+
+static journal_entry * new_entry(journal* j, uint64_t id);
+
+static void
+grow_entries(journal* j) {
+    journal_entry * old = j->entries;
+    int old_size = j->entry_size;
+    j->entry_size *= 2;
+    j->entries = calloc(j->entry_size, sizeof(journal_entry));
+    j->entry_cnt = 0;
+    int i;
+    for (i=0; i<old_size; i++) {
+        if (old[i].used) {
+            *new_entry(j, old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+static journal_entry *
+new_entry(journal* j, uint64_t id) {
+    if ((j->entry_cnt + 1)*2 > j->entry_size) {
+        grow_entries(j);
+    }
+    int i = entry_slot(j, id);
+    while (j->entries[i].used) {
+        i = (i + 1) & (j->entry_size - 1);
+    }
+    journal_entry * e = &j->entries[i];
+    memset(e, 0, sizeof(*e));
+    e->id = id;
+    e->used = true;
+    j->entry_cnt++;
+    return e;
+}
+
+static void
+remove_entry(journal* j, journal_entry* e) {
+    int mask = j->entry_size - 1;
+    int hole = (int)(e - j->entries);
+    int i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!j->entries[i].used) {
+            break;
+        }
+        int home = entry_slot(j, j->entries[i].id);
+        //move back unless its home lies cyclically in (hole, i]
+        if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+            j->entries[hole] = j->entries[i];
+            hole = i;
+        }
+    }
+    j->entries[hole].used = false;
+    j->entry_cnt--;
+}
+
+journal *
+journal_new(float quantum) {
+    journal * j = malloc(sizeof(*j));
+    memset(j, 0, sizeof(*j));
+    j->quantum = quantum > 0 ? quantum : 0;
+    j->entry_size = JOURNAL_PRE_ALLOC;
+    j->entries = calloc(j->entry_size, sizeof(journal_entry));
+    return j;
+}
+
+void
+journal_delete(journal* j) {
+    free(j->ops.data);
+    free(j->chunk.data);
+    free(j->entries);
+    free(j->dirty);
+    free(j);
+}
+
+void
+journal_add(journal* j, object* obj) {
+    buf_byte(&j->ops, JOURNAL_ADD);
+    buf_varint(&j->ops, obj->id);
+    buf_float(&j->ops, obj->x);
+    buf_float(&j->ops, obj->z);
+    buf_float(&j->ops, obj->radius);
+    buf_varint(&j->ops, zigzag(obj->type));
+    j->op_cnt++;
+    journal_entry * e = find_entry(j, obj->id); //re-added in the tick it was deleted and moved
+    if (e) {
+        e->x = obj->x;
+        e->z = obj->z;
+    }
+}
+
+void
+journal_remove(journal* j, uint64_t id) {
+    buf_byte(&j->ops, JOURNAL_DELETE);
+    buf_varint(&j->ops, id);
+    j->op_cnt++;
+    journal_entry * e = find_entry(j, id);
+    if (e) {
+        remove_entry(j, e);
+    }
+}
+
+void
+journal_radius(journal* j, object* obj) {
+    buf_byte(&j->ops, JOURNAL_RADIUS);
+    buf_varint(&j->ops, obj->id);
+    buf_float(&j->ops, obj->radius);
+    j->op_cnt++;
+}
+
+void
+journal_type(journal* j, object* obj) {
+    buf_byte(&j->ops, JOURNAL_TYPE);
+    buf_varint(&j->ops, obj->id);
+    buf_varint(&j->ops, zigzag(obj->type));
+    j->op_cnt++;
+}
+
+//called before the position changes, the replica still holds the old one unless an entry says otherwise
+void
+journal_move(journal* j, object* obj) {
+    journal_entry * e = find_entry(j, obj->id);
+    if (!e) {
+        e = new_entry(j, obj->id);
+        e->x = obj->x;
+        e->z = obj->z;
+    }
+    if (e->dirty) {
+        return;
+    }
+    e->dirty = true;
+    if (j->dirty_cnt >= j->dirty_cap) {
+        j->dirty_cap = j->dirty_cap ? j->dirty_cap*2 : JOURNAL_PRE_ALLOC;
+        j->dirty = realloc(j->dirty, j->dirty_cap*sizeof(uint64_t));
+    }
+    j->dirty[j->dirty_cnt++] = obj->id;
+}
+
+//a rounded step near the border can leave the map, the replica would refuse it
+static inline bool
+step_in_map(map* m, float x, float z) {
+    int row = z/m->grid_size;
+    int col = x/m->grid_size;
+    return row >= 0 && row < m->max_row && col >= 0 && col < m->max_col;
+}
+
+static void
+flush_move(map* m, journal* j, journal_entry* e) {
+    object * obj = map_query_object(m, e->id);
+    if (!obj) {
+        remove_entry(j, e);
+        return;
+    }
+    float q = j->quantum;
+    double kx = q > 0 ? rint(((double)obj->x - e->x)/q) : 0;
+    double kz = q > 0 ? rint(((double)obj->z - e->z)/q) : 0;
+    if (q > 0 && fabs(kx) <= JOURNAL_STEP_MAX && fabs(kz) <= JOURNAL_STEP_MAX
+        && step_in_map(m, journal_step(e->x, (int64_t)kx, q), journal_step(e->z, (int64_t)kz, q))) {
+        if (kx == 0 && kz == 0) { //still within half a quantum of the replica
+            if (obj->x == e->x && obj->z == e->z) {
+                remove_entry(j, e);
+            }
+            return;
+        }
+        buf_byte(&j->ops, JOURNAL_MOVE);
+        buf_varint(&j->ops, e->id);
+        buf_varint(&j->ops, zigzag((int64_t)kx));
+        buf_varint(&j->ops, zigzag((int64_t)kz));
+        e->x = journal_step(e->x, (int64_t)kx, q);
+        e->z = journal_step(e->z, (int64_t)kz, q);
+    }else if (obj->x != e->x || obj->z != e->z) {
+        buf_byte(&j->ops, JOURNAL_MOVE_ABS);
+        buf_varint(&j->ops, e->id);
+        buf_float(&j->ops, obj->x);
+        buf_float(&j->ops, obj->z);
+        e->x = obj->x;
+        e->z = obj->z;
+    }else {
+        remove_entry(j, e);
+        return;
+    }
+    j->op_cnt++;
+    if (e->x == obj->x && e->z == obj->z) {
+        remove_entry(j, e);
+    }
+}
+
+//chunk of everything journaled since the previous flush, valid until the next one
+const uint8_t *
+journal_flush(map* m, size_t* len) {
+    journal * j = m->journal;
+    int i;
+    map_commit(m); //deferred moves belong to this tick
+    for (i=0; i<j->dirty_cnt; i++) {
+        journal_entry * e = find_entry(j, j->dirty[i]);
+        if (e && e->dirty) {
+            e->dirty = false;
+            flush_move(m, j, e);
+        }
+    }
+    j->dirty_cnt = 0;
+    journal_buf * c = &j->chunk;
+    c->len = 0;
+    uint32_t magic = JOURNAL_MAGIC;
+    buf_put(c, &magic, sizeof(magic));
+    buf_byte(c, JOURNAL_VERSION);
+    buf_float(c, j->quantum);
+    buf_varint(c, j->tick++);
+    buf_varint(c, j->op_cnt);
+    buf_varint(c, j->ops.len);
+    buf_put(c, j->ops.data, j->ops.len);
+    j->ops.len = 0;
+    j->op_cnt = 0;
+    *len = c->len;
+    return c->data;
+}
+
+typedef struct journal_reader {
+    const uint8_t * p;
+    const uint8_t * end;
+} journal_reader;
+
+static inline bool
+read_varint(journal_reader* r, uint64_t* v) {
+    uint64_t x = 0;
+    int shift = 0;
+    for (;;) {
+        if (r->p >= r->end || shift > 63) {
+            return false;
+        }
+        uint8_t c = *r->p++;
+        x |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    *v = x;
+    return true;
+}
+
+static inline bool
+read_float(journal_reader* r, float* f) {
+    if ((size_t)(r->end - r->p) < sizeof(float)) {
+        return false;
+    }
+    memcpy(f, r->p, sizeof(float));
+    r->p += sizeof(float);
+    return true;
+}
+
+typedef struct journal_op {
+    int op;
+    uint64_t id;
+    uint64_t v1, v2;
+    float f[3];
+} journal_op;
+
+static bool
+read_op(journal_reader* r, journal_op* o) {
+    if (r->p >= r->end) {
+        return false;
+    }
+    o->op = *r->p++;
+    if (!read_varint(r, &o->id)) {
+        return false;
+    }
+    switch (o->op) {
+    case JOURNAL_ADD:
+        return read_float(r, &o->f[0]) && read_float(r, &o->f[1]) && read_float(r, &o->f[2]) && read_varint(r, &o->v1);
+    case JOURNAL_DELETE:
+        return true;
+    case JOURNAL_RADIUS:
+        return read_float(r, &o->f[0]);
+    case JOURNAL_TYPE:
+        return read_varint(r, &o->v1);
+    case JOURNAL_MOVE:
+        return read_varint(r, &o->v1) && read_varint(r, &o->v2);
+    case JOURNAL_MOVE_ABS:
+        return read_float(r, &o->f[0]) && read_float(r, &o->f[1]);
+    }
+    return false;
+}
+
+static void
+apply_op(map* m, const journal_op* o, float quantum) {
+    object * obj = o->op == JOURNAL_ADD ? NULL : map_query_object(m, o->id);
+    switch (o->op) {
+    case JOURNAL_ADD:
+        map_add_object(m, o->id, o->f[0], o->f[1], o->f[2], (int)unzigzag(o->v1));
+        break;
+    case JOURNAL_DELETE:
+        if (obj) {
+            map_delete_object(m, o->id);
+        }
+        break;
+    case JOURNAL_RADIUS:
+        if (obj) {
+            map_set_object_radius(m, obj, o->f[0]);
+        }
+        break;
+    case JOURNAL_TYPE:
+        if (obj) {
+            map_set_object_type(m, obj, (int)unzigzag(o->v1));
+        }
+        break;
+    case JOURNAL_MOVE:
+        if (obj) {
+            map_update_object(m, obj, journal_step(obj->x, unzigzag(o->v1), quantum), journal_step(obj->z, unzigzag(o->v2), quantum));
+        }
+        break;
+    case JOURNAL_MOVE_ABS:
+        if (obj) {
+            map_update_object(m, obj, o->f[0], o->f[1]);
+        }
+        break;
+    }
+}
+
+//applies every complete chunk in data, *used tells where an incomplete trailing chunk starts.
+//a chunk is parsed whole before any of its ops is applied and must carry the tick after the last one
+//applied, the moves are steps from the replica positions so a repeated or missing chunk can not be
+//applied. returns the ops applied, JOURNAL_MALFORMED or JOURNAL_OUT_OF_ORDER; the chunks before the
+//failing one stay applied and *used points past them
+int
+journal_apply(map* m, const uint8_t* data, size_t len, size_t* used) {
+    journal_reader r;
+    r.p = data;
+    r.end = data + len;
+    int n = 0;
+    *used = 0;
+    while (r.p < r.end) {
+        uint32_t magic;
+        uint8_t version;
+        float quantum;
+        uint64_t tick, op_cnt, payload;
+        if ((size_t)(r.end - r.p) < sizeof(magic) + 1) {
+            break;
+        }
+        memcpy(&magic, r.p, sizeof(magic));
+        version = r.p[sizeof(magic)];
+        if (magic != JOURNAL_MAGIC || version != JOURNAL_VERSION) {
+            return JOURNAL_MALFORMED;
+        }
+        r.p += sizeof(magic) + 1;
+        if (!read_float(&r, &quantum) || !read_varint(&r, &tick) || !read_varint(&r, &op_cnt) || !read_varint(&r, &payload)) {
+            break;
+        }
+        if ((uint64_t)(r.end - r.p) < payload) {
+            break;
+        }
+        if (!(quantum >= 0) || op_cnt > payload) {
+            return JOURNAL_MALFORMED;
+        }
+        if (tick != m->journal_tick) {
+            return JOURNAL_OUT_OF_ORDER;
+        }
+        journal_reader body;
+        body.p = r.p;
+        body.end = r.p + payload;
+        journal_op o;
+        uint64_t i;
+        for (i=0; i<op_cnt; i++) {
+            if (!read_op(&body, &o)) {
+                return JOURNAL_MALFORMED;
+            }
+        }
+        if (body.p != body.end) {
+            return JOURNAL_MALFORMED;
+        }
+        body.p = r.p;
+        for (i=0; i<op_cnt; i++) {
+            read_op(&body, &o);
+            apply_op(m, &o, quantum);
+        }
+        m->journal_tick++;
+        r.p = body.end;
+        n += (int)op_cnt;
+        *used = r.p - data;
+    }
+    return n;
+}
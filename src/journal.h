@@ -0,0 +1,68 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+#include "divgrid.h"
+
+//delta journal feeding a standby map, flushed once per tick into a self delimiting chunk:
+//magic, version, float quantum, varint tick, varint op count, varint payload length, then the ops.
+//adds, deletes, radius and type changes are kept in call order, the moves of a tick are coalesced
+//into one per object and appended at the flush as steps of quantum from the position the replica holds.
+#define JOURNAL_MAGIC 0x4e4a5341 //"ASJN"
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_ADD 1      //varint id, float x, z, radius, zigzag type
+#define JOURNAL_DELETE 2   //varint id
+#define JOURNAL_RADIUS 3   //varint id, float radius
+#define JOURNAL_TYPE 4     //varint id, zigzag type
+#define JOURNAL_MOVE 5     //varint id, zigzag steps on x and z
+#define JOURNAL_MOVE_ABS 6 //varint id, float x, z, when quantum is 0 or the steps do not fit
+#define JOURNAL_STEP_MAX (1<<24)
+
+#define JOURNAL_MALFORMED -1
+#define JOURNAL_OUT_OF_ORDER -2 //the chunk tick is not the one after the last applied
+
+//position the replica holds for an object moved this tick or left off by the quantization
+typedef struct journal_entry {
+    uint64_t id;
+    float x;
+    float z;
+    bool used;
+    bool dirty;
+} journal_entry;
+
+typedef struct journal_buf {
+    uint8_t * data;
+    size_t len;
+    size_t cap;
+} journal_buf;
+
+typedef struct journal {
+    float quantum;
+    uint64_t tick;
+    int op_cnt;
+    journal_buf ops;
+    journal_buf chunk;
+    journal_entry * entries;
+    int entry_size;
+    int entry_cnt;
+    uint64_t * dirty;
+    int dirty_cnt;
+    int dirty_cap;
+} journal;
+
+//the replica rebuilds a quantized position with the same arithmetic
+static inline float
+journal_step(float base, int64_t steps, float quantum) {
+    return (float)(base + steps*(double)quantum);
+}
+
+journal* journal_new(float);
+void journal_delete(journal*);
+void journal_add(journal*, object*);
+void journal_remove(journal*, uint64_t);
+void journal_radius(journal*, object*);
+void journal_type(journal*, object*);
+void journal_move(journal*, object*);
+const uint8_t* journal_flush(map*, size_t*);
+int journal_apply(map*, const uint8_t*, size_t, size_t*);
+
+#endif
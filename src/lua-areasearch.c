@@ -1,139 +1,131 @@
 #include "divgrid.h"
 #include "lua.h"
 #include "lauxlib.h"
+#include "search.h"
+#include "slowlog.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "shm.h"
+#include "deferred.h"
+#include "trigger.h"
+#include "standing.h"
+#include "qcache.h"
 
-#define HALF_SQRT2 0.7071
-#define PER_ANGLE_RADIAN M_PI/180
+#if defined(__GNUC__)
+#define AREASEARCH_API __attribute__((visibility("default")))
+#else
+#define AREASEARCH_API
+#endif
 
 #define check_area(L, idx)\
     *(map**)luaL_checkudata(L, idx, "areasearch_meta")
 
-static inline bool
-is_two_circle_cross(float cx1, float cz1, float R1, float cx2, float cz2, float R2) {
-    double dx = cx1 - cx2;
-    double dz = cz1 - cz2;
-    double dr = R1 + R2;
-    return (dx*dx+dz*dz) <= dr*dr;
-}
-
-static inline bool
-is_circle_rect_cross(float rect_cx, float rect_cz, float rect_dir_x, float rect_dir_z, float rect_half_width, float rect_half_height, float circle_cx, float circle_cz, float circle_radius) {
-    float check_width = rect_half_width + circle_radius;
-    float check_height = rect_half_height + circle_radius;
-    float c2c_dir_x = circle_cx - rect_cx;
-    float c2c_dir_z = circle_cz - rect_cz;
-    float c2c_width = (c2c_dir_x*rect_dir_z - rect_dir_x*c2c_dir_z); //vector cross (AxB)
-    if (c2c_width < 0) {
-        c2c_width = -c2c_width;
-    }
-    if (c2c_width>check_width) {
-        return false;
-    }
-    float c2c_height = (c2c_dir_x*rect_dir_x + c2c_dir_z*rect_dir_z); //vector dot  (A*B)
-    if (c2c_height < 0) {
-        c2c_height = -c2c_height;
-    }
-    if (c2c_height>check_height) {
-        return false;
-    }
-    if (c2c_width>=rect_half_width && c2c_height>=rect_half_height) {
-        double dw = c2c_width - rect_half_width;
-        double dh = c2c_height - rect_half_height;
-        double radius2 = (double)circle_radius * (double)circle_radius;
-        return (dw*dw + dh*dh) <= radius2;
-    }else{
-        return true;
-    }
-}
-
-static inline bool
-is_circle_sector_cross(float sector_cx, float sector_cz, float sector_dir_x, float sector_dir_z, float half_angle_rad, float sector_radius, float circle_cx, float circle_cz, float circle_radius) {
-    if (!is_two_circle_cross(sector_cx,sector_cz,sector_radius, circle_cx,circle_cz,circle_radius)) {
-        return false;
-    }
-    //approximate calculation
-    double cx = sector_cx - circle_radius*sector_dir_x;
-    double cz = sector_cz - circle_radius*sector_dir_z;
-    double dx = circle_cx - cx;
-    double dz = circle_cz - cz;
-    double len2 = dx*dx + dz*dz;
-    double dot_value = sector_dir_x*dx + sector_dir_z*dz;
-    double cos_value = cos(half_angle_rad);
-    if (cos_value >= 0){
-        if (dot_value >= 0){
-            return dot_value*dot_value > len2*cos_value*cos_value;
-        }else {
-            return false;
-        }
-    }else{
-        if (dot_value < 0){
-            return dot_value*dot_value < len2*cos_value*cos_value;
-        }else {
-            return true;
-        }
-    }
-}
+#define check_shared(L, idx)\
+    *(shm_reader**)luaL_checkudata(L, idx, "areasearch_shared_meta")
 
-static inline void
-vector_rotate(float dir_x, float dir_z, float rotate_rad, float* new_dir_x, float* new_dir_z) {
-    float cos_value = cos(rotate_rad);
-    float sin_value = sin(rotate_rad);
-    *new_dir_x = dir_x*cos_value - dir_z*sin_value;
-    *new_dir_z = dir_z*cos_value + dir_x*sin_value;
-}
+#define check_filter(L, idx)\
+    (lua_filter*)luaL_checkudata(L, idx, "areasearch_filter_meta")
 
-static inline void
-check_max_and_min(float* max, float* min, float value){
-    if (value > *max) {
-        *max = value;
-    }
-    if (value < *min) {
-        *min = value;
-    }
-}
+#define check_cursor(L, idx)\
+    (search_cursor*)luaL_checkudata(L, idx, "areasearch_cursor_meta")
 
-static inline void
-get_cover_row_and_col(map* m, float min_x, float max_x, float min_z, float max_z, int* min_col, int* max_col, int* min_row, int* max_row){
-    *min_col = floor(min_x/m->grid_size);
-    *max_col = floor(max_x/m->grid_size);
-    *min_row = floor(min_z/m->grid_size);
-    *max_row = floor(max_z/m->grid_size);
-    *min_col -= m->extra_check_grids;
-    *max_col += m->extra_check_grids;
-    *min_row -= m->extra_check_grids;
-    *max_row += m->extra_check_grids;
-}
+#define check_standing(L, idx)\
+    (standing_query*)luaL_checkudata(L, idx, "areasearch_standing_meta")
 
-static inline bool
-get_safe_row_and_col(map* m, float min_x, float max_x, float min_z, float max_z, int* min_col, int* max_col, int* min_row, int* max_row){
-    *min_col = ceil(min_x/m->grid_size);
-    *max_col = floor(max_x/m->grid_size)-1;
-    *min_row = ceil(min_z/m->grid_size);
-    *max_row = floor(max_z/m->grid_size)-1;
-    return (min_row<=max_row && min_col<=max_col);
-}
+#ifdef AREA_STATS
+#define LATENCY_BEGIN(m) uint64_t latency_t0 = latency_begin(m)
+#define LATENCY_END(m, op) latency_end(m, op, latency_t0)
+#else
+#define LATENCY_BEGIN(m) ((void)0)
+#define LATENCY_END(m, op) ((void)0)
+#endif
 
-static inline bool
-is_valid_pos(map* m, float x, float z){
-    return (x>=0 && x<=m->max_x) && (z>=0 && z<=m->max_z);
-}
 
+static void
+push_area(lua_State* L, map* m) {
+    *(map**)lua_newuserdata(L, sizeof(void*)) = m;
+    luaL_getmetatable(L, "areasearch_meta");
+    lua_setmetatable(L, -2);
+}
 
 static int
 area_new(lua_State* L) {
     int max_x = luaL_checknumber(L, 1);
     int max_z = luaL_checknumber(L, 2);
     int grid_size = luaL_checknumber(L, 3);
+    int backend = BACKEND_GRID;
+    bool compact = false;
+    int layout = LAYOUT_ROW;
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "backend");
+        const char* name = luaL_optstring(L, -1, "grid");
+        if (strcmp(name, "quadtree") == 0) {
+            backend = BACKEND_QUADTREE;
+        }else if (strcmp(name, "grid") != 0) {
+            return luaL_error(L, "unknown backend %s", name);
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, 4, "compact");
+        compact = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (compact && backend != BACKEND_GRID) {
+            return luaL_error(L, "compact storage needs the grid backend");
+        }
+        lua_getfield(L, 4, "layout");
+        const char* layout_name = luaL_optstring(L, -1, "row");
+        if (strcmp(layout_name, "morton") == 0) {
+            layout = LAYOUT_MORTON;
+        }else if (strcmp(layout_name, "row") != 0) {
+            return luaL_error(L, "unknown layout %s", layout_name);
+        }
+        lua_pop(L, 1);
+        if (layout != LAYOUT_ROW && backend != BACKEND_GRID) {
+            return luaL_error(L, "tower layout needs the grid backend");
+        }
+    }
     map * m = map_new(max_x, max_z, grid_size);
-    *(map**)lua_newuserdata(L, sizeof(void*)) = m;
-    luaL_getmetatable(L, "areasearch_meta");
-    lua_setmetatable(L, -2);
+    map_set_backend(m, backend);
+    map_set_compact(m, compact);
+    map_set_layout(m, layout);
+    push_area(L, m);
     return 1;
 };
 
+static int
+area_load(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    map * m = snapshot_load(path);
+    if (!m) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot load snapshot %s", path);
+        return 2;
+    }
+    push_area(L, m);
+    return 1;
+}
+
+static int
+area_save(lua_State* L) {
+    map* m = check_area(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    if (!snapshot_save(m, path)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int
 area_release(lua_State* L) {
     map* m = check_area(L, 1);
+    if (m->recorder) {
+        trace_close(m->recorder);
+        m->recorder = NULL;
+    }
+    shm_unshare(m);
     map_delete(m);
     return 0;
 }
@@ -145,74 +137,113 @@ area_add(lua_State* L) {
     float x = luaL_checknumber(L, 3);
     float z = luaL_checknumber(L, 4);
     float radius = luaL_checknumber(L, 5);
-    object * obj = map_query_object(m, id);
-    if (obj) {
-        return 0;
+    int type = 0;
+    if (lua_isnumber(L, 6)) {
+        type = luaL_checknumber(L, 6);
     }
-    int row = z/m->grid_size;
-    int col = x/m->grid_size;
-    tower *t = get_tower(m, row, col, true);
-    if (!t) {
-        return 0;
+    if (m->recorder) {
+        trace_add(m->recorder, id, x, z, radius, type);
     }
-    obj = map_init_object(m, id);
-    obj->x = x;
-    obj->z = z;
-    obj->radius = radius;
-    if (radius > m->extra_check_grids*m->grid_size) {
-        m->extra_check_grids = ceil(radius/m->grid_size);
+    LATENCY_BEGIN(m);
+    object * obj = map_add_object(m, id, x, z, radius, type);
+    LATENCY_END(m, LATENCY_ADD);
+    if (!obj) {
+        return 0;
     }
-    if (lua_isnumber(L, 6)) {
-        obj->type = luaL_checknumber(L, 6);
+    if (lua_toboolean(L, 7)) {
+        lua_pushinteger(L, map_object_handle(m, obj));
+    }else {
+        lua_pushboolean(L, 1);
     }
-    insert_obj_to_tower(t, obj);
-    lua_pushboolean(L, 1);
     return 1;
 }
 
+//the *_h variants take the handle of add(..., true) or handle(id) and skip the id index,
+//a stale handle behaves like an unknown id
 static int
-area_update(lua_State* L) {
+update_object(lua_State* L, bool by_handle) {
     map* m = check_area(L, 1);
-    uint64_t id = luaL_checkinteger(L, 2);
+    uint64_t key = luaL_checkinteger(L, 2);
     float x = luaL_checknumber(L, 3);
     float z = luaL_checknumber(L, 4);
-    object * obj = map_query_object(m, id);
+    bool has_radius = lua_isnumber(L, 5);
+    float radius = has_radius ? luaL_checknumber(L, 5) : 0;
+    bool has_type = lua_isnumber(L, 6);
+    int type = has_type ? luaL_checknumber(L, 6) : 0;
+    object * obj = by_handle ? map_handle_object(m, key) : NULL;
+    if (m->recorder && (obj || !by_handle)) {
+        trace_update(m->recorder, obj ? obj->id : key, x, z, has_radius, radius, has_type, type);
+    }
+    LATENCY_BEGIN(m);
+    if (!by_handle) {
+        obj = map_query_object(m, key);
+    }
     if (!obj) {
+        LATENCY_END(m, LATENCY_UPDATE);
         return 0;
     }
-    if (lua_isnumber(L, 5)) {
-        float radius = luaL_checknumber(L, 5);
-        obj->radius = radius;
-        if (radius > m->extra_check_grids*m->grid_size) {
-            m->extra_check_grids = ceil(radius/m->grid_size);
-        }
+    if (has_radius) {
+        map_set_object_radius(m, obj, radius);
+    }
+    if (has_type) {
+        map_set_object_type(m, obj, type);
     }
-    int suc = map_update_object(m,obj,x,z);
+    int suc = m->deferred ? deferred_move(m, obj, x, z) : map_update_object(m,obj,x,z);
+    LATENCY_END(m, LATENCY_UPDATE);
     lua_pushboolean(L, suc);
     return 1;
 }
 
 static int
-area_delete(lua_State* L) {
+area_update(lua_State* L) {
+    return update_object(L, false);
+}
+
+static int
+area_update_h(lua_State* L) {
+    return update_object(L, true);
+}
+
+static int
+delete_object(lua_State* L, bool by_handle) {
     map* m = check_area(L, 1);
-    uint64_t id = luaL_checkinteger(L, 2);
-    object * obj = map_query_object(m, id);
+    uint64_t key = luaL_checkinteger(L, 2);
+    object * obj = by_handle ? map_handle_object(m, key) : NULL;
+    if (m->recorder && (obj || !by_handle)) {
+        trace_delete(m->recorder, obj ? obj->id : key);
+    }
+    LATENCY_BEGIN(m);
+    if (!by_handle) {
+        obj = map_query_object(m, key);
+    }
     if (obj){
-        map_delete_object(m, id);
+        map_delete_object(m, obj->id); //the id index still drops its slot
     }
+    LATENCY_END(m, LATENCY_DELETE);
     return 0;
 }
 
 static int
-area_query(lua_State* L) {
+area_delete(lua_State* L) {
+    return delete_object(L, false);
+}
+
+static int
+area_delete_h(lua_State* L) {
+    return delete_object(L, true);
+}
+
+static int
+query_object(lua_State* L, bool by_handle) {
     map* m = check_area(L, 1);
-    uint64_t id = luaL_checkinteger(L, 2);
-    object * obj = map_query_object(m, id);
+    uint64_t key = luaL_checkinteger(L, 2);
+    LATENCY_BEGIN(m);
+    object * obj = by_handle ? map_handle_object(m, key) : map_query_object(m, key);
     lua_settop(L, 2);
     lua_newtable(L);
     if (obj){
         lua_pushstring(L, "id");
-        lua_pushinteger(L, id);
+        lua_pushinteger(L, obj->id);
         lua_rawset(L,3);
         lua_pushstring(L, "radius");
         lua_pushinteger(L, obj->radius);
@@ -227,81 +258,186 @@ area_query(lua_State* L) {
         lua_pushinteger(L, obj->type);
         lua_rawset(L,3);
         lua_pushstring(L, "tower_row");
-        lua_pushinteger(L, obj->pTower->row);
+        lua_pushinteger(L, m->qt ? (int)(obj->z/m->grid_size) : obj->pTower->row);
         lua_rawset(L,3);
         lua_pushstring(L, "tower_col");
-        lua_pushinteger(L, obj->pTower->col);
+        lua_pushinteger(L, m->qt ? (int)(obj->x/m->grid_size) : obj->pTower->col);
         lua_rawset(L,3);
+        lua_pushstring(L, "attr");
+        lua_createtable(L, OBJECT_ATTR_CNT, 0);
+        int i;
+        for (i=0; i<OBJECT_ATTR_CNT; i++) {
+            lua_pushnumber(L, obj->attr[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_rawset(L,3);
+        if (obj->motion >= 0) {
+            lua_pushstring(L, "vx");
+            lua_pushnumber(L, m->motions[obj->motion].vx);
+            lua_rawset(L,3);
+            lua_pushstring(L, "vz");
+            lua_pushnumber(L, m->motions[obj->motion].vz);
+            lua_rawset(L,3);
+        }
     }
+    LATENCY_END(m, LATENCY_QUERY);
     return 1;
 }
 
 static int
-area_search_circle_range_objs(lua_State* L) {
+area_query(lua_State* L) {
+    return query_object(L, false);
+}
+
+static int
+area_query_h(lua_State* L) {
+    return query_object(L, true);
+}
+
+static int
+area_handle(lua_State* L) {
     map* m = check_area(L, 1);
-    float x = luaL_checknumber(L, 2);
-    float z = luaL_checknumber(L, 3);
-    float radius = luaL_checknumber(L, 4);
-    int type = 0;
-    if (lua_isnumber(L, 5)) {
-        type = luaL_checknumber(L, 5);
+    uint64_t id = luaL_checkinteger(L, 2);
+    object * obj = map_query_object(m, id);
+    if (!obj) {
+        return 0;
     }
-    int limit_cnt = 0x7fff;
-    if (lua_isnumber(L, 6)) {
-        limit_cnt = luaL_checknumber(L, 6);
+    lua_pushinteger(L, map_object_handle(m, obj));
+    return 1;
+}
+
+static void
+push_search_hit(void* ud, object* obj) {
+    lua_State* L = ud;
+    lua_pushinteger(L,obj->id);
+    lua_pushinteger(L,1);
+    lua_rawset(L,-3);
+}
+
+//a filter built by areasearch.filter, type is its all-bits mask
+typedef struct lua_filter {
+    int type;
+    search_filter f;
+} lua_filter;
+
+static void
+set_exclude(lua_State* L, lua_filter* lf, int first, int last) {
+    if (last - first + 1 > FILTER_EXCLUDE_MAX) {
+        luaL_error(L, "at most %d excluded ids", FILTER_EXCLUDE_MAX);
     }
-    lua_settop(L, 4);
-    lua_newtable(L);
-    if (!is_valid_pos(m, x, z)) {
-        return 1;
+    lf->f.exclude_cnt = 0;
+    int i;
+    for (i=first; i<=last; i++) {
+        lf->f.exclude[lf->f.exclude_cnt++] = luaL_checkinteger(L, i);
     }
-    int min_cover_col,max_cover_col,min_cover_row,max_cover_row;
-    get_cover_row_and_col(m, x-radius, x+radius, z-radius, z+radius, &min_cover_col, &max_cover_col, &min_cover_row, &max_cover_row);
-
-    float safe_radius = HALF_SQRT2*radius;
-    int min_safe_col,max_safe_col,min_safe_row,max_safe_row;
-    bool has_safe = get_safe_row_and_col(m, x-safe_radius, x+safe_radius, z-safe_radius, z+safe_radius, &min_safe_col, &max_safe_col, &min_safe_row, &max_safe_row);
-    int n = 0;
-    int r,c;
-    for (r=min_cover_row; r<=max_cover_row; r++){
-        for (c=min_cover_col; c<=max_cover_col; c++){
-            tower *t = get_tower(m, r, c, false);
-            if (!t) {
-                continue;
-            }
-            if (has_safe && r>=min_safe_row && r<=max_safe_row && c>=min_safe_col && c<=max_safe_col) { //safe area
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        lua_pushinteger(L,pCur->id);
-                        lua_pushinteger(L,1);
-                        lua_rawset(L,5);
-                        n++;
-                        if (n >= limit_cnt) {
-                            return 1;
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
-            }else {
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        if (is_two_circle_cross(x,z,radius,pCur->x,pCur->z,pCur->radius)) {
-                            lua_pushinteger(L,pCur->id);
-                            lua_pushinteger(L,1);
-                            lua_rawset(L,5);
-                            n++;
-                            if (n >= limit_cnt) {
-                                return 1;
-                            }
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
+}
+
+//areasearch.filter{all = mask, any = mask, none = mask, exclude = {id, ...}, attr = {[slot] = {min, max}}}
+static int
+area_filter(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_filter * lf = lua_newuserdata(L, sizeof(lua_filter));
+    memset(lf, 0, sizeof(*lf));
+    luaL_getmetatable(L, "areasearch_filter_meta");
+    lua_setmetatable(L, -2);
+    lua_getfield(L, 1, "all");
+    lf->type = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 1, "any");
+    lf->f.any = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 1, "none");
+    lf->f.none = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 3);
+    int i;
+    if (lua_getfield(L, 1, "exclude") == LUA_TTABLE) {
+        int top = lua_gettop(L);
+        int cnt = luaL_len(L, top);
+        luaL_checkstack(L, cnt, NULL);
+        for (i=1; i<=cnt; i++) {
+            lua_rawgeti(L, top, i);
+        }
+        set_exclude(L, lf, top + 1, top + cnt);
+        lua_settop(L, top);
+    }
+    lua_pop(L, 1);
+    if (lua_getfield(L, 1, "attr") == LUA_TTABLE) {
+        for (i=0; i<OBJECT_ATTR_CNT; i++) {
+            if (lua_rawgeti(L, -1, i + 1) == LUA_TTABLE) {
+                lua_rawgeti(L, -1, 1);
+                lua_rawgeti(L, -2, 2);
+                lf->f.attr_mask |= 1<<i;
+                lf->f.attr_min[i] = luaL_optnumber(L, -2, -HUGE_VAL);
+                lf->f.attr_max[i] = luaL_optnumber(L, -1, HUGE_VAL);
+                lua_pop(L, 2);
             }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+//filter:set_exclude(id, ...) replaces the excluded ids, a filter kept around is reused per caster
+static int
+filter_set_exclude(lua_State* L) {
+    lua_filter * lf = check_filter(L, 1);
+    set_exclude(L, lf, 2, lua_gettop(L));
+    lua_settop(L, 1);
+    return 1;
+}
+
+//type is either a number or an areasearch.filter, f stays NULL for a plain type;
+//callers that pass no f only take numbers
+static inline void
+check_search_filter(lua_State* L, int idx, int* type, const search_filter** f, int* limit_cnt) {
+    *type = 0;
+    if (f) {
+        *f = NULL;
+    }
+    if (lua_isnumber(L, idx)) {
+        *type = luaL_checknumber(L, idx);
+    }else if (lua_isuserdata(L, idx)) {
+        if (!f) {
+            luaL_argerror(L, idx, "filters other than a type mask are not supported here");
         }
+        lua_filter * lf = check_filter(L, idx);
+        *type = lf->type;
+        *f = &lf->f;
+    }
+    *limit_cnt = DEFAULT_LIMIT_CNT;
+    if (lua_isnumber(L, idx+1)) {
+        *limit_cnt = luaL_checknumber(L, idx+1);
+    }
+}
+
+//deferred updates: the pending moves are committed first unless the search accepts the committed state
+static inline void
+commit_before_search(lua_State* L, map* m, int idx) {
+    if (m->deferred && !lua_toboolean(L, idx)) {
+        map_commit(m);
+    }
+}
+
+static int
+area_search_circle_range_objs(lua_State* L) {
+    map* m = check_area(L, 1);
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float radius = luaL_checknumber(L, 4);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, 5, &type, &f, &limit_cnt);
+    commit_before_search(L, m, 7);
+    double t = luaL_optnumber(L, 8, m->now);
+    if (m->recorder && !f && t == m->now) {
+        float args[] = {x, z, radius};
+        trace_search(m->recorder, TRACE_SEARCH_CIRCLE, args, type, limit_cnt);
     }
+    LATENCY_BEGIN(m);
+    lua_newtable(L); //on top of the arguments, a filter stays referenced during the search
+    shape s;
+    shape_circle(&s, x, z, radius);
+    map_search_at(m, &s, t, type, f, limit_cnt, push_search_hit, L);
+    LATENCY_END(m, LATENCY_SEARCH_CIRCLE);
     return 1;
 }
 
@@ -312,103 +448,23 @@ area_search_rect_range_objs(lua_State* L) {
     float z = luaL_checknumber(L, 3);
     float dir_x = luaL_checknumber(L, 4);
     float dir_z = luaL_checknumber(L, 5);
-    float dir_len = sqrt(dir_x*dir_x + dir_z*dir_z);
-    if (dir_len > 0 && dir_len != 1) { //convert to unit dir
-        dir_x = dir_x/dir_len;
-        dir_z = dir_z/dir_len;
-    }
     float half_width = luaL_checknumber(L, 6);
     float half_height = luaL_checknumber(L, 7);
-
-    int type = 0;
-    if (lua_isnumber(L, 8)) {
-        type = luaL_checknumber(L, 8);
-    }
-    int limit_cnt = 0x7fff;
-    if (lua_isnumber(L, 9)) {
-        limit_cnt = luaL_checknumber(L, 9);
-    }
-    lua_settop(L, 4);
-    lua_newtable(L);
-    if (!is_valid_pos(m, x, z)) {
-        return 1;
-    }
-    float top_dx = dir_x*half_height;
-    float top_dz = dir_z*half_height;
-    float bottom_dx = -top_dx;
-    float bottom_dz = -top_dz;
-    float left_dx = (-dir_z)*half_width;
-    float left_dz = dir_x*half_width;
-    float right_dx = -left_dx;
-    float right_dz = -left_dz;
-
-    float lt_pos_x = x + top_dx + left_dx;
-    float lt_pos_z = z + top_dz + left_dz;
-    float rt_pos_x = x + top_dx + right_dx;
-    float rt_pos_z = z + top_dz + right_dz;
-    float lb_pos_x = x + bottom_dx + left_dx;
-    float lb_pos_z = z + bottom_dz + left_dz;
-    float rb_pos_x = x + bottom_dx + right_dx;
-    float rb_pos_z = z + bottom_dz + right_dz;
-
-    float min_x,max_x,min_z,max_z;
-    min_x = max_x = lt_pos_x;
-    min_z = max_z = lt_pos_z;
-    check_max_and_min(&max_x, &min_x, rt_pos_x);
-    check_max_and_min(&max_x, &min_x, lb_pos_x);
-    check_max_and_min(&max_x, &min_x, rb_pos_x);
-
-    check_max_and_min(&max_z, &min_z, rt_pos_z);
-    check_max_and_min(&max_z, &min_z, lb_pos_z);
-    check_max_and_min(&max_z, &min_z, rb_pos_z);
-
-    int min_cover_col,max_cover_col,min_cover_row,max_cover_row;
-    get_cover_row_and_col(m, min_x, max_x, min_z, max_z, &min_cover_col, &max_cover_col, &min_cover_row, &max_cover_row);
-
-    float safe_radius = HALF_SQRT2*((half_width<half_height) ? half_width : half_height);
-    int min_safe_col,max_safe_col,min_safe_row,max_safe_row;
-    bool has_safe = get_safe_row_and_col(m, x-safe_radius, x+safe_radius, z-safe_radius, z+safe_radius, &min_safe_col, &max_safe_col, &min_safe_row, &max_safe_row);
-    int n = 0;
-    int r,c;
-    for (r=min_cover_row; r<=max_cover_row; r++){
-        for (c=min_cover_col; c<=max_cover_col; c++){
-            tower *t = get_tower(m, r, c, false);
-            if (!t) {
-                continue;
-            }
-            if (has_safe && r>=min_safe_row && r<=max_safe_row && c>=min_safe_col && c<=max_safe_col) {
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        lua_pushinteger(L,pCur->id);
-                        lua_pushinteger(L,1);
-                        lua_rawset(L,5);
-                        n++;
-                        if (n >= limit_cnt) {
-                            return 1;
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
-            }else {
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        if (is_circle_rect_cross(x,z,dir_x,dir_z,half_width,half_height,pCur->x,pCur->z,pCur->radius)) {
-                            lua_pushinteger(L,pCur->id);
-                            lua_pushinteger(L,1);
-                            lua_rawset(L,5);
-                            n++;
-                            if (n >= limit_cnt) {
-                                return 1;
-                            }
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
-            }
-        }
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, 8, &type, &f, &limit_cnt);
+    commit_before_search(L, m, 10);
+    double t = luaL_optnumber(L, 11, m->now);
+    if (m->recorder && !f && t == m->now) {
+        float args[] = {x, z, dir_x, dir_z, half_width, half_height};
+        trace_search(m->recorder, TRACE_SEARCH_RECT, args, type, limit_cnt);
     }
+    LATENCY_BEGIN(m);
+    lua_newtable(L); //on top of the arguments, a filter stays referenced during the search
+    shape s;
+    shape_rect(&s, x, z, dir_x, dir_z, half_width, half_height);
+    map_search_at(m, &s, t, type, f, limit_cnt, push_search_hit, L);
+    LATENCY_END(m, LATENCY_SEARCH_RECT);
     return 1;
 }
 
@@ -419,166 +475,1369 @@ area_search_sector_range_objs(lua_State* L) {
     float z = luaL_checknumber(L, 3);
     float dir_x = luaL_checknumber(L, 4);
     float dir_z = luaL_checknumber(L, 5);
-    float dir_len = sqrt(dir_x*dir_x + dir_z*dir_z);
-    if (dir_len > 0 && dir_len != 1) { //convert to unit dir
-        dir_x = dir_x/dir_len;
-        dir_z = dir_z/dir_len;
-    }
     float angle = luaL_checknumber(L, 6);
     float radius = luaL_checknumber(L, 7);
-    int type = 0;
-    if (lua_isnumber(L, 8)) {
-        type = luaL_checknumber(L, 8);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, 8, &type, &f, &limit_cnt);
+    commit_before_search(L, m, 10);
+    double t = luaL_optnumber(L, 11, m->now);
+    if (m->recorder && !f && t == m->now) {
+        float args[] = {x, z, dir_x, dir_z, angle, radius};
+        trace_search(m->recorder, TRACE_SEARCH_SECTOR, args, type, limit_cnt);
+    }
+    LATENCY_BEGIN(m);
+    lua_newtable(L); //on top of the arguments, a filter stays referenced during the search
+    shape s;
+    shape_sector(&s, x, z, dir_x, dir_z, angle, radius);
+    map_search_at(m, &s, t, type, f, limit_cnt, push_search_hit, L);
+    LATENCY_END(m, LATENCY_SEARCH_SECTOR);
+    return 1;
+}
+
+static float
+compound_number(lua_State* L, int idx, int i) {
+    lua_rawgeti(L, idx, i);
+    if (!lua_isnumber(L, -1)) {
+        luaL_error(L, "compound shape: number expected at [%d]", i);
     }
-    int limit_cnt = 0x7fff;
-    if (lua_isnumber(L, 9)) {
-        limit_cnt = luaL_checknumber(L, 9);
+    float v = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return v;
+}
+
+//builds the expression in the table at idx, returns its node
+//  {"circle", x, z, radius}, {"rect", x, z, dir_x, dir_z, half_width, half_height},
+//  {"sector", x, z, dir_x, dir_z, angle, radius}, {"annulus", x, z, inner_radius, outer_radius},
+//  {"union" | "intersect" | "diff", expr, expr, ...}, diff keeps the first minus all the others
+static int
+check_compound(lua_State* L, int idx, compound* c) {
+    if (!lua_istable(L, idx)) {
+        luaL_error(L, "compound shape: table expected");
     }
-    lua_settop(L, 4);
-    lua_newtable(L);
-    if (!is_valid_pos(m, x, z)) {
-        return 1;
+    luaL_checkstack(L, 4, NULL);
+    lua_rawgeti(L, idx, 1);
+    const char* kind = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    if (!kind) {
+        luaL_error(L, "compound shape: kind expected at [1]");
     }
-    float min_x,min_z,max_x,max_z;
-    min_x = max_x = x;
-    min_z = max_z = z;
-    float half_angle = angle*0.5;
-    float half_angle_rad = half_angle*PER_ANGLE_RADIAN;
-    float edge_dir_x,edge_dir_z;
-    int i;
-    for (i=0; i<2; i++) {
-        if (i==0) {
-            vector_rotate(dir_x, dir_z, half_angle_rad, &edge_dir_x, &edge_dir_z);
+    shape s;
+    int node = -1;
+    if (strcmp(kind, "circle") == 0) {
+        shape_circle(&s, compound_number(L, idx, 2), compound_number(L, idx, 3), compound_number(L, idx, 4));
+        node = compound_shape(c, &s);
+    }else if (strcmp(kind, "rect") == 0 || strcmp(kind, "sector") == 0) {
+        float v[6];
+        int i;
+        for (i=0; i<6; i++) {
+            v[i] = compound_number(L, idx, i + 2);
+        }
+        if (kind[0] == 'r') {
+            shape_rect(&s, v[0], v[1], v[2], v[3], v[4], v[5]);
         }else {
-            vector_rotate(dir_x, dir_z, -half_angle_rad, &edge_dir_x, &edge_dir_z);
+            shape_sector(&s, v[0], v[1], v[2], v[3], v[4], v[5]);
         }
-        float edge_vx = x + edge_dir_x*radius;
-        float edge_vz = z + edge_dir_z*radius;
-        check_max_and_min(&max_x, &min_x, edge_vx);
-        check_max_and_min(&max_z, &min_z, edge_vz);
-    }
-
-    float rad = atan2(dir_z, dir_x);
-    float min_pi_rad = (rad - half_angle_rad)/M_PI;
-    float max_pi_rad = (rad + half_angle_rad)/M_PI;
-    float f;
-    float check_x,check_z;
-    for (f = -2; f <= 2; f += 0.5) {
-        if (f > max_pi_rad) {
-            break;
+        node = compound_shape(c, &s);
+    }else if (strcmp(kind, "annulus") == 0) {
+        float x = compound_number(L, idx, 2);
+        float z = compound_number(L, idx, 3);
+        shape inner;
+        shape_circle(&inner, x, z, compound_number(L, idx, 4));
+        shape_circle(&s, x, z, compound_number(L, idx, 5));
+        int outer = compound_shape(c, &s);
+        node = compound_op(c, COMPOUND_DIFF, outer, compound_shape(c, &inner));
+    }else {
+        int op;
+        if (strcmp(kind, "union") == 0) {
+            op = COMPOUND_UNION;
+        }else if (strcmp(kind, "intersect") == 0) {
+            op = COMPOUND_INTERSECT;
+        }else if (strcmp(kind, "diff") == 0) {
+            op = COMPOUND_DIFF;
+        }else {
+            return luaL_error(L, "compound shape: unknown kind %s", kind);
         }
-        if (f < min_pi_rad) {
-            continue;
+        int cnt = lua_rawlen(L, idx);
+        if (cnt < 2) {
+            luaL_error(L, "compound shape: %s without operands", kind);
         }
-        if (f==-2 || f==0 || f==2) {
-            check_x = x + radius;
-            check_z = 0;
-        }else if (f==1 || f==-1) {
-            check_x = x - radius;
-            check_z = 0;
-        }else if (f==-1.5 || f==0.5) {
-            check_x = 0;
-            check_z = z + radius;
-        }else {
-            check_x = 0;
-            check_z = z - radius;
+        int i;
+        for (i=2; i<=cnt; i++) {
+            lua_rawgeti(L, idx, i);
+            int operand = check_compound(L, lua_gettop(L), c);
+            lua_pop(L, 1);
+            node = i == 2 ? operand : compound_op(c, op, node, operand);
         }
-        check_max_and_min(&max_x, &min_x, check_x);
-        check_max_and_min(&max_z, &min_z, check_z);
-    }
-
-    int min_cover_col,max_cover_col,min_cover_row,max_cover_row;
-    get_cover_row_and_col(m, min_x, max_x, min_z, max_z, &min_cover_col, &max_cover_col, &min_cover_row, &max_cover_row);
-
-    float min_safe_x, max_safe_x, min_safe_z, max_safe_z;
-    if (half_angle < 90) {
-        float L = radius/(1 + sin(half_angle_rad));
-        float R = L*sin(half_angle_rad)*HALF_SQRT2;
-        float cx = x + L*dir_x;
-        float cz = z + L*dir_z;
-        min_safe_x = cx - R;
-        max_safe_x = cx + R;
-        min_safe_z = cz - R;
-        max_safe_z = cz + R;
+    }
+    if (node < 0) {
+        luaL_error(L, "compound shape: more than %d nodes", COMPOUND_NODE_MAX);
+    }
+    return node;
+}
+
+//areaobj:search_compound(expr, type, limit_cnt, committed), one pass for the whole expression
+static int
+area_search_compound(lua_State* L) {
+    map* m = check_area(L, 1);
+    compound c;
+    c.cnt = 0;
+    c.root = check_compound(L, 2, &c);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, 3, &type, &f, &limit_cnt);
+    commit_before_search(L, m, 5);
+    LATENCY_BEGIN(m);
+    lua_newtable(L);
+    map_search_compound(m, &c, type, f, limit_cnt, push_search_hit, L);
+    LATENCY_END(m, LATENCY_SEARCH_COMPOUND);
+    return 1;
+}
+
+//columnar results: out.ids, out.x, out.z, out.radius, out.type and, when out has a dist2 table, the squared
+//distance to the shape center; the caller's arrays are reused, entries past out.n of the last call are cleared
+#define COLUMN_IDS 0
+#define COLUMN_X 1
+#define COLUMN_Z 2
+#define COLUMN_RADIUS 3
+#define COLUMN_TYPE 4
+#define COLUMN_DIST2 5
+#define COLUMN_MAX 6
+
+static const char* column_names[COLUMN_MAX] = {"ids", "x", "z", "radius", "type", "dist2"};
+
+typedef struct columns {
+    lua_State* L;
+    int base; //stack index of the ids column, the others follow
+    int cnt;  //columns filled
+    int n;
+    float cx;
+    float cz;
+} columns;
+
+//pushes out (created when idx holds nil) and then its columns
+static void
+columns_begin(lua_State* L, int idx, columns* col) {
+    if (lua_isnoneornil(L, idx)) {
+        lua_settop(L, idx - 1);
+        lua_newtable(L);
     }else {
-        float L = radius/2;
-        float R = L*HALF_SQRT2;
-        float cx = x + L*dir_x;
-        float cz = z + L*dir_z;
-        min_safe_x = cx - R;
-        max_safe_x = cx + R;
-        min_safe_z = cz - R;
-        max_safe_z = cz + R;
-    }
-    int min_safe_col,max_safe_col,min_safe_row,max_safe_row;
-    bool has_safe = get_safe_row_and_col(m, min_safe_x, max_safe_x, min_safe_z, max_safe_z, &min_safe_col, &max_safe_col, &min_safe_row, &max_safe_row);
-    int n = 0;
-    int r,c;
-    for (r=min_cover_row; r<=max_cover_row; r++){
-        for (c=min_cover_col; c<=max_cover_col; c++){
-            tower *t = get_tower(m, r, c, false);
-            if (!t) {
-                continue;
-            }
-            if (has_safe && r>=min_safe_row && r<=max_safe_row && c>=min_safe_col && c<=max_safe_col){
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        lua_pushinteger(L,pCur->id);
-                        lua_pushinteger(L,1);
-                        lua_rawset(L,5);
-                        n++;
-                        if (n >= limit_cnt) {
-                            return 1;
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
-            }else{
-                object* pCur = t->pHead->pNext;
-                while (pCur != t->pHead) {
-                    if ((type&pCur->type) == type) {
-                        if (is_circle_sector_cross(x,z,dir_x,dir_z,half_angle_rad,radius,pCur->x,pCur->z,pCur->radius)) {
-                            lua_pushinteger(L,pCur->id);
-                            lua_pushinteger(L,1);
-                            lua_rawset(L,5);
-                            n++;
-                            if (n >= limit_cnt) {
-                                return 1;
-                            }
-                        }
-                    }
-                    pCur = pCur->pNext;
-                }
-            }
+        luaL_checktype(L, idx, LUA_TTABLE);
+        lua_settop(L, idx);
+    }
+    int out = lua_gettop(L);
+    int i;
+    col->L = L;
+    col->base = out + 1;
+    col->n = 0;
+    col->cnt = COLUMN_DIST2;
+    if (lua_getfield(L, out, column_names[COLUMN_DIST2]) == LUA_TTABLE) {
+        col->cnt = COLUMN_MAX;
+    }
+    lua_pop(L, 1);
+    for (i=0; i<col->cnt; i++) {
+        if (lua_getfield(L, out, column_names[i]) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_createtable(L, 16, 0);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, out, column_names[i]);
+        }
+    }
+}
+
+static void
+columns_push(columns* col, object* obj) {
+    lua_State* L = col->L;
+    int n = ++col->n;
+    lua_pushinteger(L, obj->id);
+    lua_rawseti(L, col->base + COLUMN_IDS, n);
+    lua_pushnumber(L, obj->x);
+    lua_rawseti(L, col->base + COLUMN_X, n);
+    lua_pushnumber(L, obj->z);
+    lua_rawseti(L, col->base + COLUMN_Z, n);
+    lua_pushnumber(L, obj->radius);
+    lua_rawseti(L, col->base + COLUMN_RADIUS, n);
+    lua_pushinteger(L, obj->type);
+    lua_rawseti(L, col->base + COLUMN_TYPE, n);
+    if (col->cnt > COLUMN_DIST2) {
+        float dx = obj->x - col->cx;
+        float dz = obj->z - col->cz;
+        lua_pushnumber(L, dx*dx + dz*dz);
+        lua_rawseti(L, col->base + COLUMN_DIST2, n);
+    }
+}
+
+static void
+push_column_hit(void* ud, object* obj) {
+    columns_push(ud, obj);
+}
+
+//leaves out on the top of the stack with out.n set
+static void
+columns_end(columns* col) {
+    lua_State* L = col->L;
+    int out = col->base - 1;
+    lua_getfield(L, out, "n");
+    lua_Integer old_n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_Integer k;
+    int i;
+    for (i=0; i<col->cnt; i++) {
+        for (k=col->n+1; k<=old_n; k++) {
+            lua_pushnil(L);
+            lua_rawseti(L, col->base + i, k);
         }
     }
+    lua_pushinteger(L, col->n);
+    lua_setfield(L, out, "n");
+    lua_settop(L, out);
+}
+
+static int
+search_columns(lua_State* L, const shape* s, int filter_idx, int trace_kind, float* args) {
+    map* m = check_area(L, 1);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, filter_idx, &type, &f, &limit_cnt);
+    if (m->recorder && !f) {
+        trace_search(m->recorder, trace_kind, args, type, limit_cnt);
+    }
+    commit_before_search(L, m, filter_idx + 3);
+    columns col;
+    columns_begin(L, filter_idx + 2, &col);
+    col.cx = s->x;
+    col.cz = s->z;
+    LATENCY_BEGIN(m);
+    map_search_at(m, s, m->now, type, f, limit_cnt, push_column_hit, &col);
+    LATENCY_END(m, LATENCY_SEARCH_CIRCLE + s->kind - SHAPE_CIRCLE);
+    columns_end(&col);
+    lua_pushinteger(L, col.n);
+    return 2;
+}
+
+static int
+area_search_circle_columns(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float radius = luaL_checknumber(L, 4);
+    float args[] = {x, z, radius};
+    shape s;
+    shape_circle(&s, x, z, radius);
+    return search_columns(L, &s, 5, TRACE_SEARCH_CIRCLE, args);
+}
+
+static int
+area_search_rect_columns(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float half_width = luaL_checknumber(L, 6);
+    float half_height = luaL_checknumber(L, 7);
+    float args[] = {x, z, dir_x, dir_z, half_width, half_height};
+    shape s;
+    shape_rect(&s, x, z, dir_x, dir_z, half_width, half_height);
+    return search_columns(L, &s, 8, TRACE_SEARCH_RECT, args);
+}
+
+static int
+area_search_sector_columns(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float angle = luaL_checknumber(L, 6);
+    float radius = luaL_checknumber(L, 7);
+    float args[] = {x, z, dir_x, dir_z, angle, radius};
+    shape s;
+    shape_sector(&s, x, z, dir_x, dir_z, angle, radius);
+    return search_columns(L, &s, 8, TRACE_SEARCH_SECTOR, args);
+}
+
+typedef struct nearest_out {
+    lua_State* L;
+    int n;
+} nearest_out;
+
+static void
+push_nearest_hit(void* ud, object* obj) {
+    nearest_out * no = ud;
+    lua_pushinteger(no->L, obj->id);
+    lua_rawseti(no->L, -2, ++no->n);
+}
+
+//hits as a sequence of ids, nearest towers first, by distance to the center when exact is true
+static int
+search_nearest(lua_State* L, const shape* s, int filter_idx) {
+    map* m = check_area(L, 1);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, filter_idx, &type, &f, &limit_cnt);
+    bool exact = lua_toboolean(L, filter_idx + 2);
+    commit_before_search(L, m, filter_idx + 3);
+    LATENCY_BEGIN(m);
+    lua_newtable(L); //on top of the arguments, a filter stays referenced during the search
+    nearest_out no = {L, 0};
+    map_search_nearest(m, s, type, f, limit_cnt, exact, push_nearest_hit, &no);
+    LATENCY_END(m, LATENCY_SEARCH_CIRCLE + s->kind - SHAPE_CIRCLE);
     return 1;
 }
 
-int
-luaopen_areasearch(lua_State* L) {
-    luaL_checkversion(L);
-    luaL_Reg l1[] = {
-        {"create", area_new},
-        {NULL, NULL},
-    };
-    luaL_Reg l2[] = {
-        {"add", area_add},
-        {"update", area_update},
-        {"delete", area_delete},
-        {"query", area_query},
-        {"search_circle_range_objs", area_search_circle_range_objs},
-        {"search_rect_range_objs", area_search_rect_range_objs},
-        {"search_sector_range_objs", area_search_sector_range_objs},
-        {NULL, NULL},
-    };
+static int
+area_search_circle_nearest(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float radius = luaL_checknumber(L, 4);
+    shape s;
+    shape_circle(&s, x, z, radius);
+    return search_nearest(L, &s, 5);
+}
+
+static int
+area_search_rect_nearest(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float half_width = luaL_checknumber(L, 6);
+    float half_height = luaL_checknumber(L, 7);
+    shape s;
+    shape_rect(&s, x, z, dir_x, dir_z, half_width, half_height);
+    return search_nearest(L, &s, 8);
+}
+
+static int
+area_search_sector_nearest(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float angle = luaL_checknumber(L, 6);
+    float radius = luaL_checknumber(L, 7);
+    shape s;
+    shape_sector(&s, x, z, dir_x, dir_z, angle, radius);
+    return search_nearest(L, &s, 8);
+}
+
+//the objects of an id list in columns, unknown ids are skipped
+static int
+area_get_positions(lua_State* L) {
+    map* m = check_area(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer cnt = luaL_len(L, 2);
+    columns col;
+    columns_begin(L, 3, &col);
+    col.cx = 0;
+    col.cz = 0;
+    lua_Integer i;
+    for (i=1; i<=cnt; i++) {
+        lua_rawgeti(L, 2, i);
+        lua_Integer id = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        object * obj = map_query_object(m, id);
+        if (obj) {
+            columns_push(&col, obj);
+        }
+    }
+    columns_end(&col);
+    lua_pushinteger(L, col.n);
+    return 2;
+}
+
+static search_cursor*
+new_cursor(lua_State* L) {
+    search_cursor * c = lua_newuserdata(L, sizeof(search_cursor));
+    memset(c, 0, sizeof(*c));
+    luaL_getmetatable(L, "areasearch_cursor_meta");
+    lua_setmetatable(L, -2);
+    return c;
+}
+
+static int
+area_cursor(lua_State* L) {
+    new_cursor(L);
+    return 1;
+}
+
+static int
+cursor_release(lua_State* L) {
+    map_cursor_free(check_cursor(L, 1));
+    return 0;
+}
+
+//generic for step: the cursor keeps its map as user value
+static int
+cursor_step(lua_State* L) {
+    search_cursor * c = check_cursor(L, 1);
+    if (lua_getuservalue(L, 1) != LUA_TUSERDATA) {
+        return 0;
+    }
+    map* m = check_area(L, -1);
+    object * obj = map_cursor_next(m, c);
+    if (!obj) {
+        if (c->state == CURSOR_STALE) {
+            return luaL_error(L, "objects were added, deleted or changed towers during the iteration");
+        }
+        return 0;
+    }
+    lua_pushinteger(L, obj->id);
+    lua_pushnumber(L, obj->x);
+    lua_pushnumber(L, obj->z);
+    return 3;
+}
+
+//for id, x, z in areaobj:each_in_*(..., type, limit_cnt, committed, cursor): hits are produced as the loop asks
+//for them; without a cursor the map reuses its own, and a new one replaces it while it is still iterating
+static int
+each_in(lua_State* L, const shape* s, int filter_idx) {
+    map* m = check_area(L, 1);
+    int type,limit_cnt;
+    const search_filter * f;
+    check_search_filter(L, filter_idx, &type, &f, &limit_cnt);
+    int cursor_idx = filter_idx + 3;
+    search_cursor * c;
+    if (lua_isnoneornil(L, cursor_idx)) {
+        lua_settop(L, cursor_idx - 1);
+        if (lua_getuservalue(L, 1) != LUA_TUSERDATA || (c = check_cursor(L, -1))->state == CURSOR_ACTIVE) {
+            lua_pop(L, 1);
+            c = new_cursor(L);
+            lua_pushvalue(L, -1);
+            lua_setuservalue(L, 1);
+        }
+    }else {
+        c = check_cursor(L, cursor_idx);
+        lua_settop(L, cursor_idx);
+    }
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    commit_before_search(L, m, filter_idx + 2);
+    map_cursor_begin(m, c, s, m->now, type, f, limit_cnt);
+    lua_pushcfunction(L, cursor_step);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int
+area_each_in_circle(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float radius = luaL_checknumber(L, 4);
+    shape s;
+    shape_circle(&s, x, z, radius);
+    return each_in(L, &s, 5);
+}
+
+static int
+area_each_in_rect(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float half_width = luaL_checknumber(L, 6);
+    float half_height = luaL_checknumber(L, 7);
+    shape s;
+    shape_rect(&s, x, z, dir_x, dir_z, half_width, half_height);
+    return each_in(L, &s, 8);
+}
+
+static int
+area_each_in_sector(lua_State* L) {
+    float x = luaL_checknumber(L, 2);
+    float z = luaL_checknumber(L, 3);
+    float dir_x = luaL_checknumber(L, 4);
+    float dir_z = luaL_checknumber(L, 5);
+    float angle = luaL_checknumber(L, 6);
+    float radius = luaL_checknumber(L, 7);
+    shape s;
+    shape_sector(&s, x, z, dir_x, dir_z, angle, radius);
+    return each_in(L, &s, 8);
+}
+
+#define set_stat_field(L, name, value)\
+    lua_pushinteger(L, value);\
+    lua_setfield(L, -2, name)
+
+#define set_number_field(L, name, value)\
+    lua_pushnumber(L, value);\
+    lua_setfield(L, -2, name)
+
+static int
+area_stats(lua_State* L) {
+    map* m = check_area(L, 1);
+    lua_newtable(L);
+    set_stat_field(L, "towers", map_tower_count(m));
+    set_stat_field(L, "objects", map_object_count(m));
+    set_stat_field(L, "extra_check_grids", m->extra_check_grids);
+    set_stat_field(L, "hash_size", m->size);
+    lua_pushboolean(L, m->compact);
+    lua_setfield(L, -2, "compact");
+    lua_pushstring(L, m->layout == LAYOUT_MORTON ? "morton" : "row");
+    lua_setfield(L, -2, "layout");
+    set_number_field(L, "now", m->now);
+    set_stat_field(L, "moving", m->motion_cnt);
+    set_number_field(L, "max_speed", m->max_speed);
+    if (m->deferred) {
+        set_stat_field(L, "pending_moves", m->deferred->cnt);
+        set_stat_field(L, "committed_moves", m->deferred->committed);
+        set_stat_field(L, "coalesced_moves", m->deferred->coalesced);
+    }
+    if (m->cache) {
+        set_stat_field(L, "cache_hits", m->cache->hits);
+        set_stat_field(L, "cache_revalidated", m->cache->revalidated);
+        set_stat_field(L, "cache_misses", m->cache->misses);
+        set_stat_field(L, "cache_stale", m->cache->stale);
+    }
+    if (m->triggers) {
+        set_stat_field(L, "trigger_events", m->triggers->event_cnt);
+        set_stat_field(L, "trigger_tests", m->triggers->tests);
+    }
+#ifdef AREA_STATS
+    set_stat_field(L, "searches", m->stats.searches);
+    set_stat_field(L, "towers_visited", m->stats.towers_visited);
+    set_stat_field(L, "safe_towers", m->stats.safe_towers);
+    set_stat_field(L, "objects_tested", m->stats.objects_tested);
+    set_stat_field(L, "hits", m->stats.hits);
+    set_stat_field(L, "limit_truncations", m->stats.limit_truncations);
+    set_stat_field(L, "hash_lookups", m->stats.hash_lookups);
+    set_stat_field(L, "hash_probes", m->stats.hash_probes);
+    set_stat_field(L, "max_probe_len", m->stats.max_probe_len);
+    set_stat_field(L, "rehashes", m->stats.rehashes);
+#endif
+    return 1;
+}
+
+#ifdef AREA_STATS
+static const char* latency_names[LATENCY_MAX] = {
+    "add", "update", "delete", "query", "search_circle", "search_rect", "search_sector", "search_compound",
+};
+#endif
+
+static int
+area_set_latency_sample(lua_State* L) {
+    map* m = check_area(L, 1);
+    int sample = luaL_optinteger(L, 2, 1);
+#ifdef AREA_STATS
+    map_set_latency_sample(m, sample);
+#else
+    (void)m;
+    (void)sample;
+#endif
+    return 0;
+}
+
+static int
+area_latency(lua_State* L) {
+    map* m = check_area(L, 1);
+    bool with_buckets = lua_toboolean(L, 2);
+    lua_newtable(L);
+#ifdef AREA_STATS
+    if (!m->latency) {
+        return 1;
+    }
+    int i,j;
+    for (i=0; i<LATENCY_MAX; i++) {
+        histogram * h = &m->latency->hist[i];
+        lua_newtable(L);
+        set_stat_field(L, "count", h->count);
+        set_stat_field(L, "mean", h->count ? h->sum/h->count : 0);
+        set_stat_field(L, "max", h->max);
+        set_stat_field(L, "p50", hist_percentile(h, 0.5));
+        set_stat_field(L, "p90", hist_percentile(h, 0.9));
+        set_stat_field(L, "p99", hist_percentile(h, 0.99));
+        set_stat_field(L, "p999", hist_percentile(h, 0.999));
+        if (with_buckets) { //{upper_ns, count} of every non empty bucket
+            lua_newtable(L);
+            int n = 0;
+            for (j=0; j<HIST_BUCKET_CNT; j++) {
+                if (h->buckets[j] == 0) {
+                    continue;
+                }
+                lua_createtable(L, 2, 0);
+                lua_pushinteger(L, hist_bucket_upper(j));
+                lua_rawseti(L, -2, 1);
+                lua_pushinteger(L, h->buckets[j]);
+                lua_rawseti(L, -2, 2);
+                lua_rawseti(L, -2, ++n);
+            }
+            lua_setfield(L, -2, "buckets");
+        }
+        lua_setfield(L, -2, latency_names[i]);
+    }
+#else
+    (void)m;
+    (void)with_buckets;
+#endif
+    return 1;
+}
+
+static int
+area_set_slowlog(lua_State* L) {
+    map* m = check_area(L, 1);
+    lua_Number threshold_us = luaL_optnumber(L, 2, 0);
+    int threshold_tested = luaL_optinteger(L, 3, 0);
+    int cap = luaL_optinteger(L, 4, 256);
+#ifdef AREA_STATS
+    free(m->slowlog);
+    m->slowlog = NULL;
+    if ((threshold_us > 0 || threshold_tested > 0) && cap > 0) {
+        m->slowlog = slowlog_new(cap, threshold_us*1000, threshold_tested);
+    }
+#else
+    (void)m;
+    (void)threshold_us;
+    (void)threshold_tested;
+    (void)cap;
+#endif
+    return 0;
+}
+
+static int
+area_set_journal(lua_State* L) {
+    map* m = check_area(L, 1);
+    if (m->journal) {
+        journal_delete(m->journal);
+        m->journal = NULL;
+    }
+    if (!lua_isnoneornil(L, 2)) {
+        m->journal = journal_new(luaL_checknumber(L, 2));
+    }
+    return 0;
+}
+
+static int
+area_flush_journal(lua_State* L) {
+    map* m = check_area(L, 1);
+    if (!m->journal) {
+        return 0;
+    }
+    size_t len;
+    const uint8_t * chunk = journal_flush(m, &len);
+    lua_pushlstring(L, (const char*)chunk, len);
+    return 1;
+}
+
+static int
+area_apply_journal(lua_State* L) {
+    map* m = check_area(L, 1);
+    size_t len;
+    const char* data = luaL_checklstring(L, 2, &len);
+    size_t used;
+    int n = journal_apply(m, (const uint8_t*)data, len, &used);
+    if (n == JOURNAL_OUT_OF_ORDER) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "journal chunk out of order, expected tick %d", (int)m->journal_tick);
+        lua_pushinteger(L, used);
+        return 3;
+    }
+    if (n < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "malformed journal chunk");
+        lua_pushinteger(L, used);
+        return 3;
+    }
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, used);
+    return 2;
+}
+
+static int
+area_share(lua_State* L) {
+    map* m = check_area(L, 1);
+    const char* name = luaL_optstring(L, 2, NULL);
+    shm_unshare(m);
+    if (!name) {
+        return 0;
+    }
+    if (!shm_share(m, name)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot share %s", name);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+area_publish(lua_State* L) {
+    map* m = check_area(L, 1);
+    if (!m->shared || !shm_publish(m)) {
+        return 0;
+    }
+    lua_pushinteger(L, m->shared->hdr->seq);
+    return 1;
+}
+
+static int
+area_attach(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+    shm_reader * r = shm_attach(name);
+    if (!r) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot attach %s", name);
+        return 2;
+    }
+    *(shm_reader**)lua_newuserdata(L, sizeof(void*)) = r;
+    luaL_getmetatable(L, "areasearch_shared_meta");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int
+shared_release(lua_State* L) {
+    shm_detach(check_shared(L, 1));
+    return 0;
+}
+
+static int
+shared_search(lua_State* L, int kind) {
+    shm_reader* r = check_shared(L, 1);
+    float a[6];
+    int argc = kind == SHAPE_CIRCLE ? 3 : 6;
+    int i;
+    for (i=0; i<argc; i++) {
+        a[i] = luaL_checknumber(L, 2 + i);
+    }
+    int type,limit_cnt;
+    check_search_filter(L, 2 + argc, &type, NULL, &limit_cnt);
+    shape s;
+    if (kind == SHAPE_CIRCLE) {
+        shape_circle(&s, a[0], a[1], a[2]);
+    }else if (kind == SHAPE_RECT) {
+        shape_rect(&s, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }else {
+        shape_sector(&s, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    int n = shm_search(r, &s, type, limit_cnt);
+    lua_createtable(L, 0, n > 0 ? n : 0);
+    for (i=0; i<n; i++) {
+        lua_pushinteger(L, r->hits[i]);
+        lua_pushinteger(L, 1);
+        lua_rawset(L, -3);
+    }
+    return 1;
+}
+
+static int
+shared_search_circle_range_objs(lua_State* L) {
+    return shared_search(L, SHAPE_CIRCLE);
+}
+
+static int
+shared_search_rect_range_objs(lua_State* L) {
+    return shared_search(L, SHAPE_RECT);
+}
+
+static int
+shared_search_sector_range_objs(lua_State* L) {
+    return shared_search(L, SHAPE_SECTOR);
+}
+
+static int
+shared_query(lua_State* L) {
+    shm_reader* r = check_shared(L, 1);
+    uint64_t id = luaL_checkinteger(L, 2);
+    snapshot_obj so;
+    lua_newtable(L);
+    if (shm_query(r, id, &so)) {
+        set_stat_field(L, "id", so.id);
+        set_number_field(L, "radius", so.radius);
+        set_number_field(L, "x", so.x);
+        set_number_field(L, "z", so.z);
+        set_stat_field(L, "type", so.type);
+    }
+    return 1;
+}
+
+static int
+shared_seq(lua_State* L) {
+    shm_reader* r = check_shared(L, 1);
+    lua_pushinteger(L, r->seq);
+    lua_pushinteger(L, r->retries);
+    return 2;
+}
+
+#ifdef AREA_STATS
+static const char* shape_names[] = {"", "circle", "rect", "sector"};
+#endif
+
+static int
+area_slowlog(lua_State* L) {
+    map* m = check_area(L, 1);
+    lua_newtable(L);
+#ifdef AREA_STATS
+    slowlog * log = m->slowlog;
+    int i;
+    for (i=0; log && i<log->cnt; i++) {
+        const slow_query * q = slowlog_get(log, i);
+        lua_newtable(L);
+        lua_pushstring(L, shape_names[q->kind]);
+        lua_setfield(L, -2, "shape");
+        set_stat_field(L, "ns", q->ns);
+        set_stat_field(L, "type", q->type);
+        set_stat_field(L, "limit_cnt", q->limit_cnt);
+        set_stat_field(L, "towers", q->towers);
+        set_stat_field(L, "tested", q->tested);
+        set_stat_field(L, "hits", q->hits);
+        lua_pushnumber(L, q->x);
+        lua_setfield(L, -2, "x");
+        lua_pushnumber(L, q->z);
+        lua_setfield(L, -2, "z");
+        lua_rawseti(L, -2, i+1);
+    }
+#else
+    (void)m;
+#endif
+    return 1;
+}
+
+static int
+area_dump_slowlog(lua_State* L) {
+    map* m = check_area(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    if (!slowlog_dump(m, path)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+area_advise_grid_size(lua_State* L) {
+    map* m = check_area(L, 1);
+    grid_advice advice;
+    map_advise_grid_size(m, &advice);
+    lua_pushinteger(L, advice.grid_size);
+    lua_newtable(L);
+    set_stat_field(L, "current", m->grid_size);
+    set_stat_field(L, "query_cnt", advice.query_cnt);
+    lua_pushnumber(L, advice.query_width);
+    lua_setfield(L, -2, "query_width");
+    lua_pushnumber(L, advice.query_height);
+    lua_setfield(L, -2, "query_height");
+    lua_pushnumber(L, advice.max_radius);
+    lua_setfield(L, -2, "max_radius");
+    lua_createtable(L, advice.candidate_cnt, 0);
+    int i;
+    for (i=0; i<advice.candidate_cnt; i++) {
+        grid_cost * gc = &advice.candidates[i];
+        lua_newtable(L);
+        set_stat_field(L, "grid_size", gc->grid_size);
+        set_stat_field(L, "occupied_towers", gc->occupied_towers);
+        set_stat_field(L, "max_occupancy", gc->max_occupancy);
+        lua_pushnumber(L, gc->weighted_occupancy);
+        lua_setfield(L, -2, "weighted_occupancy");
+        lua_pushnumber(L, gc->towers);
+        lua_setfield(L, -2, "towers");
+        lua_pushnumber(L, gc->tested);
+        lua_setfield(L, -2, "tested");
+        lua_pushnumber(L, gc->cost);
+        lua_setfield(L, -2, "cost");
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "candidates");
+    return 2;
+}
+
+static int
+area_regrid(lua_State* L) {
+    map* m = check_area(L, 1);
+    int grid_size = luaL_checkinteger(L, 2);
+    lua_pushboolean(L, map_regrid(m, grid_size));
+    return 1;
+}
+
+static int
+area_record(lua_State* L) {
+    map* m = check_area(L, 1);
+    const char* path = luaL_optstring(L, 2, NULL);
+    if (m->recorder) {
+        trace_close(m->recorder);
+        m->recorder = NULL;
+    }
+    if (!path) {
+        return 0;
+    }
+    m->recorder = trace_open(m, path);
+    if (!m->recorder) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+area_set_deferred(lua_State* L) {
+    map* m = check_area(L, 1);
+    map_set_deferred(m, lua_toboolean(L, 2));
+    return 0;
+}
+
+static int
+area_commit(lua_State* L) {
+    map* m = check_area(L, 1);
+    lua_pushinteger(L, map_commit(m));
+    return 1;
+}
+
+static int
+area_set_attr(lua_State* L) {
+    map* m = check_area(L, 1);
+    uint64_t id = luaL_checkinteger(L, 2);
+    int slot = luaL_checkinteger(L, 3);
+    float value = luaL_checknumber(L, 4);
+    luaL_argcheck(L, slot >= 1 && slot <= OBJECT_ATTR_CNT, 3, "no such attribute slot");
+    object * obj = map_query_object(m, id);
+    if (!obj) {
+        return 0;
+    }
+    obj->attr[slot - 1] = value;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+area_set_velocity(lua_State* L) {
+    map* m = check_area(L, 1);
+    uint64_t id = luaL_checkinteger(L, 2);
+    float vx = luaL_checknumber(L, 3);
+    float vz = luaL_checknumber(L, 4);
+    object * obj = map_query_object(m, id);
+    if (!obj) {
+        return 0;
+    }
+    if (!map_set_object_velocity(m, obj, vx, vz)) {
+        return luaL_error(L, "velocities need the grid backend");
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+area_advance(lua_State* L) {
+    map* m = check_area(L, 1);
+    double t = luaL_checknumber(L, 2);
+    lua_pushinteger(L, map_advance(m, t));
+    return 1;
+}
+
+//one circle, rect or sector in the form of search_compound
+static void
+check_single_shape(lua_State* L, int idx, shape* s) {
+    compound c;
+    c.cnt = 0;
+    int node = check_compound(L, idx, &c);
+    if (c.nodes[node].op != COMPOUND_SHAPE) {
+        luaL_argerror(L, idx, "circle, rect, sector or polygon expected");
+    }
+    *s = c.nodes[node].s;
+}
+
+//areaobj:add_trigger({"circle", x, z, radius} | {"rect", ...} | {"sector", ...} | {"polygon", x1, z1, x2, z2, ...}, type)
+static int
+area_add_trigger(lua_State* L) {
+    map* m = check_area(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int type = luaL_optinteger(L, 3, 0);
+    lua_rawgeti(L, 2, 1);
+    const char* kind = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    int i = -1;
+    if (kind && strcmp(kind, "polygon") == 0) {
+        int len = lua_rawlen(L, 2) - 1;
+        if (len % 2 != 0) {
+            return luaL_argerror(L, 2, "polygon coordinates must come in x, z pairs");
+        }
+        int cnt = len/2;
+        if (cnt < 3) {
+            return luaL_argerror(L, 2, "a polygon needs 3 vertices");
+        }
+        float * points = lua_newuserdata(L, cnt*2*sizeof(float)); //freed by the gc if a vertex is refused
+        int k;
+        for (k=0; k<cnt*2; k++) {
+            lua_rawgeti(L, 2, k + 2);
+            int isnum;
+            points[k] = lua_tonumberx(L, -1, &isnum);
+            if (!isnum) {
+                return luaL_error(L, "polygon: number expected at [%d]", k + 2);
+            }
+            lua_pop(L, 1);
+        }
+        i = trigger_add_polygon(m, points, cnt, type);
+        lua_pop(L, 1);
+    }else {
+        shape s;
+        check_single_shape(L, 2, &s);
+        i = trigger_add_shape(m, &s, type);
+    }
+    lua_pushinteger(L, i);
+    return 1;
+}
+
+static int
+area_remove_trigger(lua_State* L) {
+    map* m = check_area(L, 1);
+    int i = luaL_checkinteger(L, 2);
+    lua_pushboolean(L, trigger_remove(m, i));
+    return 1;
+}
+
+//out at idx (created when it holds nil) with its array fields pushed right after it, returns the out.n of
+//the last call; out_end clears the entries past the new n
+static lua_Integer
+out_begin(lua_State* L, int idx, const char** names, int cnt) {
+    if (lua_isnoneornil(L, idx)) {
+        lua_settop(L, idx - 1);
+        lua_newtable(L);
+    }else {
+        luaL_checktype(L, idx, LUA_TTABLE);
+        lua_settop(L, idx);
+    }
+    int i;
+    for (i=0; i<cnt; i++) {
+        if (lua_getfield(L, idx, names[i]) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, idx, names[i]);
+        }
+    }
+    lua_getfield(L, idx, "n");
+    lua_Integer old_n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return old_n;
+}
+
+//leaves out and n on the stack
+static void
+out_end(lua_State* L, int idx, int cnt, lua_Integer n, lua_Integer old_n) {
+    lua_Integer k;
+    int i;
+    for (k=n+1; k<=old_n; k++) {
+        for (i=0; i<cnt; i++) {
+            lua_pushnil(L);
+            lua_rawseti(L, idx + 1 + i, k);
+        }
+    }
+    lua_pushinteger(L, n);
+    lua_setfield(L, idx, "n");
+    lua_settop(L, idx);
+    lua_pushinteger(L, n);
+}
+
+//events queued since the last drain, in order: out.ids, out.triggers, out.enter (false for an exit) and
+//out.n; pass the same out every tick to reuse its arrays
+static int
+area_drain_triggers(lua_State* L) {
+    map* m = check_area(L, 1);
+    static const char* names[] = {"ids", "triggers", "enter"};
+    lua_Integer old_n = out_begin(L, 2, names, 3);
+    trigger_set * ts = m->triggers;
+    int n = ts ? ts->event_cnt : 0;
+    int i;
+    for (i=0; i<n; i++) {
+        const trigger_event * e = &ts->events[i];
+        lua_pushinteger(L, e->id);
+        lua_rawseti(L, 3, i + 1);
+        lua_pushinteger(L, e->region);
+        lua_rawseti(L, 4, i + 1);
+        lua_pushboolean(L, e->kind == TRIGGER_ENTER);
+        lua_rawseti(L, 5, i + 1);
+    }
+    if (ts) {
+        ts->event_cnt = 0;
+    }
+    out_end(L, 2, 3, n, old_n);
+    return 2;
+}
+
+static int
+area_set_cache(lua_State* L) {
+    map* m = check_area(L, 1);
+    int size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "negative size");
+    map_set_cache(m, size);
+    return 0;
+}
+
+static int
+area_clear_cache(lua_State* L) {
+    map* m = check_area(L, 1);
+    map_clear_cache(m);
+    return 0;
+}
+
+static int
+area_change_version(lua_State* L) {
+    map* m = check_area(L, 1);
+    lua_pushinteger(L, m->change_seq);
+    return 1;
+}
+
+static int
+area_set_change_log(lua_State* L) {
+    map* m = check_area(L, 1);
+    int cap = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, cap >= 0, 2, "negative capacity");
+    map_set_change_log(m, cap);
+    return 0;
+}
+
+typedef struct changed_out {
+    lua_State* L;
+    int base;
+    int n;
+} changed_out;
+
+static void
+push_changed_tower(void* ud, tower* t) {
+    changed_out * co = ud;
+    lua_State* L = co->L;
+    co->n++;
+    lua_pushinteger(L, t->row);
+    lua_rawseti(L, co->base, co->n);
+    lua_pushinteger(L, t->col);
+    lua_rawseti(L, co->base + 1, co->n);
+    lua_pushinteger(L, t->version);
+    lua_rawseti(L, co->base + 2, co->n);
+}
+
+//areaobj:changed_towers(since, region, out, committed): towers changed after the version since in the cover box of region
+//(a search_compound shape, nil for the whole map) as out.rows, out.cols (from 0, cells of grid_size), out.versions
+static int
+area_changed_towers(lua_State* L) {
+    map* m = check_area(L, 1);
+    uint64_t since = luaL_checkinteger(L, 2);
+    if (m->qt) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "changed_towers needs the grid backend");
+        return 2;
+    }
+    int min_row = 0, max_row = m->max_row - 1, min_col = 0, max_col = m->max_col - 1;
+    if (!lua_isnoneornil(L, 3)) {
+        shape s;
+        check_single_shape(L, 3, &s);
+        min_row = floor(s.min_z/m->grid_size);
+        max_row = floor(s.max_z/m->grid_size);
+        min_col = floor(s.min_x/m->grid_size);
+        max_col = floor(s.max_x/m->grid_size);
+    }
+    commit_before_search(L, m, 5);
+    static const char* names[] = {"rows", "cols", "versions"};
+    lua_Integer old_n = out_begin(L, 4, names, 3);
+    changed_out co = {L, 5, 0};
+    map_changed_towers(m, since, min_row, max_row, min_col, max_col, push_changed_tower, &co);
+    out_end(L, 4, 3, co.n, old_n);
+    return 2;
+}
+
+//areaobj:standing({"circle", x, z, radius} | {"rect", ...} | {"sector", ...}, type), the query keeps its map as user value
+static int
+area_standing(lua_State* L) {
+    luaL_checkudata(L, 1, "areasearch_meta");
+    shape s;
+    check_single_shape(L, 2, &s);
+    int type = luaL_optinteger(L, 3, 0);
+    standing_query * q = lua_newuserdata(L, sizeof(standing_query));
+    standing_init(q, &s, type);
+    luaL_getmetatable(L, "areasearch_standing_meta");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static map*
+standing_map(lua_State* L, int idx) {
+    lua_getuservalue(L, idx);
+    map* m = check_area(L, -1);
+    lua_pop(L, 1);
+    return m;
+}
+
+//the ids of l as a sequence in the table at idx (created when it holds nil), the old tail is cleared
+static void
+push_standing_ids(lua_State* L, int idx, const standing_list* l) {
+    if (lua_isnoneornil(L, idx)) {
+        lua_newtable(L);
+        lua_replace(L, idx);
+    }else {
+        luaL_checktype(L, idx, LUA_TTABLE);
+    }
+    lua_Integer old_n = lua_rawlen(L, idx);
+    lua_Integer k;
+    for (k=0; k<l->cnt; k++) {
+        lua_pushinteger(L, l->items[k].id);
+        lua_rawseti(L, idx, k + 1);
+    }
+    for (k=l->cnt+1; k<=old_n; k++) {
+        lua_pushnil(L);
+        lua_rawseti(L, idx, k);
+    }
+}
+
+//query:update(entered, left) returns the ids that entered and left since the last update,
+//pass the same tables every tick to reuse them
+static int
+standing_update_ids(lua_State* L) {
+    standing_query * q = check_standing(L, 1);
+    map* m = standing_map(L, 1);
+    lua_settop(L, 3);
+    map_commit(m);
+    standing_update(m, q);
+    push_standing_ids(L, 2, &q->entered);
+    push_standing_ids(L, 3, &q->left);
+    return 2;
+}
+
+static int
+standing_set_region(lua_State* L) {
+    standing_query * q = check_standing(L, 1);
+    shape s;
+    check_single_shape(L, 2, &s);
+    standing_set_shape(q, &s);
+    return 0;
+}
+
+//the result of the last update as id -> true
+static int
+standing_ids(lua_State* L) {
+    standing_query * q = check_standing(L, 1);
+    lua_createtable(L, 0, q->result.cnt);
+    int i;
+    for (i=0; i<q->result.cnt; i++) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, -2, q->result.items[i].id);
+    }
+    return 1;
+}
+
+static int
+standing_release(lua_State* L) {
+    standing_free(check_standing(L, 1));
+    return 0;
+}
+
+static int
+area_reset_stats(lua_State* L) {
+    map* m = check_area(L, 1);
+    map_reset_stats(m);
+    return 0;
+}
+
+AREASEARCH_API int
+luaopen_areasearch(lua_State* L) {
+    luaL_checkversion(L);
+    luaL_Reg l1[] = {
+        {"create", area_new},
+        {"load", area_load},
+        {"attach", area_attach},
+        {"cursor", area_cursor},
+        {"filter", area_filter},
+        {NULL, NULL},
+    };
+    luaL_Reg l2[] = {
+        {"add", area_add},
+        {"update", area_update},
+        {"delete", area_delete},
+        {"query", area_query},
+        {"update_h", area_update_h},
+        {"delete_h", area_delete_h},
+        {"query_h", area_query_h},
+        {"handle", area_handle},
+        {"search_circle_range_objs", area_search_circle_range_objs},
+        {"search_rect_range_objs", area_search_rect_range_objs},
+        {"search_sector_range_objs", area_search_sector_range_objs},
+        {"search_compound", area_search_compound},
+        {"each_in_circle", area_each_in_circle},
+        {"each_in_rect", area_each_in_rect},
+        {"each_in_sector", area_each_in_sector},
+        {"search_circle_columns", area_search_circle_columns},
+        {"search_rect_columns", area_search_rect_columns},
+        {"search_sector_columns", area_search_sector_columns},
+        {"get_positions", area_get_positions},
+        {"search_circle_nearest", area_search_circle_nearest},
+        {"search_rect_nearest", area_search_rect_nearest},
+        {"search_sector_nearest", area_search_sector_nearest},
+        {"stats", area_stats},
+        {"reset_stats", area_reset_stats},
+        {"set_latency_sample", area_set_latency_sample},
+        {"latency", area_latency},
+        {"set_slowlog", area_set_slowlog},
+        {"slowlog", area_slowlog},
+        {"dump_slowlog", area_dump_slowlog},
+        {"record", area_record},
+        {"advise_grid_size", area_advise_grid_size},
+        {"regrid", area_regrid},
+        {"save", area_save},
+        {"set_journal", area_set_journal},
+        {"flush_journal", area_flush_journal},
+        {"apply_journal", area_apply_journal},
+        {"share", area_share},
+        {"publish", area_publish},
+        {"set_deferred", area_set_deferred},
+        {"commit", area_commit},
+        {"set_velocity", area_set_velocity},
+        {"set_attr", area_set_attr},
+        {"advance", area_advance},
+        {"add_trigger", area_add_trigger},
+        {"remove_trigger", area_remove_trigger},
+        {"drain_triggers", area_drain_triggers},
+        {"set_cache", area_set_cache},
+        {"clear_cache", area_clear_cache},
+        {"change_version", area_change_version},
+        {"set_change_log", area_set_change_log},
+        {"changed_towers", area_changed_towers},
+        {"standing", area_standing},
+        {NULL, NULL},
+    };
     luaL_newmetatable(L, "areasearch_meta");
     luaL_newlib(L, l2);
     lua_setfield(L, -2, "__index");
     lua_pushcfunction(L, area_release);
     lua_setfield(L, -2, "__gc");
 
+    luaL_Reg l3[] = {
+        {"search_circle_range_objs", shared_search_circle_range_objs},
+        {"search_rect_range_objs", shared_search_rect_range_objs},
+        {"search_sector_range_objs", shared_search_sector_range_objs},
+        {"query", shared_query},
+        {"seq", shared_seq},
+        {NULL, NULL},
+    };
+    luaL_newmetatable(L, "areasearch_shared_meta");
+    luaL_newlib(L, l3);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, shared_release);
+    lua_setfield(L, -2, "__gc");
+
+    luaL_Reg l4[] = {
+        {"set_exclude", filter_set_exclude},
+        {NULL, NULL},
+    };
+    luaL_newmetatable(L, "areasearch_filter_meta");
+    luaL_newlib(L, l4);
+    lua_setfield(L, -2, "__index");
+
+    luaL_newmetatable(L, "areasearch_cursor_meta");
+    lua_pushcfunction(L, cursor_release);
+    lua_setfield(L, -2, "__gc");
+
+    luaL_Reg l5[] = {
+        {"update", standing_update_ids},
+        {"set_shape", standing_set_region},
+        {"ids", standing_ids},
+        {NULL, NULL},
+    };
+    luaL_newmetatable(L, "areasearch_standing_meta");
+    luaL_newlib(L, l5);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, standing_release);
+    lua_setfield(L, -2, "__gc");
+
     luaL_newlib(L, l1);
     return 1;
 }
\ No newline at end of file
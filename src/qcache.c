@@ -0,0 +1,143 @@
+#include "qcache.h"
+
+query_cache*
+qcache_new(int size) {
+    int n = 1;
+    while (n < size) {
+        n *= 2;
+    }
+    query_cache * qc = calloc(1, sizeof(*qc));
+    qc->size = n;
+    qc->entries = calloc(n, sizeof(cache_entry));
+    return qc;
+}
+
+void
+qcache_delete(query_cache* qc) {
+    int i;
+    for (i=0; i<qc->size; i++) {
+        free(qc->entries[i].cands);
+    }
+    free(qc->entries);
+    free(qc);
+}
+
+//the entries keep their candidate arrays for the next keys
+void
+qcache_clear(query_cache* qc) {
+    int i;
+    for (i=0; i<qc->size; i++) {
+        qc->entries[i].used = false;
+    }
+}
+
+static inline uint32_t
+key_hash(const cache_key* k) {
+    const uint32_t * w = (const uint32_t *)k;
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i=0; i<sizeof(*k)/sizeof(uint32_t); i++) {
+        h = (h ^ w[i])*16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+static bool
+towers_unchanged(map* m, const cache_entry* e) {
+    tower_walk w;
+    tower_walk_begin(m, &w, e->min_row, e->max_row, e->min_col, e->max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &w))) {
+        if (t->version > e->stamp) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void
+push_cand(cache_entry* e, object* obj) {
+    if (e->cnt >= e->cap) {
+        e->cap = e->cap ? e->cap*2 : 32;
+        e->cands = realloc(e->cands, e->cap*sizeof(object*));
+    }
+    e->cands[e->cnt++] = obj;
+}
+
+//the cover box of s for any center in the tower of key, every object of the type in it
+static void
+build(map* m, cache_entry* e, const shape* s) {
+    float g = m->grid_size;
+    float cell_x = e->key.col*g;
+    float cell_z = e->key.row*g;
+    int extra = m->extra_check_grids;
+    e->min_col = floor((cell_x + s->min_x - s->x)/g) - extra;
+    e->max_col = floor((cell_x + g + s->max_x - s->x)/g) + extra;
+    e->min_row = floor((cell_z + s->min_z - s->z)/g) - extra;
+    e->max_row = floor((cell_z + g + s->max_z - s->z)/g) + extra;
+    e->min_row = e->min_row > 0 ? e->min_row : 0;
+    e->min_col = e->min_col > 0 ? e->min_col : 0;
+    e->max_row = e->max_row < m->max_row - 1 ? e->max_row : m->max_row - 1;
+    e->max_col = e->max_col < m->max_col - 1 ? e->max_col : m->max_col - 1;
+    e->extra_check_grids = extra;
+    e->stamp = m->change_seq;
+    e->cnt = 0;
+    int type = e->key.type;
+    tower_walk w;
+    tower_walk_begin(m, &w, e->min_row, e->max_row, e->min_col, e->max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &w))) {
+        if (!t->pHead) {
+            int i;
+            for (i=0; i<t->cnt; i++) {
+                if ((type&t->refs[i]->type) == type) {
+                    push_cand(e, t->refs[i]);
+                }
+            }
+            continue;
+        }
+        object * pCur;
+        for (pCur=t->pHead->pNext; pCur!=t->pHead; pCur=pCur->pNext) {
+            if ((type&pCur->type) == type) {
+                push_cand(e, pCur);
+            }
+        }
+    }
+}
+
+//candidates of a grid search with its center inside the map
+const cache_entry*
+qcache_get(map* m, const shape* s, int type) {
+    query_cache * qc = m->cache;
+    cache_key k;
+    memset(&k, 0, sizeof(k));
+    k.kind = s->kind;
+    k.row = s->z/m->grid_size;
+    k.col = s->x/m->grid_size;
+    k.type = type;
+    k.dir_x = s->dir_x;
+    k.dir_z = s->dir_z;
+    k.radius = s->radius;
+    k.half_width = s->half_width;
+    k.half_height = s->half_height;
+    k.angle = s->angle;
+    cache_entry * e = &qc->entries[key_hash(&k) & (qc->size - 1)];
+    if (e->used && memcmp(&e->key, &k, sizeof(k)) == 0 && e->extra_check_grids == m->extra_check_grids) {
+        if (e->stamp == m->change_seq) {
+            qc->hits++;
+            return e;
+        }
+        if (towers_unchanged(m, e)) {
+            qc->revalidated++;
+            e->stamp = m->change_seq;
+            return e;
+        }
+        qc->stale++;
+    }else {
+        qc->misses++;
+    }
+    e->key = k;
+    e->used = true;
+    build(m, e, s);
+    return e;
+}
@@ -0,0 +1,47 @@
+#ifndef _QCACHE_H
+#define _QCACHE_H
+#include "search.h"
+
+//search result cache: searches of the same kind, parameters and type whose centers fall in the same tower
+//share one candidate list, the objects of the type in every tower such a search can cover; a hit only
+//runs the exact test on the candidates. An entry holds while none of its towers changed since it was
+//built, checked against the tower versions once the map moved on, and everything goes at qcache_clear
+typedef struct cache_key {
+    int kind;
+    int row;
+    int col;
+    int type;
+    float dir_x;
+    float dir_z;
+    float radius;
+    float half_width;
+    float half_height;
+    float angle;
+} cache_key;
+
+typedef struct cache_entry {
+    cache_key key;
+    bool used;
+    uint64_t stamp; //change_seq the towers were checked at
+    int extra_check_grids;
+    int min_row, max_row, min_col, max_col;
+    object ** cands;
+    int cnt;
+    int cap;
+} cache_entry;
+
+typedef struct query_cache {
+    cache_entry * entries; //direct mapped, a new key replaces the entry of its slot
+    int size;
+    uint64_t hits;
+    uint64_t revalidated; //hits after checking the tower versions
+    uint64_t misses;
+    uint64_t stale; //entries rebuilt because one of their towers changed
+} query_cache;
+
+query_cache* qcache_new(int);
+void qcache_delete(query_cache*);
+void qcache_clear(query_cache*);
+const cache_entry* qcache_get(map*, const shape*, int);
+
+#endif
@@ -0,0 +1,282 @@
+#include "quadtree.h"
+
+#define QT_STACK_MAX 256
+
+static qnode *
+new_node(qtree* qt, qnode* parent, float cx, float cz, float half) {
+    qnode * node = malloc(sizeof(*node));
+    node->cx = cx;
+    node->cz = cz;
+    node->half = half;
+    node->depth = parent ? parent->depth + 1 : 0;
+    node->cnt = 0;
+    node->total = 0;
+    node->pHead = malloc(sizeof(object));
+    node->pHead->pNext = node->pHead;
+    node->pHead->pPrev = node->pHead;
+    node->parent = parent;
+    memset(node->child, 0, sizeof(node->child));
+    qt->node_cnt++;
+    return node;
+}
+
+static void
+free_node(qtree* qt, qnode* node) {
+    int i;
+    for (i=0; i<4; i++) {
+        if (node->child[i]) {
+            free_node(qt, node->child[i]);
+        }
+    }
+    free(node->pHead);
+    free(node);
+    qt->node_cnt--;
+}
+
+static inline bool
+is_split(qnode* node) {
+    return node->child[0] != NULL;
+}
+
+static inline int
+quadrant(qnode* node, float x, float z) {
+    return (x >= node->cx ? 1 : 0) | (z >= node->cz ? 2 : 0);
+}
+
+static inline bool
+fits(qnode* node, object* obj) {
+    return obj->radius <= node->half
+        && fabsf(obj->x - node->cx) <= node->half && fabsf(obj->z - node->cz) <= node->half;
+}
+
+static inline void
+link_obj(qnode* node, object* obj) {
+    obj->pNext = node->pHead->pNext;
+    obj->pPrev = node->pHead;
+    obj->pNext->pPrev = obj;
+    obj->pPrev->pNext = obj;
+    obj->pNode = node;
+    node->cnt++;
+}
+
+static inline void
+unlink_obj(qnode* node, object* obj) {
+    obj->pNext->pPrev = obj->pPrev;
+    obj->pPrev->pNext = obj->pNext;
+    obj->pPrev = NULL;
+    obj->pNext = NULL;
+    obj->pNode = NULL;
+    node->cnt--;
+}
+
+//deepest node under from that can hold obj
+static qnode *
+find_node(qnode* node, object* obj) {
+    while (is_split(node)) {
+        qnode * c = node->child[quadrant(node, obj->x, obj->z)];
+        if (obj->radius > c->half) {
+            break;
+        }
+        node = c;
+    }
+    return node;
+}
+
+static void
+split(qtree* qt, qnode* node) {
+    float h = node->half*0.5;
+    int i;
+    for (i=0; i<4; i++) {
+        node->child[i] = new_node(qt, node, node->cx + ((i&1) ? h : -h), node->cz + ((i&2) ? h : -h), h);
+    }
+    object * pCur = node->pHead->pNext;
+    while (pCur != node->pHead) {
+        object * pNext = pCur->pNext;
+        qnode * c = node->child[quadrant(node, pCur->x, pCur->z)];
+        if (pCur->radius <= c->half) {
+            unlink_obj(node, pCur);
+            link_obj(c, pCur);
+            c->total++;
+        }
+        pCur = pNext;
+    }
+}
+
+static void
+collect(qnode* to, qnode* node) {
+    int i;
+    for (i=0; i<4; i++) {
+        if (node->child[i]) {
+            collect(to, node->child[i]);
+        }
+    }
+    if (node != to) {
+        object * pCur = node->pHead->pNext;
+        while (pCur != node->pHead) {
+            object * pNext = pCur->pNext;
+            unlink_obj(node, pCur);
+            link_obj(to, pCur);
+            pCur = pNext;
+        }
+    }
+}
+
+static void
+merge(qtree* qt, qnode* node) {
+    collect(node, node);
+    int i;
+    for (i=0; i<4; i++) {
+        free_node(qt, node->child[i]);
+        node->child[i] = NULL;
+    }
+}
+
+static void
+insert_from(qtree* qt, qnode* from, object* obj) {
+    qnode * node = find_node(from, obj);
+    link_obj(node, obj);
+    qnode * n;
+    for (n=node; n; n=n->parent) {
+        n->total++;
+    }
+    if (!is_split(node) && node->cnt > QT_SPLIT_CNT && node->depth < qt->max_depth) {
+        split(qt, node);
+    }
+}
+
+static void
+detach(qtree* qt, object* obj) {
+    qnode * node = obj->pNode;
+    unlink_obj(node, obj);
+    qnode * target = NULL;
+    qnode * n;
+    for (n=node; n; n=n->parent) {
+        n->total--;
+        if (is_split(n) && n->total <= QT_MERGE_CNT) {
+            target = n;
+        }
+    }
+    if (target) {
+        merge(qt, target);
+    }
+}
+
+qtree *
+qtree_new(map* m) {
+    qtree * qt = malloc(sizeof(*qt));
+    qt->node_cnt = 0;
+    float size = m->max_x > m->max_z ? m->max_x : m->max_z;
+    qt->root = new_node(qt, NULL, size*0.5, size*0.5, size*0.5);
+    qt->max_depth = 0;
+    float leaf = size;
+    while (leaf*0.5 >= m->grid_size && qt->max_depth < QT_MAX_DEPTH) {
+        leaf *= 0.5;
+        qt->max_depth++;
+    }
+    return qt;
+}
+
+void
+qtree_delete(qtree* qt) {
+    free_node(qt, qt->root);
+    free(qt);
+}
+
+void
+qtree_insert(qtree* qt, object* obj) {
+    insert_from(qt, qt->root, obj);
+}
+
+void
+qtree_remove(qtree* qt, object* obj) {
+    detach(qt, obj);
+}
+
+void
+qtree_update(qtree* qt, object* obj, float x, float z) {
+    obj->x = x;
+    obj->z = z;
+    qnode * node = obj->pNode;
+    if (fits(node, obj) || node == qt->root) {
+        return;
+    }
+    detach(qt, obj);
+    insert_from(qt, qt->root, obj);
+}
+
+void
+qtree_rebuild(qtree* qt, map* m) {
+    qnode * root = qt->root;
+    if (is_split(root)) {
+        merge(qt, root);
+    }
+    qt->max_depth = 0;
+    float leaf = root->half*2;
+    while (leaf*0.5 >= m->grid_size && qt->max_depth < QT_MAX_DEPTH) {
+        leaf *= 0.5;
+        qt->max_depth++;
+    }
+    root->total = 0;
+    root->cnt = 0;
+    object * pCur = root->pHead->pNext;
+    root->pHead->pNext = root->pHead;
+    root->pHead->pPrev = root->pHead;
+    while (pCur != root->pHead) {
+        object * pNext = pCur->pNext;
+        insert_from(qt, root, pCur);
+        pCur = pNext;
+    }
+}
+
+static inline bool
+box_overlap(float min_x, float max_x, float min_z, float max_z, qnode* node) {
+    float loose = node->half*2;
+    return !(max_x < node->cx - loose || min_x > node->cx + loose || max_z < node->cz - loose || min_z > node->cz + loose);
+}
+
+static inline bool
+in_safe_box(const shape* s, qnode* node) {
+    return s->has_safe_box
+        && node->cx - node->half >= s->min_safe_x && node->cx + node->half <= s->max_safe_x
+        && node->cz - node->half >= s->min_safe_z && node->cz + node->half <= s->max_safe_z;
+}
+
+int
+qtree_search(qtree* qt, const shape* s, int type, int limit_cnt, search_cb cb, void* ud, int* towers, int* safe_towers, int* tested) {
+    qnode * stack[QT_STACK_MAX];
+    bool safe_stack[QT_STACK_MAX];
+    int top = 0;
+    int n = 0;
+    stack[top] = qt->root;
+    safe_stack[top++] = false;
+    while (top > 0) {
+        top--;
+        qnode * node = stack[top];
+        bool safe = safe_stack[top] || in_safe_box(s, node);
+        (*towers)++;
+        if (safe) {
+            (*safe_towers)++;
+        }
+        object * pCur = node->pHead->pNext;
+        while (pCur != node->pHead) {
+            (*tested)++;
+            if ((type&pCur->type) == type && (safe || shape_cross(s, pCur->x, pCur->z, pCur->radius))) {
+                cb(ud, pCur);
+                n++;
+                if (n >= limit_cnt) {
+                    return n;
+                }
+            }
+            pCur = pCur->pNext;
+        }
+        int i;
+        for (i=3; i>=0; i--) {
+            qnode * c = node->child[i];
+            if (c && c->total > 0 && box_overlap(s->min_x, s->max_x, s->min_z, s->max_z, c)) {
+                stack[top] = c;
+                safe_stack[top++] = safe;
+            }
+        }
+    }
+    return n;
+}
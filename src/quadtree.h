@@ -0,0 +1,39 @@
+#ifndef _QUADTREE_H
+#define _QUADTREE_H
+#include "divgrid.h"
+#include "search.h"
+
+//loose quadtree: an object lives in the deepest node whose tight bounds contain its
+//center and whose loose bounds (tight bounds grown by half their size on each side)
+//contain its whole circle, leaves are never smaller than the map grid_size
+#define QT_SPLIT_CNT 16
+#define QT_MERGE_CNT 8
+#define QT_MAX_DEPTH 48
+
+typedef struct qnode {
+    float cx;
+    float cz;
+    float half; //half size of the tight bounds
+    int depth;
+    int cnt;    //objects linked to this node
+    int total;  //objects in the whole subtree
+    object * pHead;
+    struct qnode * parent;
+    struct qnode * child[4];
+} qnode;
+
+typedef struct qtree {
+    qnode * root;
+    int max_depth;
+    int node_cnt;
+} qtree;
+
+qtree* qtree_new(map*);
+void qtree_delete(qtree*);
+void qtree_insert(qtree*, object*);
+void qtree_remove(qtree*, object*);
+void qtree_update(qtree*, object*, float, float);
+void qtree_rebuild(qtree*, map*);
+int qtree_search(qtree*, const shape*, int, int, search_cb, void*, int*, int*, int*);
+
+#endif
@@ -0,0 +1,1133 @@
+#include <float.h>
+#include "search.h"
+#include "slowlog.h"
+#include "quadtree.h"
+#include "qcache.h"
+
+static inline bool
+is_two_circle_cross(float cx1, float cz1, float R1, float cx2, float cz2, float R2) {
+    double dx = cx1 - cx2;
+    double dz = cz1 - cz2;
+    double dr = R1 + R2;
+    return (dx*dx+dz*dz) <= dr*dr;
+}
+
+static inline bool
+is_circle_rect_cross(float rect_cx, float rect_cz, float rect_dir_x, float rect_dir_z, float rect_half_width, float rect_half_height, float circle_cx, float circle_cz, float circle_radius) {
+    float check_width = rect_half_width + circle_radius;
+    float check_height = rect_half_height + circle_radius;
+    float c2c_dir_x = circle_cx - rect_cx;
+    float c2c_dir_z = circle_cz - rect_cz;
+    float c2c_width = (c2c_dir_x*rect_dir_z - rect_dir_x*c2c_dir_z); //vector cross (AxB)
+    if (c2c_width < 0) {
+        c2c_width = -c2c_width;
+    }
+    if (c2c_width>check_width) {
+        return false;
+    }
+    float c2c_height = (c2c_dir_x*rect_dir_x + c2c_dir_z*rect_dir_z); //vector dot  (A*B)
+    if (c2c_height < 0) {
+        c2c_height = -c2c_height;
+    }
+    if (c2c_height>check_height) {
+        return false;
+    }
+    if (c2c_width>=rect_half_width && c2c_height>=rect_half_height) {
+        double dw = c2c_width - rect_half_width;
+        double dh = c2c_height - rect_half_height;
+        double radius2 = (double)circle_radius * (double)circle_radius;
+        return (dw*dw + dh*dh) <= radius2;
+    }else{
+        return true;
+    }
+}
+
+static inline bool
+is_circle_sector_cross(float sector_cx, float sector_cz, float sector_dir_x, float sector_dir_z, double cos_value, float sector_radius, float circle_cx, float circle_cz, float circle_radius) {
+    if (!is_two_circle_cross(sector_cx,sector_cz,sector_radius, circle_cx,circle_cz,circle_radius)) {
+        return false;
+    }
+    //approximate calculation
+    double cx = sector_cx - circle_radius*sector_dir_x;
+    double cz = sector_cz - circle_radius*sector_dir_z;
+    double dx = circle_cx - cx;
+    double dz = circle_cz - cz;
+    double len2 = dx*dx + dz*dz;
+    double dot_value = sector_dir_x*dx + sector_dir_z*dz;
+    if (cos_value >= 0){
+        if (dot_value >= 0){
+            return dot_value*dot_value > len2*cos_value*cos_value;
+        }else {
+            return false;
+        }
+    }else{
+        if (dot_value < 0){
+            return dot_value*dot_value < len2*cos_value*cos_value;
+        }else {
+            return true;
+        }
+    }
+}
+
+static inline void
+vector_rotate(float dir_x, float dir_z, float rotate_rad, float* new_dir_x, float* new_dir_z) {
+    float cos_value = cos(rotate_rad);
+    float sin_value = sin(rotate_rad);
+    *new_dir_x = dir_x*cos_value - dir_z*sin_value;
+    *new_dir_z = dir_z*cos_value + dir_x*sin_value;
+}
+
+static inline void
+check_max_and_min(float* max, float* min, float value){
+    if (value > *max) {
+        *max = value;
+    }
+    if (value < *min) {
+        *min = value;
+    }
+}
+
+static inline void
+to_unit_dir(float* dir_x, float* dir_z) {
+    float dir_len = sqrt((*dir_x)*(*dir_x) + (*dir_z)*(*dir_z));
+    if (dir_len > 0 && dir_len != 1) { //convert to unit dir
+        *dir_x = *dir_x/dir_len;
+        *dir_z = *dir_z/dir_len;
+    }
+}
+
+static inline void
+set_safe_box(shape* s, float cx, float cz, float R) {
+    s->has_safe_box = true;
+    s->min_safe_x = cx - R;
+    s->max_safe_x = cx + R;
+    s->min_safe_z = cz - R;
+    s->max_safe_z = cz + R;
+}
+
+static inline void
+get_cover_row_and_col(map* m, float min_x, float max_x, float min_z, float max_z, int* min_col, int* max_col, int* min_row, int* max_row){
+    *min_col = floor(min_x/m->grid_size);
+    *max_col = floor(max_x/m->grid_size);
+    *min_row = floor(min_z/m->grid_size);
+    *max_row = floor(max_z/m->grid_size);
+    *min_col -= m->extra_check_grids;
+    *max_col += m->extra_check_grids;
+    *min_row -= m->extra_check_grids;
+    *max_row += m->extra_check_grids;
+}
+
+static inline bool
+get_safe_row_and_col(map* m, float min_x, float max_x, float min_z, float max_z, int* min_col, int* max_col, int* min_row, int* max_row){
+    *min_col = ceil(min_x/m->grid_size);
+    *max_col = floor(max_x/m->grid_size)-1;
+    *min_row = ceil(min_z/m->grid_size);
+    *max_row = floor(max_z/m->grid_size)-1;
+    return (min_row<=max_row && min_col<=max_col);
+}
+
+static inline bool
+is_valid_pos(map* m, float x, float z){
+    return (x>=0 && x<=m->max_x) && (z>=0 && z<=m->max_z);
+}
+
+void
+shape_circle(shape* s, float x, float z, float radius) {
+    memset(s, 0, sizeof(*s));
+    s->kind = SHAPE_CIRCLE;
+    s->x = x;
+    s->z = z;
+    s->radius = radius;
+    s->min_x = x - radius;
+    s->max_x = x + radius;
+    s->min_z = z - radius;
+    s->max_z = z + radius;
+    set_safe_box(s, x, z, HALF_SQRT2*radius);
+}
+
+void
+shape_rect(shape* s, float x, float z, float dir_x, float dir_z, float half_width, float half_height) {
+    memset(s, 0, sizeof(*s));
+    to_unit_dir(&dir_x, &dir_z);
+    s->kind = SHAPE_RECT;
+    s->x = x;
+    s->z = z;
+    s->dir_x = dir_x;
+    s->dir_z = dir_z;
+    s->half_width = half_width;
+    s->half_height = half_height;
+
+    float top_dx = dir_x*half_height;
+    float top_dz = dir_z*half_height;
+    float bottom_dx = -top_dx;
+    float bottom_dz = -top_dz;
+    float left_dx = (-dir_z)*half_width;
+    float left_dz = dir_x*half_width;
+    float right_dx = -left_dx;
+    float right_dz = -left_dz;
+
+    float lt_pos_x = x + top_dx + left_dx;
+    float lt_pos_z = z + top_dz + left_dz;
+    float rt_pos_x = x + top_dx + right_dx;
+    float rt_pos_z = z + top_dz + right_dz;
+    float lb_pos_x = x + bottom_dx + left_dx;
+    float lb_pos_z = z + bottom_dz + left_dz;
+    float rb_pos_x = x + bottom_dx + right_dx;
+    float rb_pos_z = z + bottom_dz + right_dz;
+
+    s->min_x = s->max_x = lt_pos_x;
+    s->min_z = s->max_z = lt_pos_z;
+    check_max_and_min(&s->max_x, &s->min_x, rt_pos_x);
+    check_max_and_min(&s->max_x, &s->min_x, lb_pos_x);
+    check_max_and_min(&s->max_x, &s->min_x, rb_pos_x);
+
+    check_max_and_min(&s->max_z, &s->min_z, rt_pos_z);
+    check_max_and_min(&s->max_z, &s->min_z, lb_pos_z);
+    check_max_and_min(&s->max_z, &s->min_z, rb_pos_z);
+
+    float safe_radius = HALF_SQRT2*((half_width<half_height) ? half_width : half_height);
+    set_safe_box(s, x, z, safe_radius);
+}
+
+void
+shape_sector(shape* s, float x, float z, float dir_x, float dir_z, float angle, float radius) {
+    memset(s, 0, sizeof(*s));
+    to_unit_dir(&dir_x, &dir_z);
+    s->kind = SHAPE_SECTOR;
+    s->x = x;
+    s->z = z;
+    s->dir_x = dir_x;
+    s->dir_z = dir_z;
+    s->radius = radius;
+    s->angle = angle;
+
+    float min_x,min_z,max_x,max_z;
+    min_x = max_x = x;
+    min_z = max_z = z;
+    float half_angle = angle*0.5;
+    float half_angle_rad = half_angle*PER_ANGLE_RADIAN;
+    s->half_angle_rad = half_angle_rad;
+    s->cos_half_angle = cos(half_angle_rad);
+    float edge_dir_x,edge_dir_z;
+    int i;
+    for (i=0; i<2; i++) {
+        if (i==0) {
+            vector_rotate(dir_x, dir_z, half_angle_rad, &edge_dir_x, &edge_dir_z);
+        }else {
+            vector_rotate(dir_x, dir_z, -half_angle_rad, &edge_dir_x, &edge_dir_z);
+        }
+        float edge_vx = x + edge_dir_x*radius;
+        float edge_vz = z + edge_dir_z*radius;
+        check_max_and_min(&max_x, &min_x, edge_vx);
+        check_max_and_min(&max_z, &min_z, edge_vz);
+    }
+
+    float rad = atan2(dir_z, dir_x);
+    float min_pi_rad = (rad - half_angle_rad)/M_PI;
+    float max_pi_rad = (rad + half_angle_rad)/M_PI;
+    float f;
+    float check_x,check_z;
+    for (f = -2; f <= 2; f += 0.5) {
+        if (f > max_pi_rad) {
+            break;
+        }
+        if (f < min_pi_rad) {
+            continue;
+        }
+        if (f==-2 || f==0 || f==2) {
+            check_x = x + radius;
+            check_z = 0;
+        }else if (f==1 || f==-1) {
+            check_x = x - radius;
+            check_z = 0;
+        }else if (f==-1.5 || f==0.5) {
+            check_x = 0;
+            check_z = z + radius;
+        }else {
+            check_x = 0;
+            check_z = z - radius;
+        }
+        check_max_and_min(&max_x, &min_x, check_x);
+        check_max_and_min(&max_z, &min_z, check_z);
+    }
+    s->min_x = min_x;
+    s->max_x = max_x;
+    s->min_z = min_z;
+    s->max_z = max_z;
+
+    if (half_angle < 90) {
+        float L = radius/(1 + sin(half_angle_rad));
+        float R = L*sin(half_angle_rad)*HALF_SQRT2;
+        set_safe_box(s, x + L*dir_x, z + L*dir_z, R);
+    }else {
+        float L = radius/2;
+        float R = L*HALF_SQRT2;
+        set_safe_box(s, x + L*dir_x, z + L*dir_z, R);
+    }
+}
+
+bool
+shape_cross(const shape* s, float x, float z, float radius) {
+    switch (s->kind) {
+    case SHAPE_CIRCLE:
+        return is_two_circle_cross(s->x, s->z, s->radius, x, z, radius);
+    case SHAPE_RECT:
+        return is_circle_rect_cross(s->x, s->z, s->dir_x, s->dir_z, s->half_width, s->half_height, x, z, radius);
+    case SHAPE_SECTOR:
+        return is_circle_sector_cross(s->x, s->z, s->dir_x, s->dir_z, s->cos_half_angle, s->radius, x, z, radius);
+    }
+    return false;
+}
+
+#ifdef AREA_STATS
+static void
+check_slow_query(map* m, const shape* s, int type, int limit_cnt, uint64_t t0, int towers, int tested, int hits,
+    int min_row, int max_row, int min_col, int max_col) {
+    slowlog * log = m->slowlog;
+    uint64_t ns = hist_now() - t0;
+    if (!((log->threshold_ns > 0 && ns >= log->threshold_ns) || (log->threshold_tested > 0 && tested >= log->threshold_tested))) {
+        return;
+    }
+    slow_query q;
+    q.ns = ns;
+    q.kind = s->kind;
+    q.type = type;
+    q.limit_cnt = limit_cnt;
+    q.towers = towers;
+    q.tested = tested;
+    q.hits = hits;
+    q.min_row = min_row;
+    q.max_row = max_row;
+    q.min_col = min_col;
+    q.max_col = max_col;
+    q.x = s->x;
+    q.z = s->z;
+    q.dir_x = s->dir_x;
+    q.dir_z = s->dir_z;
+    q.radius = s->radius;
+    q.half_width = s->half_width;
+    q.half_height = s->half_height;
+    q.angle = s->angle;
+    slowlog_record(log, &q);
+}
+#endif
+
+//exact test, a moving object is tested where it is dt after the map time
+static inline bool
+cross_object(map* m, const shape* s, object* obj, float dt) {
+    if (dt != 0 && obj->motion >= 0) {
+        const motion * mv = &m->motions[obj->motion];
+        return shape_cross(s, obj->x + mv->vx*dt, obj->z + mv->vz*dt, obj->radius);
+    }
+    return shape_cross(s, obj->x, obj->z, obj->radius);
+}
+
+static inline bool
+type_match(int type, const search_filter* f, const object* obj) {
+    return (type&obj->type) == type && (!f || filter_match(f, obj));
+}
+
+//radius added to the packed shape test of a tower at ox, oz: a rounded position is up to ~0.71*pos_unit off,
+//plus the float error of coordinates of that magnitude. Growing the radius moves the apex of a sector back,
+//which widens it sideways by only pad*sin(half_angle); below about a degree the packed test is skipped (-1)
+static inline float
+packed_pad(const shape* s, float pos_unit, float ox, float oz, float g) {
+    float mag = fabsf(ox) + fabsf(oz) + 2*g + fabsf(s->x) + fabsf(s->z);
+    float err = pos_unit + 8*FLT_EPSILON*mag;
+    if (s->kind != SHAPE_SECTOR) {
+        return 2*err;
+    }
+    float sin_half = fabsf(sinf(s->half_angle_rad));
+    return sin_half < 0.02f ? -1 : 2*err/sin_half;
+}
+
+//a packed type that is not PACKED_WIDE is the whole type, the masks are decided on it
+static inline bool
+packed_reject(const shape* s, const packed_obj* p, float ox, float oz, float pos_unit, float radius_unit, float pad, bool safe,
+    int type, const search_filter* f) {
+    if (p->type != PACKED_WIDE && ((type&p->type) != type
+        || (f && ((f->any && !(p->type&f->any)) || (p->type&f->none))))) {
+        return true;
+    }
+    return !safe && pad >= 0 && p->radius != PACKED_WIDE
+        && !shape_cross(s, ox + p->x*pos_unit, oz + p->z*pos_unit, p->radius*radius_unit + pad);
+}
+
+//compact tower scan: type and shape are tried on the packed entries first, with the radius
+//grown past the position rounding (packed_pad), only the entries that pass read the object for the exact test
+static bool
+scan_compact(map* m, tower* t, const shape* s, float dt, bool safe, int type, const search_filter* f, int limit_cnt, int* n,
+    search_cb cb, void* ud) {
+    float g = m->grid_size;
+    float pos_unit = g/PACKED_POS_UNITS;
+    float radius_unit = g/PACKED_RADIUS_UNITS;
+    float ox = t->cx - g*0.5f;
+    float oz = t->cz - g*0.5f;
+    float pad = packed_pad(s, pos_unit, ox, oz, g);
+    const packed_obj * p = t->packed;
+    int i;
+    for (i=0; i<t->cnt; i++, p++) {
+        if (packed_reject(s, p, ox, oz, pos_unit, radius_unit, pad, safe, type, f)) {
+            continue;
+        }
+        object * obj = t->refs[i];
+        if (!type_match(type, f, obj)) {
+            continue;
+        }
+        if (safe || cross_object(m, s, obj, dt)) {
+            cb(ud, obj);
+            if (++(*n) >= limit_cnt) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//every object of a tower, true once limit_cnt is reached
+static inline bool
+scan_tower(map* m, tower* t, const shape* s, float dt, bool safe, int type, const search_filter* f, int limit_cnt, int* n, int* tested,
+    search_cb cb, void* ud) {
+    if (!t->pHead) {
+        *tested += t->cnt;
+        return scan_compact(m, t, s, dt, safe, type, f, limit_cnt, n, cb, ud);
+    }
+    object* pCur = t->pHead->pNext;
+    if (safe) { //safe area
+        while (pCur != t->pHead) {
+            (*tested)++;
+            if (type_match(type, f, pCur)) {
+                cb(ud, pCur);
+                if (++(*n) >= limit_cnt) {
+                    return true;
+                }
+            }
+            pCur = pCur->pNext;
+        }
+        return false;
+    }
+    while (pCur != t->pHead) {
+        (*tested)++;
+        if (type_match(type, f, pCur) && cross_object(m, s, pCur, dt)) {
+            cb(ud, pCur);
+            if (++(*n) >= limit_cnt) {
+                return true;
+            }
+        }
+        pCur = pCur->pNext;
+    }
+    return false;
+}
+
+//the quadtree only knows the type, the rest of a filter is applied to its hits
+typedef struct filtered_hits {
+    const search_filter * f;
+    int limit_cnt;
+    int n;
+    search_cb cb;
+    void * ud;
+} filtered_hits;
+
+static void
+filter_hit(void* ud, object* obj) {
+    filtered_hits * fh = ud;
+    if (fh->n < fh->limit_cnt && filter_match(fh->f, obj)) {
+        fh->n++;
+        fh->cb(fh->ud, obj);
+    }
+}
+
+//what a grid search walked and found, for the stats
+typedef struct search_walk {
+    int n;
+    int towers;
+    int safe_towers;
+    int tested;
+    bool truncated;
+    int min_row, max_row, min_col, max_col; //cover box
+} search_walk;
+
+//the towers under the cover box of s, in storage order
+static void
+walk_cover(map* m, const shape* s, float dt, int type, const search_filter* f, int limit_cnt, search_walk* w,
+    search_cb cb, void* ud) {
+    get_cover_row_and_col(m, s->min_x, s->max_x, s->min_z, s->max_z, &w->min_col, &w->max_col, &w->min_row, &w->max_row);
+    if (dt != 0) { //objects may have left their tower by up to max_speed*dt, and the safe box no longer holds
+        int drift = ceil(m->max_speed*fabsf(dt)/m->grid_size);
+        w->min_col -= drift;
+        w->max_col += drift;
+        w->min_row -= drift;
+        w->max_row += drift;
+    }
+
+    int min_safe_col,max_safe_col,min_safe_row,max_safe_row;
+    bool has_safe = dt == 0 && s->has_safe_box && get_safe_row_and_col(m, s->min_safe_x, s->max_safe_x, s->min_safe_z, s->max_safe_z, &min_safe_col, &max_safe_col, &min_safe_row, &max_safe_row);
+    tower_walk tw;
+    tower_walk_begin(m, &tw, w->min_row, w->max_row, w->min_col, w->max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &tw))) {
+        w->towers++;
+        bool safe = has_safe && tw.row>=min_safe_row && tw.row<=max_safe_row && tw.col>=min_safe_col && tw.col<=max_safe_col;
+        if (safe) {
+            w->safe_towers++;
+        }
+        if (scan_tower(m, t, s, dt, safe, type, f, limit_cnt, &w->n, &w->tested, cb, ud)) {
+            w->truncated = true;
+            return;
+        }
+    }
+}
+
+int
+map_search(map* m, const shape* s, int type, int limit_cnt, search_cb cb, void* ud) {
+    return map_search_at(m, s, m->now, type, NULL, limit_cnt, cb, ud);
+}
+
+//search against the positions at time t, moving objects are extrapolated from the map time
+int
+map_search_at(map* m, const shape* s, double t, int type, const search_filter* f, int limit_cnt, search_cb cb, void* ud) {
+    if (!is_valid_pos(m, s->x, s->z)) {
+        return 0;
+    }
+    float dt = m->motion_cnt > 0 ? t - m->now : 0;
+#ifdef AREA_STATS
+    uint64_t t0 = m->slowlog ? hist_now() : 0;
+#endif
+    m->query_cnt++;
+    m->query_width_sum += s->max_x - s->min_x;
+    m->query_height_sum += s->max_z - s->min_z;
+    search_walk w;
+    memset(&w, 0, sizeof(w));
+    if (m->qt) {
+        int qt_counter[3] = {0, 0, 0}; //keep the grid loop counters in registers
+        w.min_row = w.max_row = w.min_col = w.max_col = -1;
+        if (f) {
+            filtered_hits fh = {f, limit_cnt, 0, cb, ud};
+            qtree_search(m->qt, s, type, 0x7fffffff, filter_hit, &fh, &qt_counter[0], &qt_counter[1], &qt_counter[2]);
+            w.n = fh.n;
+        }else {
+            w.n = qtree_search(m->qt, s, type, limit_cnt, cb, ud, &qt_counter[0], &qt_counter[1], &qt_counter[2]);
+        }
+        w.towers = qt_counter[0];
+        w.safe_towers = qt_counter[1];
+        w.tested = qt_counter[2];
+        w.truncated = w.n >= limit_cnt;
+    }else if (m->cache && dt == 0 && !f) { //the cached candidates of the tower the center is in get the exact test
+        const cache_entry * e = qcache_get(m, s, type);
+        w.min_row = e->min_row;
+        w.max_row = e->max_row;
+        w.min_col = e->min_col;
+        w.max_col = e->max_col;
+        int i;
+        for (i=0; i<e->cnt; i++) {
+            object * obj = e->cands[i];
+            w.tested++;
+            if (shape_cross(s, obj->x, obj->z, obj->radius)) {
+                cb(ud, obj);
+                if (++w.n >= limit_cnt) {
+                    w.truncated = true;
+                    break;
+                }
+            }
+        }
+    }else {
+        walk_cover(m, s, dt, type, f, limit_cnt, &w, cb, ud);
+    }
+    if (w.truncated) {
+        STAT_INC(m, limit_truncations);
+    }
+    STAT_INC(m, searches);
+    STAT_ADD(m, towers_visited, w.towers);
+    STAT_ADD(m, safe_towers, w.safe_towers);
+    STAT_ADD(m, objects_tested, w.tested);
+    STAT_ADD(m, hits, w.n);
+#ifdef AREA_STATS
+    if (m->slowlog && !f && dt == 0) {
+        check_slow_query(m, s, type, limit_cnt, t0, w.towers, w.tested, w.n, w.min_row, w.max_row, w.min_col, w.max_col);
+    }
+#endif
+    return w.n;
+}
+
+//the hits of map_search at the map time for internal scans: no query stats, counters, slowlog or cache
+int
+map_scan(map* m, const shape* s, int type, search_cb cb, void* ud) {
+    if (m->qt) {
+        int towers,safe_towers,tested;
+        return qtree_search(m->qt, s, type, 0x7fffffff, cb, ud, &towers, &safe_towers, &tested);
+    }
+    search_walk w;
+    memset(&w, 0, sizeof(w));
+    walk_cover(m, s, 0, type, NULL, 0x7fffffff, &w, cb, ud);
+    return w.n;
+}
+
+typedef struct nearest_hit {
+    object * obj;
+    float d2;
+} nearest_hit;
+
+typedef struct nearest_buf {
+    nearest_hit * hits;
+    int cnt;
+    int cap;
+    float x;
+    float z;
+} nearest_buf;
+
+static void
+nearest_collect(void* ud, object* obj) {
+    nearest_buf * nb = ud;
+    if (nb->cnt >= nb->cap) {
+        nb->cap = nb->cap ? nb->cap*2 : 64;
+        nb->hits = realloc(nb->hits, nb->cap*sizeof(nearest_hit));
+    }
+    float dx = obj->x - nb->x;
+    float dz = obj->z - nb->z;
+    nb->hits[nb->cnt].obj = obj;
+    nb->hits[nb->cnt].d2 = dx*dx + dz*dz;
+    nb->cnt++;
+}
+
+static int
+cmp_nearest(const void* a, const void* b) {
+    float da = ((const nearest_hit *)a)->d2;
+    float db = ((const nearest_hit *)b)->d2;
+    return (da > db) - (da < db);
+}
+
+//the cover box walked in rings around the tower of the center, ring j holds the towers j rows or cols away
+typedef struct ring_walk {
+    int row;
+    int col;
+    int min_row, max_row, min_col, max_col;
+    bool has_safe;
+    int min_safe_row, max_safe_row, min_safe_col, max_safe_col;
+} ring_walk;
+
+static bool
+scan_ring(map* m, const ring_walk* w, int j, const shape* s, int type, const search_filter* f, int limit_cnt,
+    int* n, int* towers, int* tested, search_cb cb, void* ud) {
+    int r,c;
+    for (r=w->row-j; r<=w->row+j; r++) {
+        if (r < w->min_row || r > w->max_row) {
+            continue;
+        }
+        int step = (r == w->row-j || r == w->row+j) ? 1 : 2*j; //rows inside the ring only have its two ends
+        for (c=w->col-j; c<=w->col+j; c+=step) {
+            if (c < w->min_col || c > w->max_col) {
+                continue;
+            }
+            tower * t = get_tower(m, r, c, false);
+            if (!t) {
+                continue;
+            }
+            (*towers)++;
+            bool safe = w->has_safe && r>=w->min_safe_row && r<=w->max_safe_row && c>=w->min_safe_col && c<=w->max_safe_col;
+            if (scan_tower(m, t, s, 0, safe, type, f, limit_cnt, n, tested, cb, ud)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//towers in rings outward from the tower of the center, limit_cnt then keeps hits near the center instead of
+//the ones of the first rows; exact collects the hits until no further ring can hold one closer than the
+//limit_cnt nearest found and reports those by distance. The quadtree backend always sorts every hit
+int
+map_search_nearest(map* m, const shape* s, int type, const search_filter* f, int limit_cnt, bool exact, search_cb cb, void* ud) {
+    if (!is_valid_pos(m, s->x, s->z) || limit_cnt <= 0) {
+        return 0;
+    }
+    nearest_buf nb = {NULL, 0, 0, s->x, s->z};
+    int n = 0;
+    int i;
+    if (m->qt) {
+        map_search_at(m, s, m->now, type, f, 0x7fffffff, nearest_collect, &nb);
+        qsort(nb.hits, nb.cnt, sizeof(nearest_hit), cmp_nearest);
+        for (i=0; i<nb.cnt && i<limit_cnt; i++) {
+            cb(ud, nb.hits[i].obj);
+        }
+        free(nb.hits);
+        return i;
+    }
+#ifdef AREA_STATS
+    uint64_t t0 = m->slowlog ? hist_now() : 0;
+#endif
+    m->query_cnt++;
+    m->query_width_sum += s->max_x - s->min_x;
+    m->query_height_sum += s->max_z - s->min_z;
+    float g = m->grid_size;
+    ring_walk w;
+    w.row = s->z/g;
+    w.col = s->x/g;
+    get_cover_row_and_col(m, s->min_x, s->max_x, s->min_z, s->max_z, &w.min_col, &w.max_col, &w.min_row, &w.max_row);
+    w.min_row = w.min_row > 0 ? w.min_row : 0;
+    w.min_col = w.min_col > 0 ? w.min_col : 0;
+    w.max_row = w.max_row < m->max_row - 1 ? w.max_row : m->max_row - 1;
+    w.max_col = w.max_col < m->max_col - 1 ? w.max_col : m->max_col - 1;
+    w.has_safe = s->has_safe_box && get_safe_row_and_col(m, s->min_safe_x, s->max_safe_x, s->min_safe_z, s->max_safe_z,
+        &w.min_safe_col, &w.max_safe_col, &w.min_safe_row, &w.max_safe_row);
+    int rings = w.row - w.min_row;
+    rings = w.max_row - w.row > rings ? w.max_row - w.row : rings;
+    rings = w.col - w.min_col > rings ? w.col - w.min_col : rings;
+    rings = w.max_col - w.col > rings ? w.max_col - w.col : rings;
+    int towers = 0;
+    int tested = 0;
+    int j;
+    if (!exact) {
+        for (j=0; j<=rings; j++) {
+            if (scan_ring(m, &w, j, s, type, f, limit_cnt, &n, &towers, &tested, cb, ud)) {
+                STAT_INC(m, limit_truncations);
+                break;
+            }
+        }
+    }else {
+        //ring j is at least (j-1)*g + edge from the center, edge being its distance to the border of its tower
+        float ex = s->x - w.col*g;
+        float ez = s->z - w.row*g;
+        float edge = fminf(fminf(ex, g - ex), fminf(ez, g - ez));
+        bool bounded = false;
+        float bound2 = 0;
+        int collected = 0;
+        for (j=0; j<=rings; j++) {
+            float near = (j - 1)*g + edge;
+            if (bounded && j > 0 && near*near > bound2) {
+                STAT_INC(m, limit_truncations);
+                break;
+            }
+            scan_ring(m, &w, j, s, type, f, 0x7fffffff, &collected, &towers, &tested, nearest_collect, &nb);
+            if (!bounded && nb.cnt >= limit_cnt) {
+                qsort(nb.hits, nb.cnt, sizeof(nearest_hit), cmp_nearest);
+                bound2 = nb.hits[limit_cnt - 1].d2;
+                bounded = true;
+            }
+        }
+        qsort(nb.hits, nb.cnt, sizeof(nearest_hit), cmp_nearest);
+        for (n=0; n<nb.cnt && n<limit_cnt; n++) {
+            cb(ud, nb.hits[n].obj);
+        }
+        free(nb.hits);
+    }
+    STAT_INC(m, searches);
+    STAT_ADD(m, towers_visited, towers);
+    STAT_ADD(m, objects_tested, tested);
+    STAT_ADD(m, hits, n);
+#ifdef AREA_STATS
+    if (m->slowlog && !f) {
+        check_slow_query(m, s, type, limit_cnt, t0, towers, tested, n, w.min_row, w.max_row, w.min_col, w.max_col);
+    }
+#endif
+    return n;
+}
+
+//like map_search on the grid backend, restricted to the towers whose version is past since
+int
+map_search_since(map* m, const shape* s, int type, uint64_t since, search_cb cb, void* ud) {
+    if (m->qt || !is_valid_pos(m, s->x, s->z)) {
+        return 0;
+    }
+    int n = 0;
+    int towers = 0;
+    int tested = 0;
+    int min_col,max_col,min_row,max_row;
+    get_cover_row_and_col(m, s->min_x, s->max_x, s->min_z, s->max_z, &min_col, &max_col, &min_row, &max_row);
+    int min_safe_col,max_safe_col,min_safe_row,max_safe_row;
+    bool has_safe = s->has_safe_box && get_safe_row_and_col(m, s->min_safe_x, s->max_safe_x, s->min_safe_z, s->max_safe_z, &min_safe_col, &max_safe_col, &min_safe_row, &max_safe_row);
+    tower_walk tw;
+    tower_walk_begin(m, &tw, min_row, max_row, min_col, max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &tw))) {
+        if (t->version <= since) {
+            continue;
+        }
+        towers++;
+        bool safe = has_safe && tw.row>=min_safe_row && tw.row<=max_safe_row && tw.col>=min_safe_col && tw.col<=max_safe_col;
+        scan_tower(m, t, s, 0, safe, type, NULL, 0x7fffffff, &n, &tested, cb, ud);
+    }
+    STAT_ADD(m, towers_visited, towers);
+    STAT_ADD(m, objects_tested, tested);
+    STAT_ADD(m, hits, n);
+    return n;
+}
+
+//node index, -1 once the expression is full
+int
+compound_shape(compound* c, const shape* s) {
+    if (c->cnt >= COMPOUND_NODE_MAX) {
+        return -1;
+    }
+    compound_node * node = &c->nodes[c->cnt];
+    node->op = COMPOUND_SHAPE;
+    node->left = node->right = -1;
+    node->s = *s;
+    c->root = c->cnt;
+    return c->cnt++;
+}
+
+int
+compound_op(compound* c, int op, int left, int right) {
+    if (c->cnt >= COMPOUND_NODE_MAX || left < 0 || left >= c->cnt || right < 0 || right >= c->cnt) {
+        return -1;
+    }
+    compound_node * node = &c->nodes[c->cnt];
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    c->root = c->cnt;
+    return c->cnt++;
+}
+
+//cover box of a node: min_x, max_x, min_z, max_z, false when it is empty
+static bool
+compound_box(const compound* c, int i, float* box) {
+    const compound_node * node = &c->nodes[i];
+    if (node->op == COMPOUND_SHAPE) {
+        box[0] = node->s.min_x;
+        box[1] = node->s.max_x;
+        box[2] = node->s.min_z;
+        box[3] = node->s.max_z;
+        return true;
+    }
+    float rbox[4];
+    bool l = compound_box(c, node->left, box);
+    bool r = compound_box(c, node->right, rbox);
+    switch (node->op) {
+    case COMPOUND_UNION:
+        if (!l || !r) {
+            if (r) {
+                memcpy(box, rbox, sizeof(rbox));
+            }
+            return l || r;
+        }
+        box[0] = fminf(box[0], rbox[0]);
+        box[1] = fmaxf(box[1], rbox[1]);
+        box[2] = fminf(box[2], rbox[2]);
+        box[3] = fmaxf(box[3], rbox[3]);
+        return true;
+    case COMPOUND_INTERSECT:
+        if (!l || !r) {
+            return false;
+        }
+        box[0] = fmaxf(box[0], rbox[0]);
+        box[1] = fminf(box[1], rbox[1]);
+        box[2] = fmaxf(box[2], rbox[2]);
+        box[3] = fminf(box[3], rbox[3]);
+        return box[0] <= box[1] && box[2] <= box[3];
+    }
+    return l; //difference
+}
+
+#define CLASS_OUT 0
+#define CLASS_PART 1
+#define CLASS_IN 2
+
+//the towers each shape covers and the ones inside its safe box
+typedef struct compound_range {
+    int min_row, max_row, min_col, max_col;
+    bool has_safe;
+    int min_safe_row, max_safe_row, min_safe_col, max_safe_col;
+} compound_range;
+
+//classifies the tower at row r, col col for every node: no object in it can cross, every one does,
+//or each object has to be tested
+static int
+compound_classify(const compound* c, const compound_range* rg, int i, int r, int col, char* cls) {
+    const compound_node * node = &c->nodes[i];
+    int k;
+    if (node->op == COMPOUND_SHAPE) {
+        const compound_range * g = &rg[i];
+        if (r < g->min_row || r > g->max_row || col < g->min_col || col > g->max_col) {
+            k = CLASS_OUT;
+        }else if (g->has_safe && r >= g->min_safe_row && r <= g->max_safe_row && col >= g->min_safe_col && col <= g->max_safe_col) {
+            k = CLASS_IN;
+        }else {
+            k = CLASS_PART;
+        }
+    }else {
+        int l = compound_classify(c, rg, node->left, r, col, cls);
+        int rr = compound_classify(c, rg, node->right, r, col, cls);
+        if (node->op == COMPOUND_UNION) {
+            k = l > rr ? l : rr;
+        }else if (node->op == COMPOUND_INTERSECT) {
+            k = l < rr ? l : rr;
+        }else {
+            k = l < CLASS_IN - rr ? l : CLASS_IN - rr;
+        }
+    }
+    cls[i] = k;
+    return k;
+}
+
+//exact test of an object, the nodes the tower settled are not evaluated
+static bool
+compound_cross(const compound* c, int i, const char* cls, const object* obj) {
+    if (cls[i] != CLASS_PART) {
+        return cls[i] == CLASS_IN;
+    }
+    const compound_node * node = &c->nodes[i];
+    switch (node->op) {
+    case COMPOUND_SHAPE:
+        return shape_cross(&node->s, obj->x, obj->z, obj->radius);
+    case COMPOUND_UNION:
+        return compound_cross(c, node->left, cls, obj) || compound_cross(c, node->right, cls, obj);
+    case COMPOUND_INTERSECT:
+        return compound_cross(c, node->left, cls, obj) && compound_cross(c, node->right, cls, obj);
+    }
+    return compound_cross(c, node->left, cls, obj) && !compound_cross(c, node->right, cls, obj);
+}
+
+typedef struct compound_hits {
+    const compound * c;
+    const char * cls;
+    int type;
+    const search_filter * f;
+    int limit_cnt;
+    int n;
+    search_cb cb;
+    void * ud;
+} compound_hits;
+
+static void
+compound_hit(void* ud, object* obj) {
+    compound_hits * ch = ud;
+    if (ch->n < ch->limit_cnt && type_match(ch->type, ch->f, obj) && compound_cross(ch->c, ch->c->root, ch->cls, obj)) {
+        ch->n++;
+        ch->cb(ch->ud, obj);
+    }
+}
+
+//one pass over the towers of the combined cover box, each tower is classified once and an object
+//is reported at most once; objects are tested where they are at the map time
+int
+map_search_compound(map* m, const compound* c, int type, const search_filter* f, int limit_cnt, search_cb cb, void* ud) {
+    float box[4];
+    if (c->cnt <= 0 || !compound_box(c, c->root, box) || box[1] < 0 || box[0] > m->max_x || box[3] < 0 || box[2] > m->max_z) {
+        return 0;
+    }
+    char cls[COMPOUND_NODE_MAX];
+    compound_hits ch = {c, cls, type, f, limit_cnt, 0, cb, ud};
+    int towers = 0;
+    int safe_towers = 0;
+    int tested = 0;
+    m->query_cnt++;
+    m->query_width_sum += box[1] - box[0];
+    m->query_height_sum += box[3] - box[2];
+    int i;
+    if (m->qt) {
+        //the box as a rect, every object of the expression crosses it
+        memset(cls, CLASS_PART, sizeof(cls));
+        shape s;
+        shape_rect(&s, (box[0] + box[1])*0.5f, (box[2] + box[3])*0.5f, 0, 1, (box[1] - box[0])*0.5f, (box[3] - box[2])*0.5f);
+        qtree_search(m->qt, &s, type, 0x7fffffff, compound_hit, &ch, &towers, &safe_towers, &tested);
+        goto done;
+    }
+    compound_range rg[COMPOUND_NODE_MAX];
+    for (i=0; i<c->cnt; i++) {
+        const shape * s = &c->nodes[i].s;
+        compound_range * g = &rg[i];
+        if (c->nodes[i].op != COMPOUND_SHAPE) {
+            continue;
+        }
+        get_cover_row_and_col(m, s->min_x, s->max_x, s->min_z, s->max_z, &g->min_col, &g->max_col, &g->min_row, &g->max_row);
+        g->has_safe = s->has_safe_box && get_safe_row_and_col(m, s->min_safe_x, s->max_safe_x, s->min_safe_z, s->max_safe_z,
+            &g->min_safe_col, &g->max_safe_col, &g->min_safe_row, &g->max_safe_row);
+    }
+    int min_row,max_row,min_col,max_col;
+    get_cover_row_and_col(m, box[0], box[1], box[2], box[3], &min_col, &max_col, &min_row, &max_row);
+    tower_walk tw;
+    tower_walk_begin(m, &tw, min_row, max_row, min_col, max_col);
+    tower * t;
+    while ((t = tower_walk_next(m, &tw))) {
+        if (compound_classify(c, rg, c->root, tw.row, tw.col, cls) == CLASS_OUT) {
+            continue;
+        }
+        towers++;
+        if (cls[c->root] == CLASS_IN) {
+            safe_towers++;
+        }
+        if (!t->pHead) {
+            const packed_obj * p = t->packed;
+            int k;
+            for (k=0; k<t->cnt && ch.n<limit_cnt; k++, p++) {
+                tested++;
+                //only the masks are tried on the packed entry, the shapes are tested on the object
+                if (!packed_reject(NULL, p, 0, 0, 0, 0, 0, true, type, f)) {
+                    compound_hit(&ch, t->refs[k]);
+                }
+            }
+        }else {
+            object * pCur;
+            for (pCur=t->pHead->pNext; pCur!=t->pHead && ch.n<limit_cnt; pCur=pCur->pNext) {
+                tested++;
+                compound_hit(&ch, pCur);
+            }
+        }
+        if (ch.n >= limit_cnt) {
+            break;
+        }
+    }
+done:
+    if (ch.n >= limit_cnt) {
+        STAT_INC(m, limit_truncations);
+    }
+    STAT_INC(m, searches);
+    STAT_ADD(m, towers_visited, towers);
+    STAT_ADD(m, safe_towers, safe_towers);
+    STAT_ADD(m, objects_tested, tested);
+    STAT_ADD(m, hits, ch.n);
+    return ch.n;
+}
+
+static void
+collect_hit(void* ud, object* obj) {
+    search_cursor * c = ud;
+    if (c->buf_cnt >= c->buf_cap) {
+        c->buf_cap = c->buf_cap ? c->buf_cap*2 : 64;
+        c->buf = realloc(c->buf, c->buf_cap*sizeof(object*));
+    }
+    c->buf[c->buf_cnt++] = obj;
+}
+
+//a cursor yields the hits of a search one by one, the traversal stops wherever the caller stops;
+//the quadtree backend has no resumable traversal, its hits are collected up front in buf.
+//a new cursor starts zeroed, buf is kept across searches until map_cursor_free
+void
+map_cursor_begin(map* m, search_cursor* c, const shape* s, double t, int type, const search_filter* f, int limit_cnt) {
+    c->s = *s;
+    c->type = type;
+    c->filtered = f != NULL;
+    if (f) {
+        c->filter = *f;
+    }
+    c->limit_cnt = limit_cnt;
+    c->n = 0;
+    c->version = m->version;
+    c->state = CURSOR_DONE;
+    c->tower = NULL;
+    c->buf_cnt = 0;
+    c->buf_pos = 0;
+    if (!is_valid_pos(m, s->x, s->z) || limit_cnt <= 0) {
+        return;
+    }
+    if (m->qt) {
+        map_search_at(m, s, t, type, f, limit_cnt, collect_hit, c);
+        c->version = m->version;
+        c->state = CURSOR_ACTIVE;
+        return;
+    }
+    STAT_INC(m, searches);
+    m->query_cnt++;
+    m->query_width_sum += s->max_x - s->min_x;
+    m->query_height_sum += s->max_z - s->min_z;
+    c->dt = m->motion_cnt > 0 ? t - m->now : 0;
+    int min_col,max_col,min_row,max_row;
+    get_cover_row_and_col(m, s->min_x, s->max_x, s->min_z, s->max_z, &min_col, &max_col, &min_row, &max_row);
+    if (c->dt != 0) {
+        int drift = ceil(m->max_speed*fabsf(c->dt)/m->grid_size);
+        min_col -= drift;
+        max_col += drift;
+        min_row -= drift;
+        max_row += drift;
+    }
+    c->has_safe = c->dt == 0 && s->has_safe_box && get_safe_row_and_col(m, s->min_safe_x, s->max_safe_x, s->min_safe_z, s->max_safe_z,
+        &c->min_safe_col, &c->max_safe_col, &c->min_safe_row, &c->max_safe_row);
+    tower_walk_begin(m, &c->walk, min_row, max_row, min_col, max_col);
+    c->state = CURSOR_ACTIVE;
+}
+
+static bool
+cursor_next_tower(map* m, search_cursor* c) {
+    tower * t = tower_walk_next(m, &c->walk);
+    c->tower = t;
+    if (!t) {
+        return false;
+    }
+    STAT_INC(m, towers_visited);
+    const tower_walk * w = &c->walk;
+    c->safe = c->has_safe && w->row >= c->min_safe_row && w->row <= c->max_safe_row
+        && w->col >= c->min_safe_col && w->col <= c->max_safe_col;
+    c->cur = t->pHead ? t->pHead->pNext : NULL;
+    c->idx = 0;
+    return true;
+}
+
+static object*
+cursor_scan(map* m, search_cursor* c) {
+    tower * t = c->tower;
+    const shape * s = &c->s;
+    int type = c->type;
+    const search_filter * f = c->filtered ? &c->filter : NULL;
+    if (!t->pHead) {
+        float g = m->grid_size;
+        float pos_unit = g/PACKED_POS_UNITS;
+        float radius_unit = g/PACKED_RADIUS_UNITS;
+        float ox = t->cx - g*0.5f;
+        float oz = t->cz - g*0.5f;
+        float pad = packed_pad(s, pos_unit, ox, oz, g);
+        while (c->idx < t->cnt) {
+            int i = c->idx++;
+            STAT_INC(m, objects_tested);
+            if (packed_reject(s, &t->packed[i], ox, oz, pos_unit, radius_unit, pad, c->safe, type, f)) {
+                continue;
+            }
+            object * obj = t->refs[i];
+            if (type_match(type, f, obj) && (c->safe || cross_object(m, s, obj, c->dt))) {
+                return obj;
+            }
+        }
+        return NULL;
+    }
+    while (c->cur != t->pHead) {
+        object * obj = c->cur;
+        c->cur = obj->pNext;
+        STAT_INC(m, objects_tested);
+        if (type_match(type, f, obj) && (c->safe || cross_object(m, s, obj, c->dt))) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+//next hit, NULL once the search is over or when objects entered or left towers since the last
+//step, the cursor is then CURSOR_STALE
+object*
+map_cursor_next(map* m, search_cursor* c) {
+    if (c->state != CURSOR_ACTIVE) {
+        return NULL;
+    }
+    if (c->version != m->version) {
+        c->state = CURSOR_STALE;
+        return NULL;
+    }
+    object * obj = NULL;
+    if (m->qt) {
+        obj = c->buf_pos < c->buf_cnt ? c->buf[c->buf_pos++] : NULL;
+    }else {
+        while (!obj && (c->tower || cursor_next_tower(m, c))) {
+            obj = cursor_scan(m, c);
+            if (!obj) {
+                c->tower = NULL;
+            }
+        }
+    }
+    if (!obj) {
+        c->state = CURSOR_DONE;
+        return NULL;
+    }
+    if (!m->qt) { //map_search_at counted the quadtree hits
+        STAT_INC(m, hits);
+    }
+    if (++c->n >= c->limit_cnt) {
+        c->state = CURSOR_DONE;
+    }
+    return obj;
+}
+
+void
+map_cursor_free(search_cursor* c) {
+    free(c->buf);
+    c->buf = NULL;
+    c->buf_cap = 0;
+}
@@ -0,0 +1,139 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+#include "divgrid.h"
+
+#define HALF_SQRT2 0.7071
+#define PER_ANGLE_RADIAN M_PI/180
+#define DEFAULT_LIMIT_CNT 0x7fff
+
+#define SHAPE_CIRCLE 1
+#define SHAPE_RECT 2
+#define SHAPE_SECTOR 3
+
+typedef struct shape {
+    int kind;
+    float x;
+    float z;
+    float dir_x;
+    float dir_z;
+    float radius;
+    float half_width;
+    float half_height;
+    float angle;
+    float half_angle_rad;
+    double cos_half_angle;
+    //cover box
+    float min_x;
+    float max_x;
+    float min_z;
+    float max_z;
+    //safe box, every object center inside it is a hit
+    bool has_safe_box;
+    float min_safe_x;
+    float max_safe_x;
+    float min_safe_z;
+    float max_safe_z;
+} shape;
+
+typedef void (*search_cb)(void* ud, object* obj);
+
+#define FILTER_EXCLUDE_MAX 16
+
+//on top of the all-bits type: any-of and none-of masks, a few excluded ids and closed ranges
+//on the attribute slots selected by attr_mask
+typedef struct search_filter {
+    int any;
+    int none;
+    int exclude_cnt;
+    uint64_t exclude[FILTER_EXCLUDE_MAX];
+    int attr_mask;
+    float attr_min[OBJECT_ATTR_CNT];
+    float attr_max[OBJECT_ATTR_CNT];
+} search_filter;
+
+static inline bool
+filter_match(const search_filter* f, const object* obj) {
+    if ((f->any && !(obj->type&f->any)) || (obj->type&f->none)) {
+        return false;
+    }
+    int i;
+    for (i=0; i<f->exclude_cnt; i++) {
+        if (obj->id == f->exclude[i]) {
+            return false;
+        }
+    }
+    for (i=0; i<OBJECT_ATTR_CNT; i++) {
+        if ((f->attr_mask & (1<<i)) && !(obj->attr[i] >= f->attr_min[i] && obj->attr[i] <= f->attr_max[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//a small expression over shapes, an object is tested against each shape and the answers are combined;
+//an operator node refers to its two operands by index
+#define COMPOUND_SHAPE 0
+#define COMPOUND_UNION 1
+#define COMPOUND_INTERSECT 2
+#define COMPOUND_DIFF 3 //left but not right
+#define COMPOUND_NODE_MAX 32
+
+typedef struct compound_node {
+    int op;
+    int left;
+    int right;
+    shape s; //COMPOUND_SHAPE
+} compound_node;
+
+typedef struct compound {
+    int cnt;
+    int root;
+    compound_node nodes[COMPOUND_NODE_MAX];
+} compound;
+
+void shape_circle(shape*, float, float, float);
+void shape_rect(shape*, float, float, float, float, float, float);
+void shape_sector(shape*, float, float, float, float, float, float);
+bool shape_cross(const shape*, float, float, float);
+int map_search(map*, const shape*, int, int, search_cb, void*);
+int map_search_at(map*, const shape*, double, int, const search_filter*, int, search_cb, void*);
+int map_scan(map*, const shape*, int, search_cb, void*);
+int map_search_nearest(map*, const shape*, int, const search_filter*, int, bool, search_cb, void*);
+int map_search_since(map*, const shape*, int, uint64_t, search_cb, void*);
+int compound_shape(compound*, const shape*);
+int compound_op(compound*, int, int, int);
+int map_search_compound(map*, const compound*, int, const search_filter*, int, search_cb, void*);
+
+#define CURSOR_DONE 0
+#define CURSOR_ACTIVE 1
+#define CURSOR_STALE 2 //the map changed under the cursor
+
+//resumable search: the walk over the cover box, the tower being scanned and the position inside it
+typedef struct search_cursor {
+    shape s;
+    int type;
+    bool filtered;
+    search_filter filter;
+    int limit_cnt;
+    int n;
+    int state;
+    float dt;
+    uint64_t version;
+    tower_walk walk; //the cover box
+    bool has_safe;
+    int min_safe_row, max_safe_row, min_safe_col, max_safe_col;
+    tower * tower; //NULL between towers
+    bool safe;
+    object * cur; //list towers: next object
+    int idx;      //compact towers: next entry
+    object ** buf; //quadtree backend: every hit
+    int buf_cnt;
+    int buf_cap;
+    int buf_pos;
+} search_cursor;
+
+void map_cursor_begin(map*, search_cursor*, const shape*, double, int, const search_filter*, int);
+object* map_cursor_next(map*, search_cursor*);
+void map_cursor_free(search_cursor*);
+
+#endif
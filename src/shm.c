@@ -0,0 +1,434 @@
+#include "shm.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_MIN_BUF_SIZE (1<<16)
+
+static inline size_t
+align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static inline size_t
+tower_table_size(int cells) {
+    return align8((cells + 1)*sizeof(int32_t));
+}
+
+static size_t
+image_size(map* m, int obj_cnt) {
+    return sizeof(shm_image) + tower_table_size(m->max_row*m->max_col)
+        + obj_cnt*sizeof(snapshot_obj) + m->size*sizeof(snapshot_slot);
+}
+
+static void
+set_name(char* dst, const char* name) {
+    snprintf(dst, SHM_NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static inline char *
+image_buffer(const shm_header* hdr, uint64_t seq) {
+    return (char*)hdr + sizeof(shm_header) + (seq%2)*hdr->buf_size;
+}
+
+static void
+segment_name(char* dst, const char* name, uint32_t gen) {
+    if (gen == 0) {
+        snprintf(dst, SHM_SEGMENT_NAME_MAX, "%s", name);
+    }else {
+        snprintf(dst, SHM_SEGMENT_NAME_MAX, "%s.%u", name, gen);
+    }
+}
+
+//O_EXCL: a name another map or process has published is never taken over
+static bool
+create_segment(const char* name, size_t buf_size, shm_header** out, size_t* out_size) {
+    buf_size = (buf_size + 4095) & ~(size_t)4095;
+    size_t size = sizeof(shm_header) + 2*buf_size;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    shm_header * hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->buf_size = buf_size;
+    hdr->version = SHM_VERSION;
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    *out = hdr;
+    *out_size = size;
+    return true;
+}
+
+//same counting sort as the snapshot, written straight into the buffer
+static void
+write_image(map* m, char* buf, int obj_cnt) {
+    shm_image * img = (shm_image*)buf;
+    int cells = m->max_row*m->max_col;
+    int32_t * first = (int32_t*)(buf + sizeof(*img));
+    img->max_x = m->max_x;
+    img->max_z = m->max_z;
+    img->grid_size = m->grid_size;
+    img->max_row = m->max_row;
+    img->max_col = m->max_col;
+    img->extra_check_grids = m->extra_check_grids;
+    img->obj_cnt = obj_cnt;
+    img->slot_size = m->size;
+    img->obj_offset = sizeof(*img) + tower_table_size(cells);
+    img->slot_offset = img->obj_offset + obj_cnt*sizeof(snapshot_obj);
+    snapshot_obj * objs = (snapshot_obj*)(buf + img->obj_offset);
+    snapshot_slot * slots = (snapshot_slot*)(buf + img->slot_offset);
+    memset(first, 0, (cells + 1)*sizeof(int32_t));
+    int i;
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        if (obj) {
+            first[snapshot_cell(m, obj) + 1]++;
+        }
+    }
+    for (i=0; i<cells; i++) {
+        first[i+1] += first[i];
+    }
+    int * cursor = malloc(cells*sizeof(int) + 1);
+    memcpy(cursor, first, cells*sizeof(int));
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        snapshot_slot * ss = &slots[i];
+        ss->id = m->slot_list[i].id;
+        ss->next = m->slot_list[i].next;
+        ss->obj = -1;
+        if (!obj) {
+            continue;
+        }
+        int n = cursor[snapshot_cell(m, obj)]++;
+        snapshot_obj * so = &objs[n];
+        so->id = obj->id;
+        so->x = obj->x;
+        so->z = obj->z;
+        so->radius = obj->radius;
+        so->type = obj->type;
+        ss->obj = n;
+    }
+    free(cursor);
+}
+
+//the old segment keeps its name and stays live until the next generation holds an image
+static int
+grow_segment(map* m, size_t need) {
+    shm_writer * w = m->shared;
+    char name[SHM_SEGMENT_NAME_MAX];
+    uint32_t gen = w->gen + 1;
+    segment_name(name, w->name, gen);
+    shm_header * hdr;
+    size_t size;
+    if (!create_segment(name, need*2, &hdr, &size)) {
+        //only this writer makes the generations of its name, a leftover is from one that died
+        shm_unlink(name);
+        if (!create_segment(name, need*2, &hdr, &size)) {
+            return 0;
+        }
+    }
+    shm_header * old = w->hdr;
+    size_t old_size = w->size;
+    uint32_t old_gen = w->gen;
+    w->hdr = hdr;
+    w->size = size;
+    w->gen = gen;
+    shm_publish(m);
+    __atomic_store_n(&w->base->next_gen, gen, __ATOMIC_RELEASE);
+    __atomic_store_n(&old->next_gen, gen, __ATOMIC_RELEASE);
+    __atomic_store_n(&old->retired, 1, __ATOMIC_RELEASE);
+    if (old != w->base) {
+        munmap(old, old_size);
+        segment_name(name, w->name, old_gen);
+        shm_unlink(name);
+    }
+    return 1;
+}
+
+int
+shm_publish(map* m) {
+    shm_writer * w = m->shared;
+    map_commit(m);
+    int obj_cnt = map_object_count(m);
+    size_t need = image_size(m, obj_cnt);
+    if (need > w->hdr->buf_size) { //readers switch over once the old segment is retired
+        return grow_segment(m, need);
+    }
+    shm_header * hdr = w->hdr;
+    uint64_t k = hdr->seq + 1;
+    __atomic_store_n(&hdr->begin, k, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    write_image(m, image_buffer(hdr, k), obj_cnt);
+    __atomic_store_n(&hdr->seq, k, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int
+shm_share(map* m, const char* name) {
+    shm_unshare(m);
+    shm_writer * w = malloc(sizeof(*w));
+    set_name(w->name, name);
+    size_t need = image_size(m, map_object_count(m));
+    if (!create_segment(w->name, need*2 > SHM_MIN_BUF_SIZE ? need*2 : SHM_MIN_BUF_SIZE, &w->base, &w->base_size)) {
+        free(w);
+        return 0;
+    }
+    w->hdr = w->base;
+    w->size = w->base_size;
+    w->gen = 0;
+    m->shared = w;
+    return shm_publish(m);
+}
+
+void
+shm_unshare(map* m) {
+    shm_writer * w = m->shared;
+    if (!w) {
+        return;
+    }
+    if (w->hdr != w->base) {
+        char name[SHM_SEGMENT_NAME_MAX];
+        __atomic_store_n(&w->hdr->retired, 1, __ATOMIC_RELEASE);
+        munmap(w->hdr, w->size);
+        segment_name(name, w->name, w->gen);
+        shm_unlink(name);
+    }
+    __atomic_store_n(&w->base->retired, 1, __ATOMIC_RELEASE);
+    munmap(w->base, w->base_size);
+    shm_unlink(w->name);
+    free(w);
+    m->shared = NULL;
+}
+
+static bool
+map_segment(const char* name, const shm_header** hdr, size_t* size) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shm_header)) {
+        close(fd);
+        return false;
+    }
+    const shm_header * h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        return false;
+    }
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || h->version != SHM_VERSION
+        || sizeof(shm_header) + 2*h->buf_size > (uint64_t)st.st_size) {
+        munmap((void*)h, st.st_size);
+        return false;
+    }
+    *hdr = h;
+    *size = st.st_size;
+    return true;
+}
+
+//the segment the writer publishes into: the one under name or the generation it records,
+//tried again from name when that generation was retired in between
+static bool
+map_current(const char* name, const shm_header** hdr, size_t* size) {
+    int tries;
+    for (tries=0; tries<4; tries++) {
+        if (!map_segment(name, hdr, size)) {
+            return false;
+        }
+        if (!__atomic_load_n(&(*hdr)->retired, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        uint32_t gen = __atomic_load_n(&(*hdr)->next_gen, __ATOMIC_ACQUIRE);
+        munmap((void*)*hdr, *size);
+        if (gen == 0) {
+            return false;
+        }
+        char gen_name[SHM_SEGMENT_NAME_MAX];
+        segment_name(gen_name, name, gen);
+        if (map_segment(gen_name, hdr, size)) {
+            if (!__atomic_load_n(&(*hdr)->retired, __ATOMIC_ACQUIRE)) {
+                return true;
+            }
+            munmap((void*)*hdr, *size);
+        }
+    }
+    return false;
+}
+
+shm_reader *
+shm_attach(const char* name) {
+    shm_reader * r = malloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    set_name(r->name, name);
+    if (!map_current(r->name, &r->hdr, &r->size)) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void
+shm_detach(shm_reader* r) {
+    munmap((void*)r->hdr, r->size);
+    free(r->hits);
+    free(r);
+}
+
+//follow the writer to its new segment, the old mapping stays usable until that works
+static void
+reader_refresh(shm_reader* r) {
+    if (!__atomic_load_n(&r->hdr->retired, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    const shm_header * hdr;
+    size_t size;
+    if (map_current(r->name, &hdr, &size)) {
+        munmap((void*)r->hdr, r->size);
+        r->hdr = hdr;
+        r->size = size;
+    }
+}
+
+//a torn read may hand back any bytes, so every field is bounded before use
+static const shm_image *
+reader_image(shm_reader* r, uint64_t seq) {
+    const shm_image * img = (const shm_image*)image_buffer(r->hdr, seq);
+    uint64_t buf_size = r->hdr->buf_size;
+    if (img->grid_size <= 0 || img->max_row <= 0 || img->max_col <= 0 || img->obj_cnt < 0
+        || img->slot_size <= 0 || (img->slot_size & (img->slot_size - 1)) != 0
+        || (uint64_t)img->max_row*img->max_col >= buf_size
+        || img->obj_offset != sizeof(*img) + tower_table_size(img->max_row*img->max_col)
+        || img->slot_offset != img->obj_offset + (uint64_t)img->obj_cnt*sizeof(snapshot_obj)
+        || img->slot_offset + (uint64_t)img->slot_size*sizeof(snapshot_slot) > buf_size) {
+        return NULL;
+    }
+    return img;
+}
+
+static inline void
+push_hit(shm_reader* r, uint64_t id) {
+    if (r->hit_cnt >= r->hit_cap) {
+        r->hit_cap = r->hit_cap ? r->hit_cap*2 : 64;
+        r->hits = realloc(r->hits, r->hit_cap*sizeof(uint64_t));
+    }
+    r->hits[r->hit_cnt++] = id;
+}
+
+static inline int
+clamp(double v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : (int)v);
+}
+
+static int
+image_search(shm_reader* r, const shm_image* img, const shape* s, int type, int limit_cnt) {
+    if (!((s->x>=0 && s->x<=img->max_x) && (s->z>=0 && s->z<=img->max_z))) {
+        return 0;
+    }
+    const int32_t * first = (const int32_t*)(img + 1);
+    const snapshot_obj * objs = (const snapshot_obj*)((const char*)img + img->obj_offset);
+    float g = img->grid_size;
+    double e = img->extra_check_grids;
+    int min_col = clamp(floor(s->min_x/g) - e, 0, img->max_col - 1);
+    int max_col = clamp(floor(s->max_x/g) + e, 0, img->max_col - 1);
+    int min_row = clamp(floor(s->min_z/g) - e, 0, img->max_row - 1);
+    int max_row = clamp(floor(s->max_z/g) + e, 0, img->max_row - 1);
+    int min_safe_col = ceil(s->min_safe_x/g);
+    int max_safe_col = floor(s->max_safe_x/g) - 1;
+    int min_safe_row = ceil(s->min_safe_z/g);
+    int max_safe_row = floor(s->max_safe_z/g) - 1;
+    int n = 0;
+    int row,col;
+    for (row=min_row; row<=max_row; row++) {
+        for (col=min_col; col<=max_col; col++) {
+            int cell = row*img->max_col + col;
+            int a = first[cell];
+            int b = first[cell+1];
+            if (a < 0 || b > img->obj_cnt) {
+                continue;
+            }
+            bool safe = s->has_safe_box && row>=min_safe_row && row<=max_safe_row && col>=min_safe_col && col<=max_safe_col;
+            for (; a<b; a++) {
+                const snapshot_obj * so = &objs[a];
+                if ((type&so->type) == type && (safe || shape_cross(s, so->x, so->z, so->radius))) {
+                    push_hit(r, so->id);
+                    n++;
+                    if (n >= limit_cnt) {
+                        return n;
+                    }
+                }
+            }
+        }
+    }
+    return n;
+}
+
+//hits land in r->hits, -1 until the writer has published once
+int
+shm_search(shm_reader* r, const shape* s, int type, int limit_cnt) {
+    for (;;) {
+        reader_refresh(r);
+        uint64_t seq = __atomic_load_n(&r->hdr->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) {
+            return -1;
+        }
+        r->hit_cnt = 0;
+        const shm_image * img = reader_image(r, seq);
+        int n = img ? image_search(r, img, s, type, limit_cnt) : 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->hdr->begin, __ATOMIC_RELAXED) < seq + 2) {
+            r->seq = seq;
+            return n;
+        }
+        r->retries++;
+    }
+}
+
+int
+shm_query(shm_reader* r, uint64_t id, snapshot_obj* out) {
+    for (;;) {
+        reader_refresh(r);
+        uint64_t seq = __atomic_load_n(&r->hdr->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) {
+            return 0;
+        }
+        const shm_image * img = reader_image(r, seq);
+        int found = 0;
+        if (img) {
+            const snapshot_obj * objs = (const snapshot_obj*)((const char*)img + img->obj_offset);
+            const snapshot_slot * slots = (const snapshot_slot*)((const char*)img + img->slot_offset);
+            int i = id & (img->slot_size - 1);
+            int probes;
+            for (probes=0; probes<img->slot_size; probes++) {
+                const snapshot_slot * ss = &slots[i];
+                if (ss->id == id) {
+                    if (ss->obj >= 0 && ss->obj < img->obj_cnt) {
+                        *out = objs[ss->obj];
+                        found = out->id == id;
+                    }
+                    break;
+                }
+                if (ss->next < 0 || ss->next >= img->slot_size) {
+                    break;
+                }
+                i = ss->next;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->hdr->begin, __ATOMIC_RELAXED) < seq + 2) {
+            r->seq = seq;
+            return found;
+        }
+        r->retries++;
+    }
+}
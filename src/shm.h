@@ -0,0 +1,71 @@
+#ifndef _SHM_H
+#define _SHM_H
+#include "divgrid.h"
+#include "search.h"
+#include "snapshot.h"
+
+//posix shared memory image of a map for read-only searches from other processes.
+//segment: header, then two image buffers. publish n writes buffer n%2 while readers keep
+//searching the other one; begin/seq work as a seqlock so a reader that overlapped a write retries.
+//an image holds the objects sorted by tower with an offset table per tower, and the id index,
+//every reference is an index so each process can map the segment anywhere.
+//a writer that outgrows its segment moves to name.<generation>; the segment created under the
+//shared name stays as the entry point and records the latest generation for readers to follow.
+#define SHM_MAGIC 0x4d485341 //"ASHM"
+#define SHM_VERSION 2
+#define SHM_NAME_MAX 64
+#define SHM_SEGMENT_NAME_MAX (SHM_NAME_MAX + 11) //with the ".%u" of a generation
+
+typedef struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t begin;    //publishes started
+    uint64_t seq;      //publishes completed
+    uint64_t buf_size; //bytes of each image buffer
+    uint32_t retired;  //the writer moved to a larger segment or stopped sharing
+    uint32_t next_gen; //generation of the segment that took over, kept current in the first segment
+    uint32_t reserved[6];
+} shm_header;
+
+typedef struct shm_image {
+    int32_t max_x;
+    int32_t max_z;
+    int32_t grid_size;
+    int32_t max_row;
+    int32_t max_col;
+    int32_t extra_check_grids;
+    int32_t obj_cnt;
+    int32_t slot_size;
+    uint64_t obj_offset;  //from the image start, the tower offsets follow the image header
+    uint64_t slot_offset;
+} shm_image;
+
+typedef struct shm_writer {
+    char name[SHM_NAME_MAX];
+    shm_header * base; //segment under name, generation 0
+    size_t base_size;
+    shm_header * hdr; //segment of the current generation, base until the first grow
+    size_t size;
+    uint32_t gen;
+} shm_writer;
+
+typedef struct shm_reader {
+    char name[SHM_NAME_MAX];
+    const shm_header * hdr;
+    size_t size;
+    uint64_t seq; //image the last call read
+    int retries;
+    uint64_t * hits;
+    int hit_cnt;
+    int hit_cap;
+} shm_reader;
+
+int shm_share(map*, const char*);
+void shm_unshare(map*);
+int shm_publish(map*);
+shm_reader* shm_attach(const char*);
+void shm_detach(shm_reader*);
+int shm_search(shm_reader*, const shape*, int, int);
+int shm_query(shm_reader*, uint64_t, snapshot_obj*);
+
+#endif
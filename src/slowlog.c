@@ -0,0 +1,135 @@
+#include "slowlog.h"
+
+typedef struct slowlog_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t max_x;
+    int32_t max_z;
+    int32_t grid_size;
+    int32_t obj_cnt;
+    int32_t query_cnt;
+    int32_t reserved;
+} slowlog_header;
+
+slowlog *
+slowlog_new(int cap, uint64_t threshold_ns, int threshold_tested) {
+    slowlog * log = malloc(sizeof(*log) + cap*sizeof(slow_query));
+    log->threshold_ns = threshold_ns;
+    log->threshold_tested = threshold_tested;
+    log->cap = cap;
+    log->cnt = 0;
+    log->head = 0;
+    log->total = 0;
+    return log;
+}
+
+void
+slowlog_record(slowlog* log, const slow_query* q) {
+    log->entries[log->head] = *q;
+    log->head = (log->head + 1)%log->cap;
+    if (log->cnt < log->cap) {
+        log->cnt++;
+    }
+    log->total++;
+}
+
+//i-th entry from the oldest one
+const slow_query *
+slowlog_get(slowlog* log, int i) {
+    int first = (log->head - log->cnt + log->cap)%log->cap;
+    return &log->entries[(first + i)%log->cap];
+}
+
+int
+slowlog_dump(map* m, const char* path) {
+#ifdef AREA_STATS
+    slowlog * log = m->slowlog;
+#else
+    slowlog * log = NULL;
+#endif
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        return 0;
+    }
+    slowlog_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SLOWLOG_MAGIC;
+    h.version = SLOWLOG_VERSION;
+    h.max_x = m->max_x;
+    h.max_z = m->max_z;
+    h.grid_size = m->grid_size;
+    h.obj_cnt = map_object_count(m);
+    h.query_cnt = log ? log->cnt : 0;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    int i;
+    for (i=0; ok && i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        if (!obj) {
+            continue;
+        }
+        slowlog_obj o;
+        memset(&o, 0, sizeof(o));
+        o.id = obj->id;
+        o.x = obj->x;
+        o.z = obj->z;
+        o.radius = obj->radius;
+        o.type = obj->type;
+        ok = fwrite(&o, sizeof(o), 1, f) == 1;
+    }
+    for (i=0; ok && i<h.query_cnt; i++) {
+        ok = fwrite(slowlog_get(log, i), sizeof(slow_query), 1, f) == 1;
+    }
+    return (fclose(f) == 0) && ok;
+}
+
+int
+slowlog_load(const char* path, slowlog_file* sf) {
+    memset(sf, 0, sizeof(*sf));
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    slowlog_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != SLOWLOG_MAGIC || h.version != SLOWLOG_VERSION
+        || h.obj_cnt < 0 || h.query_cnt < 0) {
+        fclose(f);
+        return 0;
+    }
+    sf->max_x = h.max_x;
+    sf->max_z = h.max_z;
+    sf->grid_size = h.grid_size;
+    sf->obj_cnt = h.obj_cnt;
+    sf->query_cnt = h.query_cnt;
+    sf->objs = malloc(h.obj_cnt*sizeof(slowlog_obj) + 1);
+    sf->queries = malloc(h.query_cnt*sizeof(slow_query) + 1);
+    bool ok = fread(sf->objs, sizeof(slowlog_obj), h.obj_cnt, f) == (size_t)h.obj_cnt
+        && fread(sf->queries, sizeof(slow_query), h.query_cnt, f) == (size_t)h.query_cnt;
+    fclose(f);
+    if (!ok) {
+        slowlog_file_free(sf);
+    }
+    return ok;
+}
+
+void
+slowlog_file_free(slowlog_file* sf) {
+    free(sf->objs);
+    free(sf->queries);
+    sf->objs = NULL;
+    sf->queries = NULL;
+}
+
+void
+shape_from_slow_query(shape* s, const slow_query* q) {
+    switch (q->kind) {
+    case SHAPE_RECT:
+        shape_rect(s, q->x, q->z, q->dir_x, q->dir_z, q->half_width, q->half_height);
+        break;
+    case SHAPE_SECTOR:
+        shape_sector(s, q->x, q->z, q->dir_x, q->dir_z, q->angle, q->radius);
+        break;
+    default:
+        shape_circle(s, q->x, q->z, q->radius);
+        break;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef _SLOWLOG_H
+#define _SLOWLOG_H
+#include "divgrid.h"
+#include "search.h"
+
+//binary dump: header, object snapshot, then the logged queries, native endian
+#define SLOWLOG_MAGIC 0x4c535341 //"ASSL"
+#define SLOWLOG_VERSION 1
+
+typedef struct slow_query {
+    uint64_t ns;
+    int32_t kind;
+    int32_t type;
+    int32_t limit_cnt;
+    int32_t towers;
+    int32_t tested;
+    int32_t hits;
+    //cover range, the towers visited are the existing ones inside it
+    int32_t min_row;
+    int32_t max_row;
+    int32_t min_col;
+    int32_t max_col;
+    float x;
+    float z;
+    float dir_x;
+    float dir_z;
+    float radius;
+    float half_width;
+    float half_height;
+    float angle;
+} slow_query;
+
+typedef struct slowlog {
+    uint64_t threshold_ns;
+    int threshold_tested;
+    int cap;
+    int cnt;
+    int head;
+    uint64_t total;
+    slow_query entries[];
+} slowlog;
+
+typedef struct slowlog_obj {
+    uint64_t id;
+    float x;
+    float z;
+    float radius;
+    int32_t type;
+} slowlog_obj;
+
+typedef struct slowlog_file {
+    int max_x;
+    int max_z;
+    int grid_size;
+    int obj_cnt;
+    int query_cnt;
+    slowlog_obj * objs;
+    slow_query * queries;
+} slowlog_file;
+
+slowlog* slowlog_new(int, uint64_t, int);
+void slowlog_record(slowlog*, const slow_query*);
+const slow_query* slowlog_get(slowlog*, int);
+int slowlog_dump(map*, const char*);
+int slowlog_load(const char*, slowlog_file*);
+void slowlog_file_free(slowlog_file*);
+void shape_from_slow_query(shape*, const slow_query*);
+
+#endif
@@ -0,0 +1,277 @@
+#include "snapshot.h"
+#include "quadtree.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//index of the tower an object is filed under, the quadtree backend uses the grid of grid_size
+int
+snapshot_cell(map* m, object* obj) {
+    if (!m->qt) {
+        return obj->pTower->row*m->max_col + obj->pTower->col;
+    }
+    int row = obj->z/m->grid_size;
+    int col = obj->x/m->grid_size;
+    row = row < 0 ? 0 : (row < m->max_row ? row : m->max_row - 1);
+    col = col < 0 ? 0 : (col < m->max_col ? col : m->max_col - 1);
+    return row*m->max_col + col;
+}
+
+int
+snapshot_save(map* m, const char* path) {
+    map_commit(m);
+    int cells = m->max_row*m->max_col;
+    int * first = calloc(cells + 1, sizeof(int));
+    int * cursor = malloc(cells*sizeof(int) + 1);
+    int * index = malloc(m->size*sizeof(int));
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    int i;
+    //counting sort of the objects by tower, the slots then refer to the sorted position
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        if (obj) {
+            first[snapshot_cell(m, obj) + 1]++;
+            h.obj_cnt++;
+        }
+    }
+    for (i=0; i<cells; i++) {
+        if (first[i+1] > 0) {
+            h.tower_cnt++;
+        }
+        first[i+1] += first[i];
+    }
+    memcpy(cursor, first, cells*sizeof(int));
+    snapshot_obj * objs = malloc(h.obj_cnt*sizeof(snapshot_obj) + 1);
+    for (i=0; i<m->size; i++) {
+        object * obj = m->slot_list[i].obj;
+        index[i] = -1;
+        if (!obj) {
+            continue;
+        }
+        int n = cursor[snapshot_cell(m, obj)]++;
+        snapshot_obj * so = &objs[n];
+        memset(so, 0, sizeof(*so));
+        so->id = obj->id;
+        so->x = obj->x;
+        so->z = obj->z;
+        so->radius = obj->radius;
+        so->type = obj->type;
+        index[i] = n;
+    }
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.max_x = m->max_x;
+    h.max_z = m->max_z;
+    h.grid_size = m->grid_size;
+    h.backend = m->qt ? BACKEND_QUADTREE : BACKEND_GRID;
+    h.extra_check_grids = m->extra_check_grids;
+    h.slot_size = m->size;
+    h.lastfree = m->lastfree;
+    h.flags = (m->compact ? SNAPSHOT_COMPACT : 0) | (m->layout == LAYOUT_MORTON ? SNAPSHOT_MORTON : 0);
+    h.tower_offset = sizeof(h);
+    h.obj_offset = h.tower_offset + h.tower_cnt*sizeof(snapshot_tower);
+    h.slot_offset = h.obj_offset + h.obj_cnt*sizeof(snapshot_obj);
+    h.file_size = h.slot_offset + h.slot_size*sizeof(snapshot_slot);
+
+    bool ok = false;
+    FILE * f = fopen(path, "wb");
+    if (f) {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1;
+        for (i=0; ok && i<cells; i++) {
+            if (first[i+1] == first[i]) {
+                continue;
+            }
+            snapshot_tower st;
+            st.row = i/m->max_col;
+            st.col = i%m->max_col;
+            st.first = first[i];
+            st.cnt = first[i+1] - first[i];
+            ok = fwrite(&st, sizeof(st), 1, f) == 1;
+        }
+        ok = ok && fwrite(objs, sizeof(snapshot_obj), h.obj_cnt, f) == (size_t)h.obj_cnt;
+        for (i=0; ok && i<m->size; i++) {
+            snapshot_slot ss;
+            memset(&ss, 0, sizeof(ss));
+            ss.id = m->slot_list[i].id;
+            ss.obj = index[i];
+            ss.next = m->slot_list[i].next;
+            ok = fwrite(&ss, sizeof(ss), 1, f) == 1;
+        }
+        ok = (fclose(f) == 0) && ok;
+    }
+    free(objs);
+    free(index);
+    free(cursor);
+    free(first);
+    return ok;
+}
+
+//every index in the file is checked before the map is built from it
+static bool
+snapshot_check(const char* base, size_t size) {
+    const snapshot_header * h = (const snapshot_header *)base;
+    if (size < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION || h->file_size != size
+        || h->max_x <= 0 || h->max_z <= 0 || h->grid_size <= 0
+        || (h->backend != BACKEND_GRID && h->backend != BACKEND_QUADTREE)
+        || (h->flags & ~(SNAPSHOT_COMPACT|SNAPSHOT_MORTON)) != 0 || (h->flags != 0 && h->backend != BACKEND_GRID)
+        || h->tower_cnt < 0 || h->obj_cnt < 0 || h->slot_size <= 0 || (h->slot_size & (h->slot_size - 1)) != 0
+        || h->lastfree < -1 || h->lastfree >= h->slot_size
+        || h->tower_offset != sizeof(*h)
+        || h->obj_offset != h->tower_offset + (uint64_t)h->tower_cnt*sizeof(snapshot_tower)
+        || h->slot_offset != h->obj_offset + (uint64_t)h->obj_cnt*sizeof(snapshot_obj)
+        || h->file_size != h->slot_offset + (uint64_t)h->slot_size*sizeof(snapshot_slot)) {
+        return false;
+    }
+    int max_row = h->max_z/h->grid_size + (h->max_z%h->grid_size != 0);
+    int max_col = h->max_x/h->grid_size + (h->max_x%h->grid_size != 0);
+    const snapshot_tower * towers = (const snapshot_tower *)(base + h->tower_offset);
+    const snapshot_obj * objs = (const snapshot_obj *)(base + h->obj_offset);
+    const snapshot_slot * slots = (const snapshot_slot *)(base + h->slot_offset);
+    int i;
+    int next_first = 0;
+    for (i=0; i<h->tower_cnt; i++) {
+        const snapshot_tower * st = &towers[i];
+        if (st->row < 0 || st->row >= max_row || st->col < 0 || st->col >= max_col
+            || st->first != next_first || st->cnt <= 0 || st->cnt > h->obj_cnt - st->first) {
+            return false;
+        }
+        next_first += st->cnt;
+    }
+    if (next_first != h->obj_cnt) {
+        return false;
+    }
+    char * seen = calloc(h->obj_cnt + 1, 1);
+    int referenced = 0;
+    for (i=0; i<h->slot_size; i++) {
+        const snapshot_slot * ss = &slots[i];
+        if (ss->next < -1 || ss->next >= h->slot_size || ss->obj < -1 || ss->obj >= h->obj_cnt) {
+            break;
+        }
+        if (ss->obj >= 0) {
+            if (seen[ss->obj] || objs[ss->obj].id != ss->id) {
+                break;
+            }
+            seen[ss->obj] = 1;
+            referenced++;
+        }
+    }
+    free(seen);
+    if (i != h->slot_size || referenced != h->obj_cnt) {
+        return false;
+    }
+    //the next links must form chains: no slot is linked twice, and a walk from the chain heads,
+    //bounded by slot_size, reaches every linked slot, so none of them sits on a cycle
+    char * linked = calloc(h->slot_size, 1);
+    int linked_cnt = 0;
+    for (i=0; i<h->slot_size; i++) {
+        int next = slots[i].next;
+        if (next >= 0) {
+            if (linked[next]) {
+                break;
+            }
+            linked[next] = 1;
+            linked_cnt++;
+        }
+    }
+    int reached = 0;
+    if (i == h->slot_size) {
+        for (i=0; i<h->slot_size; i++) {
+            if (linked[i]) {
+                continue;
+            }
+            int steps = 0;
+            int k;
+            for (k=slots[i].next; k>=0 && steps<=h->slot_size; k=slots[k].next) {
+                steps++;
+            }
+            if (k >= 0) {
+                break;
+            }
+            reached += steps;
+        }
+    }
+    free(linked);
+    return i == h->slot_size && reached == linked_cnt;
+}
+
+static map*
+snapshot_build(const char* base) {
+    const snapshot_header * h = (const snapshot_header *)base;
+    const snapshot_tower * towers = (const snapshot_tower *)(base + h->tower_offset);
+    const snapshot_obj * objs = (const snapshot_obj *)(base + h->obj_offset);
+    const snapshot_slot * slots = (const snapshot_slot *)(base + h->slot_offset);
+    map * m = map_new(h->max_x, h->max_z, h->grid_size);
+    map_set_backend(m, h->backend);
+    map_set_compact(m, (h->flags & SNAPSHOT_COMPACT) != 0);
+    map_set_layout(m, (h->flags & SNAPSHOT_MORTON) ? LAYOUT_MORTON : LAYOUT_ROW);
+    //the cover margin is recomputed from the loaded radii rather than trusted from the header
+    float max_radius = 0;
+    //one block for all objects, laid out tower by tower as in the file
+    object * block = map_alloc_objects(m, h->obj_cnt);
+    int i,k;
+    for (i=0; i<h->tower_cnt; i++) {
+        const snapshot_tower * st = &towers[i];
+        tower * t = m->qt ? NULL : get_tower(m, st->row, st->col, true);
+        for (k=st->cnt-1; k>=0; k--) { //head insertion, walk backwards to keep the saved order
+            const snapshot_obj * so = &objs[st->first + k];
+            object * obj = &block[st->first + k];
+            obj->id = so->id;
+            obj->x = so->x;
+            obj->z = so->z;
+            obj->radius = so->radius;
+            if (so->radius > max_radius) {
+                max_radius = so->radius;
+            }
+            obj->type = so->type;
+            obj->motion = -1;
+            obj->handle = -1;
+            memset(obj->attr, 0, sizeof(obj->attr));
+            obj->pTower = NULL;
+            if (m->qt) {
+                qtree_insert(m->qt, obj);
+            }else {
+                insert_obj_to_tower(m, t, obj);
+            }
+        }
+    }
+    double extra = ceil(max_radius/h->grid_size);
+    int extent = h->max_x > h->max_z ? h->max_x : h->max_z;
+    int max_extra = extent/h->grid_size + 1;
+    m->extra_check_grids = extra > max_extra ? max_extra : (extra > 1 ? (int)extra : 1);
+    free(m->slot_list);
+    m->size = h->slot_size;
+    m->lastfree = h->lastfree;
+    m->slot_list = malloc(m->size*sizeof(slot));
+    for (i=0; i<m->size; i++) {
+        slot * s = &m->slot_list[i];
+        s->id = slots[i].id;
+        s->obj = slots[i].obj >= 0 ? &block[slots[i].obj] : NULL;
+        s->next = slots[i].next;
+    }
+    return m;
+}
+
+map*
+snapshot_load(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    char * base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    map * m = snapshot_check(base, size) ? snapshot_build(base) : NULL;
+    munmap(base, size);
+    return m;
+}
@@ -0,0 +1,56 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+#include "divgrid.h"
+
+//binary snapshot of a whole map, native endian, every reference is an index into a section
+//  header | towers | objects grouped by tower | id index slots
+#define SNAPSHOT_MAGIC 0x4e535341 //"ASSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_COMPACT 1
+#define SNAPSHOT_MORTON 2
+
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t max_x;
+    int32_t max_z;
+    int32_t grid_size;
+    int32_t backend;
+    int32_t extra_check_grids;
+    int32_t tower_cnt;
+    int32_t obj_cnt;
+    int32_t slot_size;
+    int32_t lastfree;
+    int32_t flags; //SNAPSHOT_COMPACT, SNAPSHOT_MORTON
+    uint64_t tower_offset;
+    uint64_t obj_offset;
+    uint64_t slot_offset;
+    uint64_t file_size;
+} snapshot_header;
+
+typedef struct snapshot_tower {
+    int32_t row;
+    int32_t col;
+    int32_t first; //index of its first object
+    int32_t cnt;
+} snapshot_tower;
+
+typedef struct snapshot_obj {
+    uint64_t id;
+    float x;
+    float z;
+    float radius;
+    int32_t type;
+} snapshot_obj;
+
+typedef struct snapshot_slot {
+    uint64_t id;
+    int32_t obj; //-1 when the slot is empty
+    int32_t next;
+} snapshot_slot;
+
+int snapshot_cell(map*, object*);
+int snapshot_save(map*, const char*);
+map* snapshot_load(const char*);
+
+#endif
@@ -0,0 +1,116 @@
+#include "standing.h"
+
+static inline void
+list_push(standing_list* l, uint64_t id, int cell) {
+    if (l->cnt >= l->cap) {
+        l->cap = l->cap ? l->cap*2 : 16;
+        l->items = realloc(l->items, l->cap*sizeof(standing_entry));
+    }
+    l->items[l->cnt].id = id;
+    l->items[l->cnt].cell = cell;
+    l->cnt++;
+}
+
+static int
+cmp_entry(const void* a, const void* b) {
+    uint64_t ia = ((const standing_entry *)a)->id;
+    uint64_t ib = ((const standing_entry *)b)->id;
+    return (ia > ib) - (ia < ib);
+}
+
+void
+standing_init(standing_query* q, const shape* s, int type) {
+    memset(q, 0, sizeof(*q));
+    q->s = *s;
+    q->type = type;
+    q->full = true;
+}
+
+void
+standing_free(standing_query* q) {
+    free(q->result.items);
+    free(q->old.items);
+    free(q->fresh.items);
+    free(q->entered.items);
+    free(q->left.items);
+    memset(q, 0, sizeof(*q));
+}
+
+//the shape moved, the old hits are compared with a full evaluation of the new one
+void
+standing_set_shape(standing_query* q, const shape* s) {
+    q->s = *s;
+    q->full = true;
+}
+
+static inline bool
+cell_changed(map* m, int cell, uint64_t stamp) {
+    if (cell < 0) {
+        return true;
+    }
+    tower * t = get_tower(m, cell/m->max_col, cell%m->max_col, false);
+    return !t || t->version > stamp;
+}
+
+typedef struct standing_scan {
+    map * m;
+    standing_list * fresh;
+} standing_scan;
+
+static void
+fresh_hit(void* ud, object* obj) {
+    standing_scan * ss = ud;
+    map * m = ss->m;
+    list_push(ss->fresh, obj->id, m->qt ? -1 : obj->pTower->row*m->max_col + obj->pTower->col);
+}
+
+//fills entered and left, returns how many ids they hold together
+int
+standing_update(map* m, standing_query* q) {
+    bool full = q->full || m->qt || q->grid_size != m->grid_size || q->extra_check_grids != m->extra_check_grids;
+    q->entered.cnt = 0;
+    q->left.cnt = 0;
+    q->old.cnt = 0;
+    q->fresh.cnt = 0;
+    //the hits of unchanged towers stay as they are
+    int i,k = 0;
+    for (i=0; i<q->result.cnt; i++) {
+        standing_entry * e = &q->result.items[i];
+        if (full || cell_changed(m, e->cell, q->stamp)) {
+            list_push(&q->old, e->id, e->cell);
+        }else {
+            q->result.items[k++] = *e;
+        }
+    }
+    q->result.cnt = k;
+    standing_scan ss = {m, &q->fresh};
+    if (m->qt) {
+        map_search(m, &q->s, q->type, 0x7fffffff, fresh_hit, &ss);
+    }else {
+        map_search_since(m, &q->s, q->type, full ? 0 : q->stamp, fresh_hit, &ss);
+    }
+    //an object that moved between two changed towers is in both lists, a merge by id pairs it up
+    qsort(q->old.items, q->old.cnt, sizeof(standing_entry), cmp_entry);
+    qsort(q->fresh.items, q->fresh.cnt, sizeof(standing_entry), cmp_entry);
+    int a = 0, b = 0;
+    while (a < q->old.cnt || b < q->fresh.cnt) {
+        if (b >= q->fresh.cnt || (a < q->old.cnt && q->old.items[a].id < q->fresh.items[b].id)) {
+            list_push(&q->left, q->old.items[a].id, q->old.items[a].cell);
+            a++;
+        }else if (a >= q->old.cnt || q->fresh.items[b].id < q->old.items[a].id) {
+            list_push(&q->entered, q->fresh.items[b].id, q->fresh.items[b].cell);
+            b++;
+        }else {
+            a++;
+            b++;
+        }
+    }
+    for (i=0; i<q->fresh.cnt; i++) {
+        list_push(&q->result, q->fresh.items[i].id, q->fresh.items[i].cell);
+    }
+    q->stamp = m->change_seq;
+    q->grid_size = m->grid_size;
+    q->extra_check_grids = m->extra_check_grids;
+    q->full = false;
+    return q->entered.cnt + q->left.cnt;
+}
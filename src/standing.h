@@ -0,0 +1,38 @@
+#ifndef _STANDING_H
+#define _STANDING_H
+#include "search.h"
+
+//standing query: a shape evaluated again and again, each evaluation reports the ids that entered and
+//left the result since the previous one; only the towers whose version moved past the last evaluation
+//are scanned again, the grid cell each hit was found in tells which old hits those towers decide
+typedef struct standing_entry {
+    uint64_t id;
+    int cell; //row*max_col + col of its tower, -1 on the quadtree backend
+} standing_entry;
+
+typedef struct standing_list {
+    standing_entry * items;
+    int cnt;
+    int cap;
+} standing_list;
+
+typedef struct standing_query {
+    shape s;
+    int type;
+    bool full; //the next evaluation scans every tower of the shape
+    uint64_t stamp; //change_seq at the last evaluation
+    int grid_size; //the cells of the entries belong to it
+    int extra_check_grids; //a wider cover range reaches towers never scanned
+    standing_list result;
+    standing_list old; //scratch: the hits of the towers scanned again
+    standing_list fresh; //scratch: what those towers hold now
+    standing_list entered;
+    standing_list left;
+} standing_query;
+
+void standing_init(standing_query*, const shape*, int);
+void standing_free(standing_query*);
+void standing_set_shape(standing_query*, const shape*);
+int standing_update(map*, standing_query*);
+
+#endif
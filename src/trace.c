@@ -0,0 +1,237 @@
+#include "trace.h"
+#include <time.h>
+
+#define TRACE_BUFFER_SIZE (1<<16)
+
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t max_x;
+    int32_t max_z;
+    int32_t grid_size;
+    int32_t reserved;
+} trace_header;
+
+static const int trace_arg_cnt[TRACE_OP_MAX] = {0, 3, 2, 0, 3, 6, 6};
+
+static inline uint64_t
+trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline void
+write_varint(FILE* f, uint64_t v) {
+    while (v >= 0x80) {
+        putc((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+static inline bool
+read_varint(FILE* f, uint64_t* v) {
+    uint64_t r = 0;
+    int shift = 0;
+    for (;;) {
+        int c = getc(f);
+        if (c == EOF || shift > 63) {
+            return false;
+        }
+        r |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    *v = r;
+    return true;
+}
+
+static inline uint64_t
+zigzag(int v) {
+    return ((uint64_t)(int64_t)v << 1) ^ (uint64_t)((int64_t)v >> 63);
+}
+
+static inline int
+unzigzag(uint64_t v) {
+    return (int)((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+}
+
+trace_writer *
+trace_open(map* m, const char* path) {
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        return NULL;
+    }
+    trace_writer * w = malloc(sizeof(*w));
+    w->f = f;
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    trace_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    h.max_x = m->max_x;
+    h.max_z = m->max_z;
+    h.grid_size = m->grid_size;
+    fwrite(&h, sizeof(h), 1, f);
+    w->start_ns = w->last_ns = trace_now();
+    w->cnt = 0;
+    return w;
+}
+
+void
+trace_close(trace_writer* w) {
+    fclose(w->f);
+    free(w);
+}
+
+void
+trace_write(trace_writer* w, const trace_op* op) {
+    FILE * f = w->f;
+    uint64_t now = trace_now();
+    putc(op->op | (op->has_radius ? 0x80 : 0) | (op->has_type ? 0x40 : 0), f);
+    write_varint(f, now - w->last_ns);
+    w->last_ns = now;
+    w->cnt++;
+    int argc = trace_arg_cnt[op->op];
+    if (op->op == TRACE_ADD || op->op == TRACE_UPDATE || op->op == TRACE_DELETE) {
+        write_varint(f, op->id);
+    }
+    if (op->op == TRACE_UPDATE && op->has_radius) {
+        argc++;
+    }
+    fwrite(op->args, sizeof(float), argc, f);
+    if (op->op == TRACE_ADD || op->op >= TRACE_SEARCH_CIRCLE || op->has_type) {
+        write_varint(f, zigzag(op->type));
+    }
+    if (op->op >= TRACE_SEARCH_CIRCLE) {
+        write_varint(f, zigzag(op->limit_cnt));
+    }
+}
+
+void
+trace_add(trace_writer* w, uint64_t id, float x, float z, float radius, int type) {
+    trace_op op;
+    op.op = TRACE_ADD;
+    op.id = id;
+    op.has_radius = false;
+    op.has_type = false;
+    op.args[0] = x;
+    op.args[1] = z;
+    op.args[2] = radius;
+    op.type = type;
+    trace_write(w, &op);
+}
+
+void
+trace_update(trace_writer* w, uint64_t id, float x, float z, bool has_radius, float radius, bool has_type, int type) {
+    trace_op op;
+    op.op = TRACE_UPDATE;
+    op.id = id;
+    op.has_radius = has_radius;
+    op.has_type = has_type;
+    op.type = type;
+    op.args[0] = x;
+    op.args[1] = z;
+    op.args[2] = radius;
+    trace_write(w, &op);
+}
+
+void
+trace_delete(trace_writer* w, uint64_t id) {
+    trace_op op;
+    op.op = TRACE_DELETE;
+    op.id = id;
+    op.has_radius = false;
+    op.has_type = false;
+    trace_write(w, &op);
+}
+
+void
+trace_search(trace_writer* w, int kind, const float* args, int type, int limit_cnt) {
+    trace_op op;
+    op.op = kind;
+    op.has_radius = false;
+    op.has_type = false;
+    memcpy(op.args, args, trace_arg_cnt[kind]*sizeof(float));
+    op.type = type;
+    op.limit_cnt = limit_cnt;
+    trace_write(w, &op);
+}
+
+bool
+trace_reader_open(trace_reader* r, const char* path) {
+    r->f = fopen(path, "rb");
+    if (!r->f) {
+        return false;
+    }
+    trace_header h;
+    if (fread(&h, sizeof(h), 1, r->f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION) {
+        fclose(r->f);
+        r->f = NULL;
+        return false;
+    }
+    setvbuf(r->f, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    r->max_x = h.max_x;
+    r->max_z = h.max_z;
+    r->grid_size = h.grid_size;
+    r->ns = 0;
+    return true;
+}
+
+bool
+trace_read(trace_reader* r, trace_op* op) {
+    FILE * f = r->f;
+    int c = getc(f);
+    if (c == EOF) {
+        return false;
+    }
+    memset(op, 0, sizeof(*op));
+    op->op = c & 0x3f;
+    op->has_radius = (c & 0x80) != 0;
+    op->has_type = (c & 0x40) != 0;
+    if (op->op <= 0 || op->op >= TRACE_OP_MAX) {
+        return false;
+    }
+    uint64_t v;
+    if (!read_varint(f, &v)) {
+        return false;
+    }
+    r->ns += v;
+    op->ns = r->ns;
+    int argc = trace_arg_cnt[op->op];
+    if (op->op == TRACE_ADD || op->op == TRACE_UPDATE || op->op == TRACE_DELETE) {
+        if (!read_varint(f, &op->id)) {
+            return false;
+        }
+    }
+    if (op->op == TRACE_UPDATE && op->has_radius) {
+        argc++;
+    }
+    if (fread(op->args, sizeof(float), argc, f) != (size_t)argc) {
+        return false;
+    }
+    if (op->op == TRACE_ADD || op->op >= TRACE_SEARCH_CIRCLE || op->has_type) {
+        if (!read_varint(f, &v)) {
+            return false;
+        }
+        op->type = unzigzag(v);
+    }
+    if (op->op >= TRACE_SEARCH_CIRCLE) {
+        if (!read_varint(f, &v)) {
+            return false;
+        }
+        op->limit_cnt = unzigzag(v);
+    }
+    return true;
+}
+
+void
+trace_reader_close(trace_reader* r) {
+    if (r->f) {
+        fclose(r->f);
+        r->f = NULL;
+    }
+}
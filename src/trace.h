@@ -0,0 +1,58 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+#include "divgrid.h"
+
+//binary trace of the Lua api calls, header then one record per call:
+//op byte, varint ns since the previous record, then the op arguments
+//bit 0x80 of the op byte: update carries a radius, bit 0x40: update carries a type
+#define TRACE_MAGIC 0x52545341 //"ASTR"
+#define TRACE_VERSION 1
+
+#define TRACE_ADD 1
+#define TRACE_UPDATE 2
+#define TRACE_DELETE 3
+#define TRACE_SEARCH_CIRCLE 4
+#define TRACE_SEARCH_RECT 5
+#define TRACE_SEARCH_SECTOR 6
+#define TRACE_OP_MAX 7
+
+#define TRACE_ARGS_MAX 6
+
+typedef struct trace_op {
+    int op;
+    uint64_t ns; //since the recording started
+    uint64_t id;
+    int type;
+    int limit_cnt;
+    bool has_radius;
+    bool has_type;
+    float args[TRACE_ARGS_MAX];
+} trace_op;
+
+typedef struct trace_writer {
+    FILE * f;
+    uint64_t start_ns;
+    uint64_t last_ns;
+    uint64_t cnt;
+} trace_writer;
+
+typedef struct trace_reader {
+    FILE * f;
+    int max_x;
+    int max_z;
+    int grid_size;
+    uint64_t ns;
+} trace_reader;
+
+trace_writer* trace_open(map*, const char*);
+void trace_close(trace_writer*);
+void trace_write(trace_writer*, const trace_op*);
+void trace_add(trace_writer*, uint64_t, float, float, float, int);
+void trace_update(trace_writer*, uint64_t, float, float, bool, float, bool, int);
+void trace_delete(trace_writer*, uint64_t);
+void trace_search(trace_writer*, int, const float*, int, int);
+bool trace_reader_open(trace_reader*, const char*);
+bool trace_read(trace_reader*, trace_op*);
+void trace_reader_close(trace_reader*);
+
+#endif
@@ -0,0 +1,347 @@
+#include "trigger.h"
+
+#define TRIGGER_PRE_ALLOC 16
+
+static inline int
+clamp_cell(int v, int max) {
+    return v < 0 ? 0 : (v < max ? v : max - 1);
+}
+
+static inline int
+point_cell(map* m, float x, float z) {
+    int row = clamp_cell(z/m->grid_size, m->max_row);
+    int col = clamp_cell(x/m->grid_size, m->max_col);
+    return row*m->max_col + col;
+}
+
+//cells the box of a region covers, clamped to the map
+static inline void
+region_cells(map* m, const trigger_region* r, int* min_row, int* max_row, int* min_col, int* max_col) {
+    *min_row = clamp_cell(floor(r->min_z/m->grid_size), m->max_row);
+    *max_row = clamp_cell(floor(r->max_z/m->grid_size), m->max_row);
+    *min_col = clamp_cell(floor(r->min_x/m->grid_size), m->max_col);
+    *max_col = clamp_cell(floor(r->max_x/m->grid_size), m->max_col);
+}
+
+static inline bool
+region_has_cell(map* m, const trigger_region* r, int cell) {
+    int min_row,max_row,min_col,max_col;
+    region_cells(m, r, &min_row, &max_row, &min_col, &max_col);
+    int row = cell/m->max_col;
+    int col = cell%m->max_col;
+    return row >= min_row && row <= max_row && col >= min_col && col <= max_col;
+}
+
+//even-odd rule on the edges crossing the horizontal line through z
+static bool
+polygon_contains(const float* p, int cnt, float x, float z) {
+    bool inside = false;
+    int i,j;
+    for (i=0, j=cnt-1; i<cnt; j=i++) {
+        float xi = p[2*i], zi = p[2*i+1];
+        float xj = p[2*j], zj = p[2*j+1];
+        if ((zi > z) != (zj > z) && x < (xj - xi)*(z - zi)/(zj - zi) + xi) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+static inline bool
+region_contains(trigger_set* ts, const trigger_region* r, int type, float x, float z) {
+    ts->tests++;
+    if ((r->type&type) != r->type || x < r->min_x || x > r->max_x || z < r->min_z || z > r->max_z) {
+        return false;
+    }
+    if (r->kind == TRIGGER_POLYGON) {
+        return polygon_contains(r->points, r->point_cnt, x, z);
+    }
+    return shape_cross(&r->s, x, z, 0);
+}
+
+static void
+push_event(trigger_set* ts, uint64_t id, int region, int kind) {
+    if (ts->event_cnt >= ts->event_cap) {
+        ts->event_cap = ts->event_cap ? ts->event_cap*2 : TRIGGER_PRE_ALLOC;
+        ts->events = realloc(ts->events, ts->event_cap*sizeof(trigger_event));
+    }
+    trigger_event * e = &ts->events[ts->event_cnt++];
+    e->id = id;
+    e->region = region;
+    e->kind = kind;
+}
+
+static void
+link_region(map* m, int i) {
+    trigger_set * ts = m->triggers;
+    int min_row,max_row,min_col,max_col;
+    region_cells(m, &ts->regions[i], &min_row, &max_row, &min_col, &max_col);
+    int r,c;
+    for (r=min_row; r<=max_row; r++) {
+        for (c=min_col; c<=max_col; c++) {
+            int e = ts->free_entry;
+            if (e >= 0) {
+                ts->free_entry = ts->entries[e].next;
+            }else {
+                if (ts->entry_cnt >= ts->entry_cap) {
+                    ts->entry_cap *= 2;
+                    ts->entries = realloc(ts->entries, ts->entry_cap*sizeof(trigger_entry));
+                }
+                e = ts->entry_cnt++;
+            }
+            int * head = &ts->cell_head[r*m->max_col + c];
+            ts->entries[e].region = i;
+            ts->entries[e].next = *head;
+            *head = e;
+        }
+    }
+}
+
+static void
+unlink_region(map* m, int i) {
+    trigger_set * ts = m->triggers;
+    int min_row,max_row,min_col,max_col;
+    region_cells(m, &ts->regions[i], &min_row, &max_row, &min_col, &max_col);
+    int r,c;
+    for (r=min_row; r<=max_row; r++) {
+        for (c=min_col; c<=max_col; c++) {
+            int * prev = &ts->cell_head[r*m->max_col + c];
+            while (*prev >= 0) {
+                int e = *prev;
+                if (ts->entries[e].region == i) {
+                    *prev = ts->entries[e].next;
+                    ts->entries[e].next = ts->free_entry;
+                    ts->free_entry = e;
+                    break;
+                }
+                prev = &ts->entries[e].next;
+            }
+        }
+    }
+}
+
+trigger_set*
+trigger_new(map* m) {
+    trigger_set * ts = calloc(1, sizeof(*ts));
+    ts->free_region = -1;
+    ts->free_entry = -1;
+    ts->entry_cap = TRIGGER_PRE_ALLOC;
+    ts->entries = malloc(ts->entry_cap*sizeof(trigger_entry));
+    ts->cell_cnt = m->max_row*m->max_col;
+    ts->cell_head = malloc(ts->cell_cnt*sizeof(int));
+    memset(ts->cell_head, -1, ts->cell_cnt*sizeof(int));
+    return ts;
+}
+
+void
+trigger_delete(trigger_set* ts) {
+    int i;
+    for (i=0; i<ts->region_cnt; i++) {
+        free(ts->regions[i].points);
+    }
+    free(ts->regions);
+    free(ts->cell_head);
+    free(ts->entries);
+    free(ts->events);
+    free(ts);
+}
+
+typedef struct region_scan {
+    trigger_set * ts;
+    int region;
+    int kind;
+} region_scan;
+
+static void
+scan_hit(void* ud, object* obj) {
+    region_scan * rs = ud;
+    if (region_contains(rs->ts, &rs->ts->regions[rs->region], obj->type, obj->x, obj->z)) {
+        push_event(rs->ts, obj->id, rs->region, rs->kind);
+    }
+}
+
+//objects already inside a region get an enter event when it is added and an exit event when it is removed
+static void
+scan_region(map* m, int i, int kind) {
+    const trigger_region * r = &m->triggers->regions[i];
+    float min_x = r->min_x > 0 ? r->min_x : 0;
+    float max_x = r->max_x < m->max_x ? r->max_x : m->max_x;
+    float min_z = r->min_z > 0 ? r->min_z : 0;
+    float max_z = r->max_z < m->max_z ? r->max_z : m->max_z;
+    if (min_x > max_x || min_z > max_z) {
+        return;
+    }
+    shape s;
+    shape_rect(&s, (min_x + max_x)*0.5f, (min_z + max_z)*0.5f, 0, 1, (max_x - min_x)*0.5f, (max_z - min_z)*0.5f);
+    region_scan rs = {m->triggers, i, kind};
+    map_scan(m, &s, r->type, scan_hit, &rs);
+}
+
+static int
+add_region(map* m, trigger_region* src) {
+    map_commit(m);
+    if (!m->triggers) {
+        m->triggers = trigger_new(m);
+    }
+    trigger_set * ts = m->triggers;
+    int i = ts->free_region;
+    if (i >= 0) {
+        ts->free_region = ts->regions[i].next_free;
+    }else {
+        if (ts->region_cnt >= ts->region_cap) {
+            ts->region_cap = ts->region_cap ? ts->region_cap*2 : TRIGGER_PRE_ALLOC;
+            ts->regions = realloc(ts->regions, ts->region_cap*sizeof(trigger_region));
+        }
+        i = ts->region_cnt++;
+    }
+    src->next_free = -1;
+    ts->regions[i] = *src;
+    link_region(m, i);
+    scan_region(m, i, TRIGGER_ENTER);
+    return i;
+}
+
+//circle, rect or sector, returns the region index
+int
+trigger_add_shape(map* m, const shape* s, int type) {
+    trigger_region r;
+    memset(&r, 0, sizeof(r));
+    r.kind = TRIGGER_SHAPE;
+    r.type = type;
+    r.s = *s;
+    r.min_x = s->min_x;
+    r.max_x = s->max_x;
+    r.min_z = s->min_z;
+    r.max_z = s->max_z;
+    return add_region(m, &r);
+}
+
+//cnt vertices as x,z pairs, -1 for fewer than 3
+int
+trigger_add_polygon(map* m, const float* points, int cnt, int type) {
+    if (cnt < 3) {
+        return -1;
+    }
+    trigger_region r;
+    memset(&r, 0, sizeof(r));
+    r.kind = TRIGGER_POLYGON;
+    r.type = type;
+    r.point_cnt = cnt;
+    r.points = malloc(cnt*2*sizeof(float));
+    memcpy(r.points, points, cnt*2*sizeof(float));
+    r.min_x = r.max_x = points[0];
+    r.min_z = r.max_z = points[1];
+    int i;
+    for (i=1; i<cnt; i++) {
+        r.min_x = points[2*i] < r.min_x ? points[2*i] : r.min_x;
+        r.max_x = points[2*i] > r.max_x ? points[2*i] : r.max_x;
+        r.min_z = points[2*i+1] < r.min_z ? points[2*i+1] : r.min_z;
+        r.max_z = points[2*i+1] > r.max_z ? points[2*i+1] : r.max_z;
+    }
+    return add_region(m, &r);
+}
+
+bool
+trigger_remove(map* m, int i) {
+    trigger_set * ts = m->triggers;
+    if (!ts || i < 0 || i >= ts->region_cnt || ts->regions[i].kind == TRIGGER_FREE) {
+        return false;
+    }
+    map_commit(m);
+    scan_region(m, i, TRIGGER_EXIT);
+    unlink_region(m, i);
+    trigger_region * r = &ts->regions[i];
+    free(r->points);
+    r->points = NULL;
+    r->kind = TRIGGER_FREE;
+    r->next_free = ts->free_region;
+    ts->free_region = i;
+    return true;
+}
+
+void
+trigger_insert(map* m, object* obj) {
+    trigger_set * ts = m->triggers;
+    int e;
+    for (e=ts->cell_head[point_cell(m, obj->x, obj->z)]; e>=0; e=ts->entries[e].next) {
+        int i = ts->entries[e].region;
+        if (region_contains(ts, &ts->regions[i], obj->type, obj->x, obj->z)) {
+            push_event(ts, obj->id, i, TRIGGER_ENTER);
+        }
+    }
+}
+
+void
+trigger_erase(map* m, object* obj) {
+    trigger_set * ts = m->triggers;
+    int e;
+    for (e=ts->cell_head[point_cell(m, obj->x, obj->z)]; e>=0; e=ts->entries[e].next) {
+        int i = ts->entries[e].region;
+        if (region_contains(ts, &ts->regions[i], obj->type, obj->x, obj->z)) {
+            push_event(ts, obj->id, i, TRIGGER_EXIT);
+        }
+    }
+}
+
+//obj has moved from old_x, old_z: the regions of the old cell are tested at both positions, the ones
+//listed only in the new cell can not have held the object before
+void
+trigger_move(map* m, object* obj, float old_x, float old_z) {
+    trigger_set * ts = m->triggers;
+    int old_cell = point_cell(m, old_x, old_z);
+    int new_cell = point_cell(m, obj->x, obj->z);
+    int e;
+    for (e=ts->cell_head[old_cell]; e>=0; e=ts->entries[e].next) {
+        int i = ts->entries[e].region;
+        const trigger_region * r = &ts->regions[i];
+        bool was = region_contains(ts, r, obj->type, old_x, old_z);
+        bool is = region_contains(ts, r, obj->type, obj->x, obj->z);
+        if (was != is) {
+            push_event(ts, obj->id, i, is ? TRIGGER_ENTER : TRIGGER_EXIT);
+        }
+    }
+    if (new_cell == old_cell) {
+        return;
+    }
+    for (e=ts->cell_head[new_cell]; e>=0; e=ts->entries[e].next) {
+        int i = ts->entries[e].region;
+        const trigger_region * r = &ts->regions[i];
+        if (!region_has_cell(m, r, old_cell) && region_contains(ts, r, obj->type, obj->x, obj->z)) {
+            push_event(ts, obj->id, i, TRIGGER_ENTER);
+        }
+    }
+}
+
+//obj has changed its type from old_type in place, only the regions of its cell can hold it
+void
+trigger_retype(map* m, object* obj, int old_type) {
+    trigger_set * ts = m->triggers;
+    int e;
+    for (e=ts->cell_head[point_cell(m, obj->x, obj->z)]; e>=0; e=ts->entries[e].next) {
+        int i = ts->entries[e].region;
+        const trigger_region * r = &ts->regions[i];
+        bool was = region_contains(ts, r, old_type, obj->x, obj->z);
+        bool is = region_contains(ts, r, obj->type, obj->x, obj->z);
+        if (was != is) {
+            push_event(ts, obj->id, i, is ? TRIGGER_ENTER : TRIGGER_EXIT);
+        }
+    }
+}
+
+//the cells follow grid_size, after a regrid every region is listed again
+void
+trigger_reindex(map* m) {
+    trigger_set * ts = m->triggers;
+    free(ts->cell_head);
+    ts->cell_cnt = m->max_row*m->max_col;
+    ts->cell_head = malloc(ts->cell_cnt*sizeof(int));
+    memset(ts->cell_head, -1, ts->cell_cnt*sizeof(int));
+    ts->entry_cnt = 0;
+    ts->free_entry = -1;
+    int i;
+    for (i=0; i<ts->region_cnt; i++) {
+        if (ts->regions[i].kind != TRIGGER_FREE) {
+            link_region(m, i);
+        }
+    }
+}
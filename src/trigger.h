@@ -0,0 +1,63 @@
+#ifndef _TRIGGER_H
+#define _TRIGGER_H
+#include "search.h"
+
+//static trigger regions: each region is listed in the cells of grid_size its box covers, a move only
+//tests the regions of the cells it leaves and enters; an object is inside a region when its center is
+#define TRIGGER_FREE 0
+#define TRIGGER_SHAPE 1
+#define TRIGGER_POLYGON 2
+
+#define TRIGGER_ENTER 1
+#define TRIGGER_EXIT 2
+
+typedef struct trigger_region {
+    int kind;
+    int type; //all of its bits must be in the object type, like a search
+    shape s; //TRIGGER_SHAPE
+    float * points; //TRIGGER_POLYGON, x and z of each vertex
+    int point_cnt;
+    float min_x, max_x, min_z, max_z;
+    int next_free;
+} trigger_region;
+
+typedef struct trigger_entry {
+    int region;
+    int next; //next entry of the cell, -1 at the end
+} trigger_entry;
+
+typedef struct trigger_event {
+    uint64_t id;
+    int region;
+    int kind; //TRIGGER_ENTER, TRIGGER_EXIT
+} trigger_event;
+
+typedef struct trigger_set {
+    trigger_region * regions;
+    int region_cnt;
+    int region_cap;
+    int free_region; //-1 when none
+    int * cell_head; //max_row*max_col, first entry of each cell
+    int cell_cnt;
+    trigger_entry * entries;
+    int entry_cnt;
+    int entry_cap;
+    int free_entry;
+    trigger_event * events; //queued until drained
+    int event_cnt;
+    int event_cap;
+    uint64_t tests; //region tests done by moves
+} trigger_set;
+
+trigger_set* trigger_new(map*);
+void trigger_delete(trigger_set*);
+int trigger_add_shape(map*, const shape*, int);
+int trigger_add_polygon(map*, const float*, int, int);
+bool trigger_remove(map*, int);
+void trigger_insert(map*, object*);
+void trigger_move(map*, object*, float, float);
+void trigger_erase(map*, object*);
+void trigger_retype(map*, object*, int);
+void trigger_reindex(map*);
+
+#endif
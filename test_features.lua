@@ -0,0 +1,1350 @@
+package.cpath = package.cpath .. ";./build/?.so"
+local areasearch = require "areasearch"
+local sfmt = string.format
+
+--behavior checks of the map features, each one names the request that introduced it
+local checks = 0
+local function check(request, what, ok)
+    checks = checks + 1
+    if not ok then
+        error(sfmt("[%s] %s", request, what), 2)
+    end
+end
+
+local backends = {
+    grid = {},
+    compact = {compact = true},
+    morton = {layout = "morton"},
+    quadtree = {backend = "quadtree"},
+}
+
+local function fill(m, cnt, max_x, max_z)
+    local objs = {}
+    for id = 1, cnt do
+        local o = {x = math.random()*max_x, z = math.random()*max_z, r = math.random()*2, type = math.random(1, 7)}
+        m:add(id, o.x, o.z, o.r, o.type)
+        objs[id] = o
+    end
+    return objs
+end
+
+local function set_of(list, n)
+    local s = {}
+    for i = 1, n or #list do
+        s[list[i]] = true
+    end
+    return s
+end
+
+local function same_set(a, b)
+    for k in pairs(a) do
+        if not b[k] then
+            return false
+        end
+    end
+    for k in pairs(b) do
+        if not a[k] then
+            return false
+        end
+    end
+    return true
+end
+
+math.randomseed(7)
+
+--user-046 triggers: the drained events follow the inside state of every object, a circle holds the centers
+--within its radius whose type has every bit of the region type
+do
+    local function inside(o, c)
+        local dx, dz = o.x - c[1], o.z - c[2]
+        return not o.deleted and dx*dx + dz*dz <= c[3]*c[3] and o.type & c[4] == c[4]
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        local objs = fill(m, 300, 200, 200)
+        local regions = {{60, 60, 30, 1}, {120, 80, 45, 2}, {100, 100, 20, 0}}
+        local state = {}
+        local out = {}
+        local function expect(what)
+            out = m:drain_triggers(out)
+            local got = {}
+            for i = 1, out.n do
+                local key = out.triggers[i] .. ":" .. out.ids[i]
+                got[key] = (got[key] or 0) + (out.enter[i] and 1 or -1)
+            end
+            local want = {}
+            for tid, c in pairs(regions) do
+                for id, o in pairs(objs) do
+                    local key = tid .. ":" .. id
+                    local now = inside(o, c)
+                    if now ~= (state[key] or false) then
+                        want[key] = now and 1 or -1
+                    end
+                    state[key] = now
+                end
+            end
+            for k, v in pairs(want) do
+                check("user-046", sfmt("%s %s event of %s", name, what, k), got[k] == v)
+                got[k] = nil
+            end
+            for k, v in pairs(got) do
+                check("user-046", sfmt("%s %s no event of %s", name, what, k), v == 0)
+            end
+        end
+        local ids = {}
+        for i, c in ipairs(regions) do
+            ids[m:add_trigger({"circle", c[1], c[2], c[3]}, c[4])] = c
+        end
+        regions = ids
+        expect("add_trigger")
+        for _ = 1, 5 do
+            for id, o in pairs(objs) do
+                if math.random() < 0.5 then
+                    o.x = math.max(0, math.min(199, o.x + math.random(-15, 15)))
+                    o.z = math.max(0, math.min(199, o.z + math.random(-15, 15)))
+                    m:update(id, o.x, o.z)
+                end
+            end
+            expect("move")
+        end
+        for id, o in pairs(objs) do
+            if math.random() < 0.5 then
+                o.type = math.random(0, 7)
+                m:update(id, o.x, o.z, nil, o.type)
+            end
+        end
+        expect("type change")
+        for id, o in pairs(objs) do
+            if math.random() < 0.3 then
+                o.type = math.random(0, 7)
+                o.x = math.max(0, math.min(199, o.x + math.random(-15, 15)))
+                m:update(id, o.x, o.z, nil, o.type)
+            end
+        end
+        expect("type change and move")
+        for id = 1, 300, 3 do
+            m:delete(id)
+            objs[id].deleted = true
+        end
+        expect("delete")
+        for id = 1, 300, 3 do
+            objs[id] = nil
+        end
+        local tid = next(regions)
+        local was = {}
+        for id in pairs(objs) do
+            was[id] = state[tid .. ":" .. id] or nil
+        end
+        m:remove_trigger(tid)
+        out = m:drain_triggers(out)
+        local left = {}
+        for i = 1, out.n do
+            check("user-046", sfmt("%s remove_trigger only exits its region", name), out.triggers[i] == tid and not out.enter[i])
+            left[out.ids[i]] = true
+        end
+        check("user-046", sfmt("%s remove_trigger exits what it held", name), same_set(left, was))
+    end
+    --a type change alone raises the event in place
+    local m = areasearch.create(100, 100, 10)
+    m:add_trigger({"rect", 50, 50, 0, 1, 10, 10}, 2)
+    m:add(1, 50, 50, 1, 1)
+    local out = m:drain_triggers({})
+    check("user-046", "no event for a type outside the region", out.n == 0)
+    m:update(1, 50, 50, nil, 3)
+    out = m:drain_triggers(out)
+    check("user-046", "type change enters", out.n == 1 and out.enter[1] == true)
+    m:update(1, 50, 50, nil, 1)
+    out = m:drain_triggers(out)
+    check("user-046", "type change exits", out.n == 1 and out.enter[1] == false)
+    --adding and removing a region scans the map without counting as a query
+    for name, opt in pairs(backends) do
+        local q = areasearch.create(200, 200, 10, opt)
+        fill(q, 200, 200, 200)
+        q:set_cache(64)
+        q:search_circle_range_objs(100, 100, 20, 0)
+        local before = q:stats()
+        local _, advice = q:advise_grid_size()
+        local tid = q:add_trigger({"circle", 80, 80, 40}, 0)
+        q:add_trigger({"polygon", 10, 10, 150, 20, 90, 160}, 0)
+        q:remove_trigger(tid)
+        local after = q:stats()
+        local _, advice_after = q:advise_grid_size()
+        check("user-046", name .. " trigger scan leaves the advisor stats", advice_after.query_cnt == advice.query_cnt)
+        check("user-046", name .. " trigger scan leaves the counters", after.searches == before.searches
+            and after.objects_tested == before.objects_tested and after.hits == before.hits)
+        check("user-046", name .. " trigger scan leaves the query cache", after.cache_hits == before.cache_hits
+            and after.cache_misses == before.cache_misses)
+        check("user-046", name .. " trigger scan still finds the objects inside", q:drain_triggers({}).n > 0)
+    end
+    check("user-046", "odd polygon coordinates are refused",
+        not pcall(m.add_trigger, m, {"polygon", 0, 0, 10, 0, 10, 10, 5}))
+    check("user-046", "non-number polygon vertex is refused",
+        not pcall(m.add_trigger, m, {"polygon", 0, 0, 10, 0, 10, "x"}))
+    check("user-046", "missing polygon vertex is refused",
+        not pcall(m.add_trigger, m, {"polygon", 0, 0, 10, nil, 10, 10}))
+    check("user-046", "numeric string polygon vertex is taken", pcall(m.add_trigger, m, {"polygon", 0, 0, 10, 0, 10, "10"}))
+end
+
+--user-034 snapshot: a loaded map holds the same objects and answers searches like the saved one, a file whose
+--slot chains loop is refused
+do
+    local path = os.tmpname()
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(300, 200, 10, opt)
+        local objs = fill(m, 500, 300, 200)
+        for id = 1, 500, 4 do
+            m:delete(id)
+            objs[id] = nil
+        end
+        check("user-034", name .. " save", m:save(path))
+        local l = areasearch.load(path)
+        check("user-034", name .. " load", l ~= nil)
+        local ids = {}
+        for id in pairs(objs) do
+            ids[#ids + 1] = id
+        end
+        local a, na = m:get_positions(ids, {})
+        local b, nb = l:get_positions(ids, {})
+        check("user-034", name .. " object count", na == #ids and nb == #ids)
+        for i = 1, na do
+            check("user-034", sfmt("%s object %d", name, ids[i]), a.ids[i] == b.ids[i] and a.x[i] == b.x[i]
+                and a.z[i] == b.z[i] and a.radius[i] == b.radius[i] and a.type[i] == b.type[i])
+        end
+        check("user-034", name .. " deleted ids stay deleted", l:query(1).id == nil)
+        for _ = 1, 20 do
+            local x, z, r, t = math.random()*300, math.random()*200, math.random(5, 40), math.random(0, 3)
+            check("user-034", name .. " search", same_set(m:search_circle_range_objs(x, z, r, t),
+                l:search_circle_range_objs(x, z, r, t)))
+        end
+        l:add(1000, 150, 100, 1, 1)
+        check("user-034", name .. " loaded map takes new objects", l:search_circle_range_objs(150, 100, 1, 1)[1000])
+    end
+    local m = areasearch.create(100, 100, 10)
+    fill(m, 40, 100, 100)
+    m:save(path)
+    local f = io.open(path, "rb")
+    local data = f:read("a")
+    f:close()
+    --header: 12 int32 then the tower, object and slot offsets
+    local size = string.unpack("i4", data, 37)
+    local slot_offset = string.unpack("I8", data, 65)
+    local function next_pos(i)
+        return slot_offset + i*16 + 12
+    end
+    local linked = {}
+    for i = 0, size - 1 do
+        local n = string.unpack("i4", data, next_pos(i) + 1)
+        if n >= 0 then
+            linked[n] = true
+        end
+    end
+    local heads = {}
+    for i = 0, size - 1 do
+        if not linked[i] and string.unpack("i4", data, next_pos(i) + 1) < 0 then
+            heads[#heads + 1] = i
+        end
+    end
+    local a, b = heads[1], heads[2]
+    local function set_next(i, v)
+        data = data:sub(1, next_pos(i)) .. string.pack("i4", v) .. data:sub(next_pos(i) + 5)
+    end
+    set_next(a, b)
+    set_next(b, a)
+    f = io.open(path, "wb")
+    f:write(data)
+    f:close()
+    check("user-034", "slot chain cycle is refused", areasearch.load(path) == nil)
+    --the cover margin in the header is not trusted: a load recomputes it from the largest radius
+    m = areasearch.create(100, 100, 10)
+    fill(m, 40, 100, 100)
+    m:add(100, 50, 50, 35, 1)
+    m:save(path)
+    f = io.open(path, "rb")
+    data = f:read("a")
+    f:close()
+    for _, v in ipairs({0, -5, 1, 0x7fffffff}) do
+        f = io.open(path, "wb")
+        f:write(data:sub(1, 24) .. string.pack("i4", v) .. data:sub(29))
+        f:close()
+        local l = areasearch.load(path)
+        check("user-034", sfmt("extra_check_grids %d recomputed", v), l:stats().extra_check_grids == 4)
+        check("user-034", sfmt("extra_check_grids %d search", v), same_set(m:search_circle_range_objs(90, 50, 5, 1),
+            l:search_circle_range_objs(90, 50, 5, 1)))
+        check("user-034", sfmt("extra_check_grids %d finds the large object", v),
+            l:search_circle_range_objs(84, 50, 1, 1)[100])
+    end
+    os.remove(path)
+end
+
+--user-035 journal: a replica seeded from a snapshot and fed the flushed chunks matches the primary, exactly
+--with quantum 0 and within quantum/2 otherwise
+do
+    local path = os.tmpname()
+    for _, quantum in ipairs{0, 0.5} do
+        for name, opt in pairs(backends) do
+            local m = areasearch.create(200, 200, 10, opt)
+            local objs = fill(m, 300, 200, 200)
+            m:save(path)
+            m:set_journal(quantum)
+            local replica = areasearch.load(path)
+            local next_id = 301
+            for tick = 1, 5 do
+                for id, o in pairs(objs) do
+                    local p = math.random()
+                    if p < 0.05 then
+                        m:delete(id)
+                        objs[id] = nil
+                    elseif p < 0.5 then
+                        o.x = math.max(0, math.min(199.9, o.x + math.random()*20 - 10))
+                        o.z = math.max(0, math.min(199.9, o.z + math.random()*20 - 10))
+                        if p < 0.1 then
+                            o.type = math.random(1, 7)
+                            m:update(id, o.x, o.z, nil, o.type)
+                        else
+                            m:update(id, o.x, o.z)
+                        end
+                    end
+                end
+                for _ = 1, 10 do
+                    local o = {x = math.random()*200, z = math.random()*200, r = 1, type = 1}
+                    m:add(next_id, o.x, o.z, o.r, o.type)
+                    objs[next_id] = o
+                    next_id = next_id + 1
+                end
+                local chunk = m:flush_journal()
+                local ops, used = replica:apply_journal(chunk)
+                check("user-035", sfmt("%s tick %d chunk applied", name, tick), ops > 0 and used == #chunk)
+                local ids = {}
+                for id in pairs(objs) do
+                    ids[#ids + 1] = id
+                end
+                local a, na = m:get_positions(ids, {})
+                local b, nb = replica:get_positions(ids, {})
+                check("user-035", sfmt("%s tick %d object count", name, tick), na == nb and na == #ids
+                    and replica:stats().objects == #ids)
+                for i = 1, na do
+                    local ok = a.ids[i] == b.ids[i] and a.type[i] == b.type[i] and a.radius[i] == b.radius[i]
+                    if quantum == 0 then
+                        ok = ok and a.x[i] == b.x[i] and a.z[i] == b.z[i]
+                    else
+                        ok = ok and math.abs(a.x[i] - b.x[i]) <= quantum/2 + 1e-3 and math.abs(a.z[i] - b.z[i]) <= quantum/2 + 1e-3
+                    end
+                    check("user-035", sfmt("%s quantum %g tick %d object %d", name, quantum, tick, ids[i]), ok)
+                end
+            end
+        end
+    end
+    --a chunk is applied once and in order, a malformed one leaves the standby untouched
+    local m = areasearch.create(100, 100, 10)
+    m:add(1, 50, 50, 1, 1)
+    m:save(path)
+    m:set_journal(0.5)
+    local replica = areasearch.load(path)
+    m:update(1, 53, 50)
+    local c0 = m:flush_journal()
+    m:update(1, 56, 50)
+    local c1 = m:flush_journal()
+    local ops, err = replica:apply_journal(c1)
+    check("user-035", "a skipped chunk is refused", ops == nil and err:find("out of order"))
+    check("user-035", "chunk 0 applies", replica:apply_journal(c0) == 1)
+    ops, err = replica:apply_journal(c0)
+    check("user-035", "a repeated chunk is refused", ops == nil and err:find("out of order"))
+    m:update(1, 59, 50)
+    local c2 = m:flush_journal()
+    ops = replica:apply_journal(c1 .. c2)
+    check("user-035", "consecutive chunks apply", ops == 2 and replica:query(1).x == 59)
+    m:add(2, 10, 10, 1, 1)
+    m:update(1, 20, 20)
+    local c3 = m:flush_journal()
+    local bad = c3:sub(1, -2) .. "\255"
+    ops, err = replica:apply_journal(bad)
+    check("user-035", "a malformed chunk is refused", ops == nil and err:find("malformed"))
+    check("user-035", "a malformed chunk applies nothing", replica:query(2).id == nil and replica:query(1).x == 59)
+    check("user-035", "the intact chunk still applies", replica:apply_journal(c3) == 2 and replica:query(2).id == 2)
+    os.remove(path)
+end
+
+--user-042 cursors: an iteration yields the hits of the search, it is stale once an object enters or leaves a
+--tower and the next step raises; moves inside a tower and deferred moves keep it valid
+do
+    local function iterate(m, x, z, r, cursor, body)
+        local got = {}
+        for id in m:each_in_circle(x, z, r, 0, nil, nil, cursor) do
+            got[id] = true
+            if body then
+                body(id)
+            end
+        end
+        return got
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        fill(m, 400, 200, 200)
+        local cursor = areasearch.cursor()
+        for _ = 1, 10 do
+            local x, z, r = math.random()*200, math.random()*200, math.random(5, 50)
+            check("user-042", name .. " iteration matches the search", same_set(iterate(m, x, z, r, cursor),
+                m:search_circle_range_objs(x, z, r)))
+        end
+        local n = 0
+        for _ in m:each_in_circle(100, 100, 80, 0, 5, nil, cursor) do
+            n = n + 1
+        end
+        check("user-042", name .. " limit_cnt", n == 5)
+        local ok, err = pcall(iterate, m, 100, 100, 80, cursor, function(id)
+            m:add(1000, 100, 100, 1, 1)
+        end)
+        check("user-042", name .. " add makes the cursor stale", not ok and err:find("during the iteration"))
+        ok, err = pcall(iterate, m, 100, 100, 80, cursor, function(id)
+            m:delete(id)
+        end)
+        check("user-042", name .. " delete makes the cursor stale", not ok and err:find("during the iteration"))
+        check("user-042", name .. " a stale cursor can start again", next(iterate(m, 100, 100, 80, cursor)) ~= nil)
+        m:set_deferred(true)
+        local moved = {}
+        ok = pcall(iterate, m, 100, 100, 80, cursor, function(id)
+            m:update(id, 5, 5)
+            moved[id] = true
+        end)
+        check("user-042", name .. " deferred moves keep the cursor", ok and next(moved) ~= nil)
+        m:commit()
+        for id in pairs(moved) do
+            check("user-042", name .. " deferred moves land at commit", m:search_circle_range_objs(5, 5, 1)[id])
+        end
+        for id = 1, 400, 2 do
+            m:update(id, math.random()*200, math.random()*200)
+        end
+        local committed = {}
+        for id in m:each_in_circle(100, 100, 60, 0, nil, true, cursor) do
+            committed[id] = true
+        end
+        check("user-042", name .. " committed iteration matches the committed search",
+            same_set(committed, m:search_circle_range_objs(100, 100, 60, 0, nil, true)))
+        check("user-042", name .. " committed iteration leaves the moves pending", m:stats().pending_moves > 0)
+        local current = iterate(m, 100, 100, 60, cursor)
+        check("user-042", name .. " iteration commits the pending moves first", m:stats().pending_moves == 0
+            and same_set(current, m:search_circle_range_objs(100, 100, 60)))
+        m:set_deferred(false)
+    end
+    --grid towers only change version when an object crosses a tower border
+    local m = areasearch.create(100, 100, 10)
+    m:add(1, 15, 15, 1, 1)
+    m:add(2, 16, 16, 1, 1)
+    local ok = pcall(function()
+        for id in m:each_in_circle(15, 15, 5) do
+            m:update(id, 14, 14)
+        end
+    end)
+    check("user-042", "a move inside a tower keeps the cursor", ok)
+end
+
+--user-045 compound shapes: one pass over an expression gives the union, intersection and difference of the
+--plain searches of its shapes
+do
+    local function random_shape()
+        local x, z = math.random()*200, math.random()*200
+        local k = math.random(4)
+        if k == 1 then
+            return {"circle", x, z, math.random(5, 40)}
+        elseif k == 2 then
+            local a = math.random()*2*math.pi
+            return {"rect", x, z, math.cos(a), math.sin(a), math.random(5, 30), math.random(5, 30)}
+        elseif k == 3 then
+            local a = math.random()*2*math.pi
+            return {"sector", x, z, math.cos(a), math.sin(a), math.random(20, 270), math.random(10, 50)}
+        end
+        local inner = math.random(3, 20)
+        return {"annulus", x, z, inner, inner + math.random(5, 30)}
+    end
+    local function random_expr(depth)
+        if depth == 0 or math.random() < 0.3 then
+            return random_shape()
+        end
+        local e = {({"union", "intersect", "diff"})[math.random(3)]}
+        for i = 1, math.random(2, 3) do
+            e[i + 1] = random_expr(depth - 1)
+        end
+        return e
+    end
+    local function reference(m, e, type)
+        local op = e[1]
+        if op == "circle" then
+            return m:search_circle_range_objs(e[2], e[3], e[4], type)
+        elseif op == "rect" then
+            return m:search_rect_range_objs(e[2], e[3], e[4], e[5], e[6], e[7], type)
+        elseif op == "sector" then
+            return m:search_sector_range_objs(e[2], e[3], e[4], e[5], e[6], e[7], type)
+        elseif op == "annulus" then
+            return reference(m, {"diff", {"circle", e[2], e[3], e[5]}, {"circle", e[2], e[3], e[4]}}, type)
+        end
+        local r = reference(m, e[2], type)
+        for i = 3, #e do
+            local o = reference(m, e[i], type)
+            local nr = {}
+            for id in pairs(op == "union" and o or r) do
+                if op == "union" or (op == "intersect") == (o[id] ~= nil) then
+                    nr[id] = true
+                end
+            end
+            if op == "union" then
+                for id in pairs(r) do
+                    nr[id] = true
+                end
+            end
+            r = nr
+        end
+        return r
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        fill(m, 1000, 200, 200)
+        for _ = 1, 100 do
+            local e = random_expr(2)
+            local type = math.random(0, 3)
+            check("user-045", name .. " compound matches the set arithmetic", same_set(m:search_compound(e, type, 0x7fffffff),
+                reference(m, e, type)))
+        end
+        local n = 0
+        for _ in pairs(m:search_compound({"circle", 100, 100, 60}, 0, 7)) do
+            n = n + 1
+        end
+        check("user-045", name .. " limit_cnt", n == 7)
+    end
+    --the morton layout walks its towers tile by tile: the same answers as the row layout on a map of partial tiles
+    local row = areasearch.create(210, 190, 10)
+    local morton = areasearch.create(210, 190, 10, {layout = "morton"})
+    local objs = fill(row, 800, 210, 190)
+    for id, o in pairs(objs) do
+        morton:add(id, o.x, o.z, o.r, o.type)
+    end
+    row:set_cache(64)
+    morton:set_cache(64)
+    local v = row:change_version()
+    check("user-045", "layouts start at the same change version", morton:change_version() == v)
+    for id = 1, 800, 7 do
+        local x, z = math.random()*210, math.random()*190
+        row:update(id, x, z)
+        morton:update(id, x, z)
+    end
+    local function cells(m)
+        local out, n = m:changed_towers(v, {"rect", 150, 40, 0, 1, 60, 40})
+        local set = {}
+        for i = 1, n do
+            set[out.rows[i] .. ":" .. out.cols[i]] = true
+        end
+        return set
+    end
+    check("user-045", "morton changed_towers matches the row layout", same_set(cells(row), cells(morton)))
+    for _ = 1, 50 do
+        local e = random_expr(2)
+        local type = math.random(0, 3)
+        check("user-045", "morton compound matches the row layout", same_set(row:search_compound(e, type, 0x7fffffff),
+            morton:search_compound(e, type, 0x7fffffff)))
+        local x, z, r = math.random()*210, math.random()*190, math.random(5, 70)
+        local a, b = {}, {}
+        for id in row:each_in_circle(x, z, r, 0, 0x7fffffff) do
+            a[id] = true
+        end
+        for id in morton:each_in_circle(x, z, r, 0, 0x7fffffff) do
+            b[id] = true
+        end
+        check("user-045", "morton iteration matches the row layout", same_set(a, b))
+        check("user-045", "morton cached search matches the row layout", same_set(
+            row:search_circle_range_objs(x, z, r, 0, 0x7fffffff), morton:search_circle_range_objs(x, z, r, 0, 0x7fffffff)))
+    end
+end
+
+--user-047 standing queries: after every update the result equals a full search of the shape and the diffs
+--are the ids that entered and left it
+do
+    local function search(m, r, type)
+        if r[1] == "circle" then
+            return m:search_circle_range_objs(r[2], r[3], r[4], type)
+        end
+        return m:search_rect_range_objs(r[2], r[3], r[4], r[5], r[6], r[7], type)
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        local objs = fill(m, 500, 200, 200)
+        local region = {"circle", 100, 100, 40}
+        local q = m:standing(region, 1)
+        local prev = {}
+        local entered, left = {}, {}
+        local next_id = 501
+        for tick = 1, 12 do
+            for id, o in pairs(objs) do
+                local p = math.random()
+                if p < 0.03 then
+                    m:delete(id)
+                    objs[id] = nil
+                elseif p < 0.3 then
+                    o.x = math.max(0, math.min(199.9, o.x + math.random()*16 - 8))
+                    o.z = math.max(0, math.min(199.9, o.z + math.random()*16 - 8))
+                    m:update(id, o.x, o.z)
+                elseif p < 0.33 then
+                    m:update(id, o.x, o.z, math.random()*3, math.random(0, 3))
+                end
+            end
+            for _ = 1, 5 do
+                local o = {x = math.random()*200, z = math.random()*200}
+                m:add(next_id, o.x, o.z, 1, 1)
+                objs[next_id] = o
+                next_id = next_id + 1
+            end
+            if tick == 5 then
+                region = {"rect", 80, 120, 0.6, 0.8, 30, 20}
+                q:set_shape(region)
+            elseif tick == 8 and not opt.backend then
+                m:regrid(20)
+            end
+            entered, left = q:update(entered, left)
+            local now = search(m, region, 1)
+            check("user-047", sfmt("%s tick %d result", name, tick), same_set(q:ids(), now))
+            local want_entered, want_left = {}, {}
+            for id in pairs(now) do
+                want_entered[id] = not prev[id] or nil
+            end
+            for id in pairs(prev) do
+                want_left[id] = not now[id] or nil
+            end
+            check("user-047", sfmt("%s tick %d entered", name, tick), same_set(set_of(entered), want_entered))
+            check("user-047", sfmt("%s tick %d left", name, tick), same_set(set_of(left), want_left))
+            prev = now
+        end
+    end
+end
+
+--user-049 search cache: a map with the cache answers every search like one without it while objects move,
+--change type and radius, come and go
+do
+    for name, opt in pairs(backends) do
+        local plain = areasearch.create(200, 200, 10, opt)
+        local cached = areasearch.create(200, 200, 10, opt)
+        cached:set_cache(64)
+        local objs = {}
+        for id = 1, 600 do
+            local o = {x = math.random()*200, z = math.random()*200, type = math.random(1, 3)}
+            plain:add(id, o.x, o.z, 1, o.type)
+            cached:add(id, o.x, o.z, 1, o.type)
+            objs[id] = o
+        end
+        local centers = {}
+        for i = 1, 8 do
+            centers[i] = {math.random()*200, math.random()*200}
+        end
+        for tick = 1, 10 do
+            for _ = 1, 40 do
+                local id = math.random(600)
+                local o = objs[id]
+                if o then
+                    local p = math.random()
+                    if p < 0.1 then
+                        plain:delete(id)
+                        cached:delete(id)
+                        objs[id] = nil
+                    else
+                        o.x = math.max(0, math.min(199.9, o.x + math.random()*6 - 3))
+                        o.z = math.max(0, math.min(199.9, o.z + math.random()*6 - 3))
+                        local r = p < 0.2 and math.random()*3 or nil
+                        local type = p < 0.3 and math.random(1, 3) or nil
+                        plain:update(id, o.x, o.z, r, type)
+                        cached:update(id, o.x, o.z, r, type)
+                    end
+                end
+            end
+            for _, c in ipairs(centers) do
+                for _ = 1, 3 do
+                    local x, z = c[1] + math.random()*2, c[2] + math.random()*2
+                    local type = math.random(0, 2)
+                    check("user-049", sfmt("%s tick %d circle", name, tick), same_set(plain:search_circle_range_objs(x, z, 15, type),
+                        cached:search_circle_range_objs(x, z, 15, type)))
+                    check("user-049", sfmt("%s tick %d rect", name, tick), same_set(plain:search_rect_range_objs(x, z, 0, 1, 12, 8, type),
+                        cached:search_rect_range_objs(x, z, 0, 1, 12, 8, type)))
+                    check("user-049", sfmt("%s tick %d sector", name, tick), same_set(plain:search_sector_range_objs(x, z, 1, 0, 90, 20, type),
+                        cached:search_sector_range_objs(x, z, 1, 0, 90, 20, type)))
+                end
+            end
+            if tick % 3 == 0 then
+                cached:clear_cache()
+            end
+        end
+        local st = cached:stats()
+        if st.cache_hits and not opt.backend then
+            check("user-049", name .. " repeated searches hit the cache", st.cache_hits + st.cache_revalidated > 0)
+        end
+    end
+end
+
+--user-050 nearest first: exact gives the limit_cnt hits closest to the center in order, as sorting every hit of
+--the plain search does; without exact the hits are still hits of the search, as many as the limit allows
+do
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(300, 300, 10, opt)
+        fill(m, 1500, 300, 300)
+        for _ = 1, 60 do
+            local x, z, r = math.random()*300, math.random()*300, math.random(10, 80)
+            local type = math.random(0, 2)
+            local limit = math.random(1, 20)
+            local all = m:search_circle_range_objs(x, z, r, type)
+            local ids = {}
+            for id in pairs(all) do
+                ids[#ids + 1] = id
+            end
+            local pos = m:get_positions(ids, {})
+            local d2 = {}
+            for i = 1, #ids do
+                local dx, dz = pos.x[i] - x, pos.z[i] - z
+                d2[ids[i]] = dx*dx + dz*dz
+            end
+            table.sort(ids, function(a, b)
+                return d2[a] < d2[b]
+            end)
+            local want = math.min(limit, #ids)
+            local got = m:search_circle_nearest(x, z, r, type, limit, true)
+            check("user-050", name .. " exact count", #got == want)
+            for i = 1, want do
+                check("user-050", name .. " exact order", all[got[i]] and math.abs(d2[got[i]] - d2[ids[i]]) < 1e-3)
+            end
+            got = m:search_circle_nearest(x, z, r, type, limit)
+            check("user-050", name .. " ring count", #got == want)
+            for i = 1, #got do
+                check("user-050", name .. " ring hits", all[got[i]])
+            end
+            local a = math.random()*2*math.pi
+            local rect = m:search_rect_range_objs(x, z, math.cos(a), math.sin(a), r, r/2, type)
+            got = m:search_rect_nearest(x, z, math.cos(a), math.sin(a), r, r/2, type, limit, true)
+            for i = 1, #got do
+                check("user-050", name .. " rect hits", rect[got[i]])
+            end
+        end
+    end
+end
+
+--user-037 compact storage: a compact map answers like a list map holding the same objects, also for objects
+--just inside the edges of narrow sectors where the packed positions are rounded across the edge
+do
+    for _, grid_size in ipairs{100, 10} do
+        local list = areasearch.create(1000, 1000, grid_size)
+        local compact = areasearch.create(1000, 1000, grid_size, {compact = true})
+        for id = 1, 3000 do
+            local x, z, r, type = math.random()*1000, math.random()*1000, math.random()*3, math.random(1, 3)
+            list:add(id, x, z, r, type)
+            compact:add(id, x, z, r, type)
+        end
+        for _ = 1, 30 do
+            local x, z, r, type = math.random()*1000, math.random()*1000, math.random(10, 300), math.random(0, 2)
+            local a = math.random()*2*math.pi
+            local dx, dz = math.cos(a), math.sin(a)
+            check("user-037", "compact circle", same_set(list:search_circle_range_objs(x, z, r, type, 0x7fffffff),
+                compact:search_circle_range_objs(x, z, r, type, 0x7fffffff)))
+            check("user-037", "compact rect", same_set(list:search_rect_range_objs(x, z, dx, dz, r, r/3, type, 0x7fffffff),
+                compact:search_rect_range_objs(x, z, dx, dz, r, r/3, type, 0x7fffffff)))
+            local angle = math.random(1, 359)
+            check("user-037", "compact sector", same_set(list:search_sector_range_objs(x, z, dx, dz, angle, r, type, 0x7fffffff),
+                compact:search_sector_range_objs(x, z, dx, dz, angle, r, type, 0x7fffffff)))
+        end
+        local id = 10000
+        for _, angle in ipairs{1, 2, 10, 30, 200, 340} do
+            for _ = 1, 5 do
+                --the apex near the border keeps the coordinates large
+                local x, z = 900 + math.random()*99, 900 + math.random()*99
+                local d = math.pi*1.25 + (math.random() - 0.5)
+                local half = math.rad(angle/2)*0.99999
+                local first = id + 1
+                for i = 1, 200 do
+                    local e = d + (i%2 == 0 and half or -half)
+                    local l = math.random()*800
+                    local ox, oz = x + math.cos(e)*l, z + math.sin(e)*l
+                    if ox >= 0 and ox < 1000 and oz >= 0 and oz < 1000 then
+                        id = id + 1
+                        list:add(id, ox, oz, 0, 1)
+                        compact:add(id, ox, oz, 0, 1)
+                    end
+                end
+                local want = list:search_sector_range_objs(x, z, math.cos(d), math.sin(d), angle, 900, 1, 0x7fffffff)
+                local got = compact:search_sector_range_objs(x, z, math.cos(d), math.sin(d), angle, 900, 1, 0x7fffffff)
+                check("user-037", sfmt("compact %g degree sector edge, grid_size %d", angle, grid_size), same_set(want, got))
+                for k = first, id do
+                    list:delete(k)
+                    compact:delete(k)
+                end
+            end
+        end
+    end
+end
+
+--user-036 shared memory: an attached reader searches the published image like the map, follows it when the
+--segment grows, and a name in use is not taken over
+do
+    local name = sfmt("areasearch_test_%d", math.random(1, 1000000000))
+    local m = areasearch.create(500, 500, 10)
+    local objs = fill(m, 200, 500, 500)
+    check("user-036", "share", m:share(name))
+    local early = areasearch.attach(name)
+    check("user-036", "attach", early ~= nil)
+    local other = areasearch.create(500, 500, 10)
+    check("user-036", "a shared name is not taken over", not other:share(name) and early:query(1).id == 1)
+    local function compare(reader, what)
+        for _ = 1, 20 do
+            local x, z, r, type = math.random()*500, math.random()*500, math.random(10, 100), math.random(0, 3)
+            check("user-036", what, same_set(m:search_circle_range_objs(x, z, r, type),
+                reader:search_circle_range_objs(x, z, r, type)))
+        end
+    end
+    compare(early, "search of the first image")
+    local seq = early:seq()
+    for id, o in pairs(objs) do
+        m:update(id, (o.x + 7) % 500, o.z)
+    end
+    check("user-036", "publish", m:publish() > seq)
+    compare(early, "search after a publish")
+    for gen = 1, 3 do
+        local first = 1000*gen
+        for id = first, first + 3000 do
+            m:add(id, math.random()*500, math.random()*500, 1, 1)
+        end
+        check("user-036", "publish into a larger segment", m:publish())
+        compare(early, sfmt("reader from the start after grow %d", gen))
+        local late = areasearch.attach(name)
+        check("user-036", "attach after a grow", late ~= nil)
+        compare(late, sfmt("reader attached after grow %d", gen))
+    end
+    m:share()
+    check("user-036", "unshare unlinks the name", areasearch.attach(name) == nil)
+    check("user-036", "the name can be shared again", other:share(name))
+    other:share()
+end
+
+--user-038 morton layout: a map with tiled towers answers every search like the row layout holding the same
+--objects, also after moves, deletes and a regrid
+do
+    local row = areasearch.create(300, 220, 10)
+    local morton = areasearch.create(300, 220, 10, {layout = "morton"})
+    check("user-038", "layout is reported", row:stats().layout == "row" and morton:stats().layout == "morton")
+    local objs = fill(row, 1500, 300, 220)
+    for id, o in pairs(objs) do
+        morton:add(id, o.x, o.z, o.r, o.type)
+    end
+    local function compare(what)
+        for _ = 1, 40 do
+            local x, z = math.random()*300, math.random()*220
+            local r, type = math.random(3, 60), math.random(0, 3)
+            local a = math.random()*2*math.pi
+            local dx, dz = math.cos(a), math.sin(a)
+            local angle = math.random(10, 300)
+            check("user-038", what .. " circle", same_set(row:search_circle_range_objs(x, z, r, type, 0x7fffffff),
+                morton:search_circle_range_objs(x, z, r, type, 0x7fffffff)))
+            check("user-038", what .. " rect", same_set(row:search_rect_range_objs(x, z, dx, dz, r, r/2, type, 0x7fffffff),
+                morton:search_rect_range_objs(x, z, dx, dz, r, r/2, type, 0x7fffffff)))
+            check("user-038", what .. " sector", same_set(
+                row:search_sector_range_objs(x, z, dx, dz, angle, r, type, 0x7fffffff),
+                morton:search_sector_range_objs(x, z, dx, dz, angle, r, type, 0x7fffffff)))
+            local na, nb = row:search_circle_nearest(x, z, r, type, 10, true), morton:search_circle_nearest(x, z, r, type, 10, true)
+            check("user-038", what .. " exact nearest", #na == #nb and same_set(set_of(na), set_of(nb)))
+            local ca, cn = row:search_circle_columns(x, z, r, type, 0x7fffffff, {})
+            local cb, cm = morton:search_circle_columns(x, z, r, type, 0x7fffffff, {})
+            check("user-038", what .. " columns", cn == cm and same_set(set_of(ca.ids, cn), set_of(cb.ids, cm)))
+        end
+    end
+    compare("fresh")
+    for id, o in pairs(objs) do
+        if id % 3 == 0 then
+            row:delete(id)
+            morton:delete(id)
+            objs[id] = nil
+        else
+            o.x, o.z = math.random()*300, math.random()*220
+            row:update(id, o.x, o.z)
+            morton:update(id, o.x, o.z)
+        end
+    end
+    compare("after moves and deletes")
+    check("user-038", "regrid", row:regrid(16) and morton:regrid(16))
+    check("user-038", "regrid keeps the layout", morton:stats().layout == "morton")
+    compare("after regrid")
+end
+
+--user-039 deferred updates: a deferred map holds the committed state until commit and then matches a map that
+--took every update directly; several updates of an object in a tick coalesce into one move
+do
+    for name, opt in pairs(backends) do
+        local direct = areasearch.create(200, 200, 10, opt)
+        local deferred = areasearch.create(200, 200, 10, opt)
+        local objs = fill(direct, 600, 200, 200)
+        local ids = {}
+        for id, o in pairs(objs) do
+            deferred:add(id, o.x, o.z, o.r, o.type)
+            ids[#ids + 1] = id
+        end
+        deferred:set_deferred(true)
+        local probes = {}
+        for i = 1, 10 do
+            probes[i] = {math.random()*200, math.random()*200, math.random(5, 50)}
+        end
+        local coalesced = 0
+        for tick = 1, 5 do
+            local before = {}
+            for i, p in ipairs(probes) do
+                before[i] = direct:search_circle_range_objs(p[1], p[2], p[3], 0, 0x7fffffff)
+            end
+            local pos = direct:get_positions(ids, {})
+            local was = {}
+            for i = 1, pos.n do
+                was[pos.ids[i]] = {pos.x[i], pos.z[i]}
+            end
+            local moved = {}
+            local moved_cnt = 0
+            for _ = 1, 400 do
+                local id = ids[math.random(#ids)]
+                if objs[id] then
+                    local x, z = math.random()*200, math.random()*200
+                    direct:update(id, x, z)
+                    deferred:update(id, x, z)
+                    if moved[id] then
+                        coalesced = coalesced + 1
+                    else
+                        moved[id] = true
+                        moved_cnt = moved_cnt + 1
+                    end
+                end
+            end
+            local st = deferred:stats()
+            check("user-039", sfmt("%s tick %d pending moves", name, tick), st.pending_moves == moved_cnt)
+            check("user-039", sfmt("%s tick %d coalesced moves", name, tick), st.coalesced_moves == coalesced)
+            for i, p in ipairs(probes) do
+                check("user-039", sfmt("%s tick %d committed search sees the last commit", name, tick), same_set(before[i],
+                    deferred:search_circle_range_objs(p[1], p[2], p[3], 0, 0x7fffffff, true)))
+            end
+            local list = {}
+            for id in pairs(moved) do
+                list[#list + 1] = id
+            end
+            local b, nb = deferred:get_positions(list, {})
+            local same = nb == moved_cnt
+            for i = 1, nb do
+                local w = was[b.ids[i]]
+                same = same and b.x[i] == w[1] and b.z[i] == w[2]
+            end
+            check("user-039", sfmt("%s tick %d pending ids keep their committed position", name, tick), same)
+            --a deleted object drops its pending move
+            local gone = list[1]
+            direct:delete(gone)
+            deferred:delete(gone)
+            objs[gone] = nil
+            check("user-039", sfmt("%s tick %d commit applies every live move once", name, tick),
+                deferred:commit() == moved_cnt - 1 and deferred:stats().pending_moves == 0)
+            local a, na = direct:get_positions(list, {})
+            b, nb = deferred:get_positions(list, {})
+            same = na == nb
+            for i = 1, na do
+                same = same and a.ids[i] == b.ids[i] and a.x[i] == b.x[i] and a.z[i] == b.z[i]
+            end
+            check("user-039", sfmt("%s tick %d committed positions are the last update", name, tick), same)
+            for _, p in ipairs(probes) do
+                check("user-039", sfmt("%s tick %d search after commit", name, tick), same_set(
+                    direct:search_circle_range_objs(p[1], p[2], p[3], 0, 0x7fffffff),
+                    deferred:search_circle_range_objs(p[1], p[2], p[3], 0, 0x7fffffff)))
+            end
+        end
+        --a search without the committed flag commits first
+        local id = next(objs)
+        direct:update(id, 7, 7)
+        deferred:update(id, 7, 7)
+        check("user-039", name .. " a plain search commits", deferred:search_circle_range_objs(7, 7, 1)[id]
+            and deferred:stats().pending_moves == 0)
+        deferred:set_deferred(false)
+        deferred:update(id, 190, 190)
+        check("user-039", name .. " direct again after set_deferred(false)",
+            deferred:search_circle_range_objs(190, 190, 1, 0, 0x7fffffff, true)[id])
+    end
+end
+
+--user-040 moving objects: a search at time t finds the objects at their extrapolated positions, checked against
+--a brute force over the same extrapolation away from the float rounding at the edge; advance moves them there
+do
+    local eps = 1e-3
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        if name == "quadtree" then
+            m:add(1, 50, 50, 1, 1)
+            check("user-040", "velocities need the grid backend", not pcall(m.set_velocity, m, 1, 1, 1))
+        else
+            local objs = {}
+            for id = 1, 500 do
+                local o = {x = 40 + math.random()*120, z = 40 + math.random()*120, r = math.random()*2, type = math.random(1, 3)}
+                m:add(id, o.x, o.z, o.r, o.type)
+                if id % 4 ~= 0 then --a quarter stands still
+                    o.vx, o.vz = math.random()*6 - 3, math.random()*6 - 3
+                    m:set_velocity(id, o.vx, o.vz)
+                else
+                    o.vx, o.vz = 0, 0
+                end
+                objs[id] = o
+            end
+            local st = m:stats()
+            check("user-040", name .. " moving count", st.moving == 375)
+            local q = m:query(1)
+            check("user-040", name .. " query reports the velocity", math.abs(q.vx - objs[1].vx) < eps
+                and math.abs(q.vz - objs[1].vz) < eps)
+            local now = 0
+            for step = 1, 4 do
+                for _ = 1, 30 do
+                    local t = now + math.random()*10 - 3
+                    local dt = t - now
+                    local x, z, r, type = math.random()*200, math.random()*200, math.random(5, 40), math.random(0, 3)
+                    local got = m:search_circle_range_objs(x, z, r, type, 0x7fffffff, false, t)
+                    local missed, extra = 0, 0
+                    for id, o in pairs(objs) do
+                        local dx, dz = o.x + o.vx*dt - x, o.z + o.vz*dt - z
+                        local d, reach = math.sqrt(dx*dx + dz*dz), r + o.r
+                        local want = o.type & type == type and d < reach
+                        if o.type & type ~= type or math.abs(d - reach) > eps then
+                            if want and not got[id] then
+                                missed = missed + 1
+                            elseif not want and got[id] then
+                                extra = extra + 1
+                            end
+                        end
+                    end
+                    check("user-040", sfmt("%s step %d search at %.2f matches the extrapolation", name, step, t),
+                        missed == 0 and extra == 0)
+                end
+                local t = now + math.random()*3
+                local x, z, r = math.random()*200, math.random()*200, 30
+                local ahead = m:search_circle_range_objs(x, z, r, 0, 0x7fffffff, false, t)
+                check("user-040", sfmt("%s step %d nothing stops inside the map", name, step), m:advance(t) == 0)
+                check("user-040", sfmt("%s step %d advance reports the time", name, step), m:stats().now == t)
+                for _, o in pairs(objs) do
+                    o.x, o.z = o.x + o.vx*(t - now), o.z + o.vz*(t - now)
+                end
+                now = t
+                local here = m:search_circle_range_objs(x, z, r, 0, 0x7fffffff)
+                local moved, seen = true, true
+                for id, o in pairs(objs) do
+                    local dx, dz = o.x - x, o.z - z
+                    local d, reach = math.sqrt(dx*dx + dz*dz), r + o.r
+                    if math.abs(d - reach) > eps then
+                        moved = moved and (here[id] ~= nil) == (d < reach)
+                        seen = seen and (ahead[id] ~= nil) == (d < reach)
+                    end
+                end
+                check("user-040", sfmt("%s step %d advance moves the objects", name, step), moved)
+                check("user-040", sfmt("%s step %d the search ahead saw them there", name, step), seen)
+            end
+            --an object whose path leaves the map stops at the edge
+            m:add(1000, 195, 100, 1, 1)
+            m:set_velocity(1000, 10, 0)
+            check("user-040", name .. " leaving the map stops", m:advance(now + 1) == 1 and m:query(1000).vx == nil)
+        end
+    end
+end
+
+--user-041 handles: a handle reaches its object like the id does until the object is deleted, then it is
+--stale and acts like an unknown id, also when its slot went to a new object
+do
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        local ref = areasearch.create(200, 200, 10, opt)
+        local handles = {}
+        local stale = {}
+        for id = 1, 300 do
+            local x, z, r, t = math.random()*200, math.random()*200, math.random()*2, math.random(1, 7)
+            handles[id] = m:add(id, x, z, r, t, true)
+            ref:add(id, x, z, r, t)
+        end
+        check("user-041", name .. " add returns an integer handle", math.type(handles[1]) == "integer")
+        check("user-041", name .. " handle(id) gives the same one", m:handle(150) == handles[150])
+        check("user-041", name .. " no handle for an unknown id", m:handle(1000) == nil)
+        for round = 1, 6 do
+            local updated = true
+            for id, h in pairs(handles) do
+                local op = math.random(10)
+                local x, z = math.random()*200, math.random()*200
+                if op <= 6 then
+                    local r, t = math.random()*2, math.random(1, 7)
+                    updated = updated and m:update_h(h, x, z, r, t) == true
+                    ref:update(id, x, z, r, t)
+                elseif op == 7 then
+                    m:delete_h(h)
+                    ref:delete(id)
+                    stale[#stale + 1] = h
+                    handles[id] = nil
+                elseif op == 8 then
+                    --the id comes back with a new handle, the old one may share its slot
+                    m:delete(id)
+                    ref:delete(id)
+                    stale[#stale + 1] = h
+                    handles[id] = m:add(id, x, z, 1, 1, true)
+                    ref:add(id, x, z, 1, 1)
+                    updated = updated and handles[id] ~= h
+                end
+            end
+            check("user-041", sfmt("%s round %d update_h and new handles", name, round), updated)
+            local ignored = true
+            for _, h in ipairs(stale) do
+                ignored = ignored and next(m:query_h(h)) == nil and m:update_h(h, 1, 1) == nil
+                m:delete_h(h)
+            end
+            check("user-041", sfmt("%s round %d stale handles act like unknown ids", name, round), ignored)
+            local cnt = 0
+            local same = true
+            for id, h in pairs(handles) do
+                cnt = cnt + 1
+                local a, b = m:query_h(h), ref:query(id)
+                same = same and a.id == id and a.x == b.x and a.z == b.z and a.type == b.type and a.radius == b.radius
+            end
+            check("user-041", sfmt("%s round %d query_h matches query", name, round), same)
+            check("user-041", sfmt("%s round %d stale handles leave the live objects", name, round),
+                m:stats().objects == cnt)
+            for _ = 1, 10 do
+                local x, z, r = math.random()*200, math.random()*200, math.random(5, 50)
+                check("user-041", sfmt("%s round %d search", name, round), same_set(
+                    m:search_circle_range_objs(x, z, r, 0, 0x7fffffff), ref:search_circle_range_objs(x, z, r, 0, 0x7fffffff)))
+            end
+        end
+        check("user-041", name .. " a made up handle is stale", next(m:query_h(12345 << 32 | 3)) == nil)
+        if name ~= "quadtree" then
+            m:regrid(16)
+        end
+        local id, h = next(handles)
+        check("user-041", name .. " handles survive a regrid", m:query_h(h).id == id)
+    end
+end
+
+--user-043 columns: the column searches hold the hits of the set searches with the float positions, radius and
+--type that get_positions gives for the same ids, and the squared distance to the center when asked
+do
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        local objs = fill(m, 800, 200, 200)
+        local out = {dist2 = {}}
+        for i = 1, 30 do
+            local x, z, r, type = math.random()*200, math.random()*200, math.random(5, 60), math.random(0, 3)
+            local a = math.random()*2*math.pi
+            local dx, dz = math.cos(a), math.sin(a)
+            local n, want
+            if i % 3 == 0 then
+                out, n = m:search_circle_columns(x, z, r, type, 0x7fffffff, out)
+                want = m:search_circle_range_objs(x, z, r, type, 0x7fffffff)
+            elseif i % 3 == 1 then
+                out, n = m:search_rect_columns(x, z, dx, dz, r, r/3, type, 0x7fffffff, out)
+                want = m:search_rect_range_objs(x, z, dx, dz, r, r/3, type, 0x7fffffff)
+            else
+                out, n = m:search_sector_columns(x, z, dx, dz, 90, r, type, 0x7fffffff, out)
+                want = m:search_sector_range_objs(x, z, dx, dz, 90, r, type, 0x7fffffff)
+            end
+            check("user-043", name .. " n", n == out.n)
+            check("user-043", name .. " columns hold the search hits", same_set(set_of(out.ids, n), want))
+            local ok = true
+            for k = 1, n do
+                local o = objs[out.ids[k]]
+                local ddx, ddz = out.x[k] - x, out.z[k] - z
+                ok = ok and math.abs(out.x[k] - o.x) < 1e-4 and math.abs(out.z[k] - o.z) < 1e-4
+                    and math.abs(out.radius[k] - o.r) < 1e-6 and out.type[k] == o.type
+                    and math.abs(out.dist2[k] - (ddx*ddx + ddz*ddz)) < 1e-2
+            end
+            check("user-043", name .. " columns hold the float position, radius, type and dist2", ok)
+            local p, pn = m:get_positions({table.unpack(out.ids, 1, n)}, {})
+            ok = pn == n
+            for k = 1, pn do
+                ok = ok and p.ids[k] == out.ids[k] and p.x[k] == out.x[k] and p.z[k] == out.z[k]
+                    and p.radius[k] == out.radius[k] and p.type[k] == out.type[k]
+            end
+            check("user-043", name .. " get_positions gives the same columns", ok)
+        end
+        local few = m:search_circle_columns(100, 100, 1e-3, 0, 0x7fffffff, out)
+        check("user-043", name .. " reused out reports the new n", few == out and out.n <= 1)
+        local p, pn = m:get_positions({1, 100000, 2}, {})
+        check("user-043", name .. " unknown ids are skipped", pn == 2 and p.ids[1] == 1 and p.ids[2] == 2)
+        local plain = m:search_circle_columns(100, 100, 30, 0, 0x7fffffff, {})
+        check("user-043", name .. " no dist2 unless asked", plain.dist2 == nil)
+    end
+end
+
+--user-044 filters: a filtered search returns the hits of the plain search that pass the same predicate written
+--in Lua, also for the wide types and radii that compact towers cannot pack
+do
+    local function random_filter()
+        local def = {all = math.random(0, 3) == 0 and 1 or 0, any = math.random(0, 2) == 0 and 0 or math.random(1, 15),
+            none = math.random(0, 1) == 0 and 0 or math.random(1, 31) << math.random(0, 1)}
+        if math.random(0, 1) == 0 then
+            def.exclude = {}
+            for k = 1, math.random(1, 16) do
+                def.exclude[k] = math.random(1, 600)
+            end
+        end
+        if math.random(0, 1) == 0 then
+            def.attr = {}
+            def.attr[math.random(1, 2)] = {math.random(0, 1) == 0 and math.random(0, 200)/4 or nil,
+                math.random(0, 1) == 0 and math.random(100, 400)/4 or nil}
+        end
+        return def
+    end
+    local function pass(def, o, id)
+        if o.type & def.all ~= def.all or (def.any ~= 0 and o.type & def.any == 0) or o.type & def.none ~= 0 then
+            return false
+        end
+        for _, e in ipairs(def.exclude or {}) do
+            if e == id then
+                return false
+            end
+        end
+        for slot, range in pairs(def.attr or {}) do
+            local v = o.attr[slot]
+            if (range[1] and v < range[1]) or (range[2] and v > range[2]) then
+                return false
+            end
+        end
+        return true
+    end
+    local function expect(def, objs, plain)
+        local want = {}
+        for id in pairs(plain) do
+            if pass(def, objs[id], id) then
+                want[id] = true
+            end
+        end
+        return want
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, 10, opt)
+        local objs = fill(m, 600, 200, 200)
+        for id = 1, 600, 37 do --types past 16 bits and radii past the packed range
+            objs[id].type = objs[id].type | 1 << 20
+            objs[id].r = 25
+            m:update(id, objs[id].x, objs[id].z, objs[id].r, objs[id].type)
+        end
+        for id, o in pairs(objs) do
+            o.attr = {math.random(0, 400)/4, math.random(0, 400)/4}
+            m:set_attr(id, 1, o.attr[1])
+            m:set_attr(id, 2, o.attr[2])
+        end
+        for _ = 1, 60 do
+            local def = random_filter()
+            local f = areasearch.filter(def)
+            local x, z, r = math.random()*200, math.random()*200, math.random(10, 80)
+            local a = math.random()*2*math.pi
+            local dx, dz = math.cos(a), math.sin(a)
+            check("user-044", name .. " circle", same_set(m:search_circle_range_objs(x, z, r, f, 0x7fffffff),
+                expect(def, objs, m:search_circle_range_objs(x, z, r, 0, 0x7fffffff))))
+            check("user-044", name .. " rect", same_set(m:search_rect_range_objs(x, z, dx, dz, r, r/2, f, 0x7fffffff),
+                expect(def, objs, m:search_rect_range_objs(x, z, dx, dz, r, r/2, 0, 0x7fffffff))))
+            check("user-044", name .. " sector", same_set(m:search_sector_range_objs(x, z, dx, dz, 120, r, f, 0x7fffffff),
+                expect(def, objs, m:search_sector_range_objs(x, z, dx, dz, 120, r, 0, 0x7fffffff))))
+            local out, n = m:search_circle_columns(x, z, r, f, 0x7fffffff, {})
+            check("user-044", name .. " columns", same_set(set_of(out.ids, n),
+                expect(def, objs, m:search_circle_range_objs(x, z, r, 0, 0x7fffffff))))
+            check("user-044", name .. " nearest", same_set(set_of(m:search_circle_nearest(x, z, r, f, 0x7fffffff)),
+                expect(def, objs, m:search_circle_range_objs(x, z, r, 0, 0x7fffffff))))
+            local e = {"diff", {"circle", x, z, r}, {"circle", x, z, r/3}}
+            check("user-044", name .. " compound", same_set(m:search_compound(e, f, 0x7fffffff),
+                expect(def, objs, m:search_compound(e, 0, 0x7fffffff))))
+            local id = next(m:search_circle_range_objs(x, z, r, f, 0x7fffffff))
+            if id then
+                f:set_exclude(id)
+                def.exclude = {id}
+                check("user-044", name .. " set_exclude", same_set(m:search_circle_range_objs(x, z, r, f, 0x7fffffff),
+                    expect(def, objs, m:search_circle_range_objs(x, z, r, 0, 0x7fffffff))))
+            end
+        end
+        check("user-044", name .. " query returns the attributes", m:query(5).attr[2] == objs[5].attr[2])
+    end
+end
+
+--user-048 changed towers: the towers reported after a version are the cells the adds, deletes, moves, radius and
+--type changes since then touched, with or without the change log, and the towers a full walk finds newer than it
+do
+    local g = 10
+    local function cell(x, z)
+        return math.floor(z/g) .. ":" .. math.floor(x/g)
+    end
+    local function changed(m, v, region)
+        local out, n = m:changed_towers(v, region)
+        local set, versions = {}, {}
+        for i = 1, n do
+            local k = out.rows[i] .. ":" .. out.cols[i]
+            set[k] = true
+            versions[k] = out.versions[i]
+        end
+        return set, versions
+    end
+    for name, opt in pairs(backends) do
+        local m = areasearch.create(200, 200, g, opt)
+        local objs = fill(m, 400, 199, 199)
+        if name == "quadtree" then
+            local out, err = m:changed_towers(0)
+            check("user-048", "changed_towers needs the grid backend", out == nil and err:find("grid backend"))
+        else
+            for _, cap in ipairs({0, 64, 4096}) do
+                m:set_change_log(cap)
+                local v = m:change_version()
+                local want = {}
+                local last
+                for _ = 1, math.random(5, 120) do
+                    local id = math.random(1, 400)
+                    local o = objs[id]
+                    local op = math.random(6)
+                    if not o then
+                        o = {x = math.random()*199, z = math.random()*199, r = 1, type = 1}
+                        m:add(id, o.x, o.z, o.r, o.type)
+                        objs[id] = o
+                    elseif op == 1 then
+                        m:delete(id)
+                        objs[id] = nil
+                    elseif op == 2 then
+                        o.r = o.r + 1
+                        m:update(id, o.x, o.z, o.r)
+                    elseif op == 3 then
+                        m:set_attr(id, 1, math.random()) --not a tower change
+                        goto next
+                    else
+                        want[cell(o.x, o.z)] = true
+                        o.x = math.max(0, math.min(199, o.x + math.random()*20 - 10))
+                        o.z = math.max(0, math.min(199, o.z + math.random()*20 - 10))
+                        m:update(id, o.x, o.z)
+                    end
+                    want[cell(o.x, o.z)] = true
+                    last = cell(o.x, o.z)
+                    ::next::
+                end
+                local got, versions = changed(m, v)
+                check("user-048", sfmt("%s log %d changed towers are the touched cells", name, cap), same_set(got, want))
+                local full = {}
+                local all, all_versions = changed(m, 0)
+                for k in pairs(all) do
+                    if all_versions[k] > v then
+                        full[k] = true
+                    end
+                end
+                check("user-048", sfmt("%s log %d matches a full walk", name, cap), same_set(got, full))
+                local newest = true
+                for _, ver in pairs(versions) do
+                    newest = newest and ver <= versions[last] and ver <= m:change_version()
+                end
+                check("user-048", sfmt("%s log %d the last change has the newest version", name, cap), last == nil or newest)
+                local region = {"rect", 60, 60, 0, 1, 35, 25}
+                local inside = {}
+                for k in pairs(want) do
+                    local r, c = k:match("(%d+):(%d+)")
+                    r, c = tonumber(r), tonumber(c)
+                    if r >= (60 - 25) // g and r <= (60 + 25) // g and c >= (60 - 35) // g and c <= (60 + 35) // g then
+                        inside[k] = true
+                    end
+                end
+                check("user-048", sfmt("%s log %d region", name, cap), same_set(changed(m, v, region), inside))
+                check("user-048", sfmt("%s log %d nothing after the current version", name, cap),
+                    next((changed(m, m:change_version()))) == nil)
+            end
+            local v = m:change_version()
+            m:regrid(20)
+            local every = {}
+            for _, o in pairs(objs) do
+                every[math.floor(o.z/20) .. ":" .. math.floor(o.x/20)] = true
+            end
+            check("user-048", name .. " a regrid makes every tower new", same_set(changed(m, v), every))
+        end
+    end
+end
+
+collectgarbage("collect")
+print(sfmt("features ok, %d checks", checks))
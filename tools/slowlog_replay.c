@@ -0,0 +1,66 @@
+#include "divgrid.h"
+#include "search.h"
+#include "slowlog.h"
+#include "histogram.h"
+
+static const char* shape_names[] = {"", "circle", "rect", "sector"};
+
+static void
+count_hit(void* ud, object* obj) {
+    (*(int*)ud)++;
+}
+
+static int
+cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int
+main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s slowlog.bin [repeat] [grid_size]\n", argv[0]);
+        return 1;
+    }
+    int repeat = argc > 2 ? atoi(argv[2]) : 10;
+    if (repeat <= 0) {
+        repeat = 1;
+    }
+    slowlog_file sf;
+    if (!slowlog_load(argv[1], &sf)) {
+        fprintf(stderr, "cannot load %s\n", argv[1]);
+        return 1;
+    }
+    int grid_size = argc > 3 ? atoi(argv[3]) : sf.grid_size;
+    map * m = map_new(sf.max_x, sf.max_z, grid_size);
+    int i,j;
+    for (i=0; i<sf.obj_cnt; i++) {
+        slowlog_obj * o = &sf.objs[i];
+        map_add_object(m, o->id, o->x, o->z, o->radius, o->type);
+    }
+    printf("map %dx%d grid_size=%d (recorded %d) objs=%d queries=%d repeat=%d\n",
+        sf.max_x, sf.max_z, grid_size, sf.grid_size, sf.obj_cnt, sf.query_cnt, repeat);
+    printf("%4s %-7s %10s %10s %10s %8s %8s %8s %8s\n", "#", "shape", "rec_ns", "min_ns", "p50_ns", "towers", "tested", "hits", "replay");
+    uint64_t * ns = malloc(repeat*sizeof(uint64_t));
+    for (i=0; i<sf.query_cnt; i++) {
+        slow_query * q = &sf.queries[i];
+        shape s;
+        int hits = 0;
+        for (j=0; j<repeat; j++) {
+            hits = 0;
+            uint64_t t0 = hist_now();
+            shape_from_slow_query(&s, q);
+            map_search(m, &s, q->type, q->limit_cnt, count_hit, &hits);
+            ns[j] = hist_now() - t0;
+        }
+        qsort(ns, repeat, sizeof(uint64_t), cmp_u64);
+        printf("%4d %-7s %10llu %10llu %10llu %8d %8d %8d %8d\n", i, shape_names[q->kind],
+            (unsigned long long)q->ns, (unsigned long long)ns[0], (unsigned long long)ns[repeat/2],
+            q->towers, q->tested, q->hits, hits);
+    }
+    free(ns);
+    map_delete(m);
+    slowlog_file_free(&sf);
+    return 0;
+}
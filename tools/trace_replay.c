@@ -0,0 +1,120 @@
+#include "divgrid.h"
+#include "search.h"
+#include "histogram.h"
+#include "trace.h"
+#include <unistd.h>
+
+static const char* op_names[TRACE_OP_MAX] = {"", "add", "update", "delete", "search_circle", "search_rect", "search_sector"};
+
+static void
+count_hit(void* ud, object* obj) {
+    (*(uint64_t*)ud)++;
+}
+
+static void
+apply(map* m, const trace_op* op, uint64_t* hits) {
+    const float * a = op->args;
+    shape s;
+    switch (op->op) {
+    case TRACE_ADD:
+        map_add_object(m, op->id, a[0], a[1], a[2], op->type);
+        break;
+    case TRACE_UPDATE: {
+        object * obj = map_query_object(m, op->id);
+        if (obj) {
+            if (op->has_radius) {
+                map_set_object_radius(m, obj, a[2]);
+            }
+            if (op->has_type) {
+                map_set_object_type(m, obj, op->type);
+            }
+            map_update_object(m, obj, a[0], a[1]);
+        }
+        break;
+    }
+    case TRACE_DELETE:
+        if (map_query_object(m, op->id)) {
+            map_delete_object(m, op->id);
+        }
+        break;
+    case TRACE_SEARCH_CIRCLE:
+        shape_circle(&s, a[0], a[1], a[2]);
+        map_search(m, &s, op->type, op->limit_cnt, count_hit, hits);
+        break;
+    case TRACE_SEARCH_RECT:
+        shape_rect(&s, a[0], a[1], a[2], a[3], a[4], a[5]);
+        map_search(m, &s, op->type, op->limit_cnt, count_hit, hits);
+        break;
+    case TRACE_SEARCH_SECTOR:
+        shape_sector(&s, a[0], a[1], a[2], a[3], a[4], a[5]);
+        map_search(m, &s, op->type, op->limit_cnt, count_hit, hits);
+        break;
+    }
+}
+
+int
+main(int argc, char** argv) {
+    const char* path = NULL;
+    int grid_size = 0;
+    bool paced = false;
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            paced = true;
+        }else if (strcmp(argv[i], "-g") == 0 && i+1 < argc) {
+            grid_size = atoi(argv[++i]);
+        }else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-p] [-g grid_size] trace.bin\n"
+            "  -p  replay at the recorded pacing instead of full speed\n", argv[0]);
+        return 1;
+    }
+    trace_reader r;
+    if (!trace_reader_open(&r, path)) {
+        fprintf(stderr, "cannot load %s\n", path);
+        return 1;
+    }
+    if (grid_size <= 0) {
+        grid_size = r.grid_size;
+    }
+    map * m = map_new(r.max_x, r.max_z, grid_size);
+    histogram * hist = calloc(TRACE_OP_MAX, sizeof(histogram));
+    uint64_t hits = 0;
+    uint64_t cnt = 0;
+    trace_op op;
+    uint64_t start = hist_now();
+    while (trace_read(&r, &op)) {
+        if (paced) {
+            uint64_t now = hist_now() - start;
+            if (op.ns > now) {
+                usleep((op.ns - now)/1000);
+            }
+        }
+        uint64_t t0 = hist_now();
+        apply(m, &op, &hits);
+        hist_record(&hist[op.op], hist_now() - t0);
+        cnt++;
+    }
+    uint64_t elapsed = hist_now() - start;
+    printf("trace %s: map %dx%d grid_size=%d (recorded %d) %s\n", path, r.max_x, r.max_z, grid_size, r.grid_size,
+        paced ? "paced" : "full speed");
+    printf("ops=%llu elapsed=%.3fs recorded=%.3fs %.0f ops/s search_hits=%llu\n", (unsigned long long)cnt,
+        elapsed/1e9, r.ns/1e9, cnt/(elapsed/1e9 + 1e-12), (unsigned long long)hits);
+    printf("  %-14s %10s %10s %10s %10s %10s\n", "op", "count", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+    for (i=1; i<TRACE_OP_MAX; i++) {
+        histogram * h = &hist[i];
+        if (h->count == 0) {
+            continue;
+        }
+        printf("  %-14s %10llu %10llu %10llu %10llu %10llu\n", op_names[i], (unsigned long long)h->count,
+            (unsigned long long)hist_percentile(h, 0.5), (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999), (unsigned long long)h->max);
+    }
+    free(hist);
+    map_delete(m);
+    trace_reader_close(&r);
+    return 0;
+}